@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) Todd A. Fisher
+ *
+ * Shared fragment cache
+ */
+#include "ngx_esi_cache.h"
+#include "ngx_esi_shm.h"
+
+static ngx_int_t
+ngx_esi_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+  ngx_esi_cache_t  *ocache = data;
+
+  size_t            len;
+  ngx_esi_cache_t  *cache;
+
+  cache = shm_zone->data;
+
+  if (ocache) {
+    cache->sh = ocache->sh;
+    cache->shpool = ocache->shpool;
+    return NGX_OK;
+  }
+
+  cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+  if (shm_zone->shm.exists) {
+    cache->sh = cache->shpool->data;
+    return NGX_OK;
+  }
+
+  cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_esi_cache_sh_t));
+  if (cache->sh == NULL) {
+    return NGX_ERROR;
+  }
+
+  cache->shpool->data = cache->sh;
+
+  ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                  ngx_rbtree_insert_value);
+  ngx_queue_init(&cache->sh->lru);
+
+  len = sizeof(" in esi cache zone \"\"") + shm_zone->shm.name.len;
+
+  cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+  if (cache->shpool->log_ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_sprintf(cache->shpool->log_ctx, " in esi cache zone \"%V\"%Z",
+              &shm_zone->shm.name);
+
+  /* the cache is expected to fill up, old fragments make room for new ones */
+  cache->shpool->log_nomem = 0;
+
+  return NGX_OK;
+}
+
+/* esi_cache_zone name:size */
+char *
+ngx_esi_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_esi_main_conf_t *emcf = conf;
+
+  u_char           *p;
+  ssize_t           size;
+  ngx_str_t        *value, name, s;
+  ngx_esi_cache_t  *cache;
+
+  if (emcf->cache_zone) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+
+  p = (u_char *) ngx_strchr(value[1].data, ':');
+  if (p == NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid esi cache zone \"%V\", expected name:size", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  name.data = value[1].data;
+  name.len = p - value[1].data;
+
+  s.data = p + 1;
+  s.len = value[1].data + value[1].len - s.data;
+
+  size = ngx_parse_size(&s);
+  if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid esi cache zone size \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  cache = ngx_pcalloc(cf->pool, sizeof(ngx_esi_cache_t));
+  if (cache == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  emcf->cache_zone = ngx_shared_memory_add(cf, &name, size,
+                                           &ngx_http_esi_filter_module);
+  if (emcf->cache_zone == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  if (emcf->cache_zone->data) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "esi zone \"%V\" is already in use", &name);
+    return NGX_CONF_ERROR;
+  }
+
+  emcf->cache_zone->init = ngx_esi_cache_init_zone;
+  emcf->cache_zone->data = cache;
+
+  return NGX_CONF_OK;
+}
+
+static void
+ngx_esi_cache_free_node(ngx_esi_cache_t *cache, ngx_esi_cache_node_t *fn)
+{
+  ngx_queue_remove(&fn->queue);
+  ngx_rbtree_delete(&cache->sh->rbtree, &fn->node);
+  if (fn->body) {
+    ngx_slab_free_locked(cache->shpool, fn->body);
+  }
+  ngx_slab_free_locked(cache->shpool, fn);
+}
+
+/* allocate, evicting the least recently used fragments until it fits */
+static void *
+ngx_esi_cache_alloc(ngx_esi_cache_t *cache, size_t size, ngx_esi_cache_node_t *keep)
+{
+  void                  *p;
+  ngx_queue_t           *q;
+  ngx_esi_cache_node_t  *fn;
+
+  for ( ;; ) {
+    p = ngx_slab_alloc_locked(cache->shpool, size);
+    if (p || ngx_queue_empty(&cache->sh->lru)) {
+      return p;
+    }
+
+    q = ngx_queue_last(&cache->sh->lru);
+    fn = ngx_queue_data(q, ngx_esi_cache_node_t, queue);
+
+    if (fn == keep) {
+      if (ngx_queue_prev(q) == ngx_queue_sentinel(&cache->sh->lru)) {
+        return NULL;
+      }
+      fn = ngx_queue_data(ngx_queue_prev(q), ngx_esi_cache_node_t, queue);
+    }
+
+    ngx_esi_cache_free_node(cache, fn);
+  }
+}
+
+ngx_esi_cache_status_e
+ngx_esi_cache_get(ngx_shm_zone_t *zone, ngx_str_t *key, ngx_pool_t *pool,
+                  ngx_chain_t **body, ngx_uint_t *refresh, ngx_uint_t *flags)
+{
+  time_t                   now;
+  uint32_t                 hash;
+  ngx_buf_t               *b;
+  ngx_chain_t             *cl;
+  ngx_esi_cache_t         *cache = zone->data;
+  ngx_esi_cache_node_t    *fn;
+  ngx_esi_cache_status_e   status;
+
+  *body = NULL;
+  if (refresh) {
+    *refresh = 0;
+  }
+  if (flags) {
+    *flags = 0;
+  }
+
+  now = ngx_time();
+  hash = ngx_crc32_short(key->data, key->len);
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  fn = (ngx_esi_cache_node_t *) ngx_esi_shm_lookup(&cache->sh->rbtree, key, hash,
+                                                    offsetof(ngx_esi_cache_node_t, len));
+  if (fn == NULL) {
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+    return NGX_ESI_CACHE_MISS;
+  }
+
+  ngx_queue_remove(&fn->queue);
+  ngx_queue_insert_head(&cache->sh->lru, &fn->queue);
+
+  if (now < fn->fresh) {
+    status = NGX_ESI_CACHE_FRESH;
+  }
+  else if (now < fn->stale) {
+    status = NGX_ESI_CACHE_STALE;
+  }
+  else {
+    status = NGX_ESI_CACHE_EXPIRED;
+  }
+
+  if (refresh && status != NGX_ESI_CACHE_FRESH && fn->updating <= now) {
+    fn->updating = now + NGX_ESI_CACHE_UPDATING;
+    *refresh = 1;
+  }
+
+  if (flags) {
+    *flags = fn->flags;
+  }
+
+  if (fn->size) {
+    b = ngx_create_temp_buf(pool, fn->size);
+    cl = ngx_alloc_chain_link(pool);
+    if (b == NULL || cl == NULL) {
+      ngx_shmtx_unlock(&cache->shpool->mutex);
+      return NGX_ESI_CACHE_MISS;
+    }
+    b->last = ngx_cpymem(b->pos, fn->body, fn->size);
+    cl->buf = b;
+    cl->next = NULL;
+    *body = cl;
+  }
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+
+  return status;
+}
+
+ngx_int_t
+ngx_esi_cache_put(ngx_shm_zone_t *zone, ngx_str_t *key, ngx_chain_t *body,
+                  time_t fresh, time_t stale, ngx_uint_t flags)
+{
+  size_t                 size;
+  time_t                 now;
+  u_char                *p;
+  uint32_t               hash;
+  ngx_chain_t           *cl;
+  ngx_esi_cache_t       *cache = zone->data;
+  ngx_esi_cache_node_t  *fn;
+
+  size = 0;
+  for (cl = body; cl; cl = cl->next) {
+    if (!ngx_buf_in_memory(cl->buf)) {
+      return NGX_DECLINED;
+    }
+    size += ngx_buf_size(cl->buf);
+  }
+
+  now = ngx_time();
+  hash = ngx_crc32_short(key->data, key->len);
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  fn = (ngx_esi_cache_node_t *) ngx_esi_shm_lookup(&cache->sh->rbtree, key, hash,
+                                                    offsetof(ngx_esi_cache_node_t, len));
+  if (fn == NULL) {
+    fn = ngx_esi_cache_alloc(cache, offsetof(ngx_esi_cache_node_t, name) + key->len, NULL);
+    if (fn == NULL) {
+      ngx_shmtx_unlock(&cache->shpool->mutex);
+      return NGX_ERROR;
+    }
+
+    ngx_memzero(fn, offsetof(ngx_esi_cache_node_t, name));
+    fn->node.key = hash;
+    fn->len = (u_short) key->len;
+    ngx_memcpy(fn->name, key->data, key->len);
+    ngx_rbtree_insert(&cache->sh->rbtree, &fn->node);
+  }
+  else {
+    ngx_queue_remove(&fn->queue);
+    if (fn->body) {
+      ngx_slab_free_locked(cache->shpool, fn->body);
+      fn->body = NULL;
+    }
+  }
+
+  ngx_queue_insert_head(&cache->sh->lru, &fn->queue);
+
+  fn->size = 0;
+  fn->flags = flags;
+  fn->updating = 0;
+  fn->fresh = now + fresh;
+  fn->stale = now + fresh + stale;
+
+  if (size) {
+    fn->body = ngx_esi_cache_alloc(cache, size, fn);
+    if (fn->body == NULL) {
+      ngx_esi_cache_free_node(cache, fn);
+      ngx_shmtx_unlock(&cache->shpool->mutex);
+      return NGX_ERROR;
+    }
+
+    p = fn->body;
+    for (cl = body; cl; cl = cl->next) {
+      p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    }
+    fn->size = size;
+  }
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+
+  return NGX_OK;
+}
+
+/*
+ * serve a cached fragment, whatever its age, to the client side fallback of an
+ * include that missed its deadline. The key is the rest of the request uri
+ * after the location prefix, escaped as the fallback script requests it
+ */
+static ngx_int_t
+ngx_esi_cache_handler(ngx_http_request_t *r)
+{
+  u_char                    *dst, *src;
+  ngx_int_t                  rc;
+  ngx_str_t                  key;
+  ngx_uint_t                 flags;
+  ngx_buf_t                 *b;
+  ngx_chain_t               *body, out;
+  ngx_esi_cache_status_e     status;
+  ngx_http_core_loc_conf_t  *clcf;
+  ngx_http_esi_main_conf_t  *emcf;
+
+  if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  emcf = ngx_http_get_module_main_conf(r, ngx_http_esi_filter_module);
+  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+  if (emcf->cache_zone == NULL || r->unparsed_uri.len <= clcf->name.len) {
+    return NGX_HTTP_NOT_FOUND;
+  }
+
+  src = r->unparsed_uri.data + clcf->name.len;
+
+  key.data = ngx_pnalloc(r->pool, r->unparsed_uri.len - clcf->name.len);
+  if (key.data == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  dst = key.data;
+  ngx_unescape_uri(&dst, &src, r->unparsed_uri.len - clcf->name.len, 0);
+  key.len = dst - key.data;
+
+  /* a fragment keyed on someone's cookie or query is theirs alone */
+  status = ngx_esi_cache_get(emcf->cache_zone, &key, r->pool, &body, NULL, &flags);
+  if (status == NGX_ESI_CACHE_MISS || (flags & NGX_ESI_CACHE_PRIVATE)) {
+    return NGX_HTTP_NOT_FOUND;
+  }
+
+  if (body == NULL) {
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    out.buf = b;
+    out.next = NULL;
+    body = &out;
+  }
+
+  b = body->buf;
+  b->last_buf = (r == r->main) ? 1 : 0;
+  b->last_in_chain = 1;
+
+  ngx_str_set(&r->headers_out.content_type, "text/html");
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = ngx_buf_size(b);
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+
+  return ngx_http_output_filter(r, body);
+}
+
+/* esi_fragment, serve the fragment cache for esi_client_fallback */
+char *
+ngx_esi_cache_fragment(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_core_loc_conf_t  *clcf;
+
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = ngx_esi_cache_handler;
+
+  return NGX_CONF_OK;
+}
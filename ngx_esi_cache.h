@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) Todd A. Fisher
+ */
+#ifndef NGX_ESI_CACHE_H
+#define NGX_ESI_CACHE_H
+
+#include "ngx_http_esi_filter_module.h"
+
+/*
+ * Fragment cache shared by all workers through the esi_cache_zone.
+ *
+ * Entries are keyed on the include src and keep a copy of the fragment body.
+ * An entry is fresh for max-age seconds, then stale for the "+stale" part of
+ * max-age (e.g. max-age='600+600') and expired after that, expired entries are
+ * kept around until the zone needs the room for something else
+ */
+typedef enum {
+  NGX_ESI_CACHE_MISS = 0,
+  NGX_ESI_CACHE_FRESH,
+  NGX_ESI_CACHE_STALE,
+  NGX_ESI_CACHE_EXPIRED
+} ngx_esi_cache_status_e;
+
+/* flags an entry is stored with */
+#define NGX_ESI_CACHE_MARKUP   0x01  /* body holds esi markup, it is parsed when included */
+#define NGX_ESI_CACHE_PRIVATE  0x02  /* key was built from request variables, esi_fragment does not serve it */
+
+/* how long a worker may spend refreshing an entry before another one tries */
+#define NGX_ESI_CACHE_UPDATING 10
+
+typedef struct {
+  ngx_rbtree_node_t  node;
+  ngx_queue_t        queue;    /* least recently used last */
+  time_t             fresh;    /* served without a fetch until */
+  time_t             stale;    /* served while being refreshed until */
+  time_t             updating; /* a worker is refreshing the entry until */
+  size_t             size;
+  ngx_uint_t         flags;    /* NGX_ESI_CACHE_MARKUP, NGX_ESI_CACHE_PRIVATE */
+  u_char            *body;
+  u_short            len;
+  u_char             name[1];
+} ngx_esi_cache_node_t;
+
+typedef struct {
+  ngx_rbtree_t       rbtree;
+  ngx_rbtree_node_t  sentinel;
+  ngx_queue_t        lru;
+} ngx_esi_cache_sh_t;
+
+typedef struct {
+  ngx_esi_cache_sh_t  *sh;
+  ngx_slab_pool_t     *shpool;
+} ngx_esi_cache_t;
+
+char *ngx_esi_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_esi_cache_fragment(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * look up key, *body is set to a copy of the cached fragment allocated from pool.
+ * *refresh is set when the caller should fetch the fragment again to update the
+ * entry, only one caller is asked to do so at a time. Without refresh the entry
+ * is only read. *flags, when given, is what the body was stored with
+ */
+ngx_esi_cache_status_e ngx_esi_cache_get(ngx_shm_zone_t *zone, ngx_str_t *key,
+                                         ngx_pool_t *pool, ngx_chain_t **body,
+                                         ngx_uint_t *refresh, ngx_uint_t *flags);
+/* markup is found once by the caller, a body stored without NGX_ESI_CACHE_MARKUP is never parsed again */
+ngx_int_t ngx_esi_cache_put(ngx_shm_zone_t *zone, ngx_str_t *key, ngx_chain_t *body,
+                            time_t fresh, time_t stale, ngx_uint_t flags);
+
+#endif
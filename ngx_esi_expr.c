@@ -0,0 +1,461 @@
+/*
+ * Copyright (C) Todd A. Fisher
+ *
+ * ESI 1.0 expressions
+ */
+#include "ngx_esi_expr.h"
+
+typedef struct {
+  u_char               *p;
+  u_char               *last;
+  ngx_esi_expr_code_t  *code;   /* NULL while sizing the code */
+  ngx_uint_t            n;
+  ngx_uint_t            depth;  /* operands on the stack at this point */
+  ngx_uint_t            max;
+  ngx_uint_t            nest;   /* open parentheses */
+  unsigned              error:1;
+} ngx_esi_expr_compiler_t;
+
+#define NGX_ESI_EXPR_TYPE_STR   0
+#define NGX_ESI_EXPR_TYPE_NUM   1
+#define NGX_ESI_EXPR_TYPE_BOOL  2
+
+typedef struct {
+  ngx_str_t   str;
+  double      num;
+  ngx_uint_t  type;
+} ngx_esi_expr_value_t;
+
+static ngx_esi_expr_t  *ngx_esi_expr_cache[NGX_ESI_EXPR_CACHE];
+
+static void ngx_esi_expr_or(ngx_esi_expr_compiler_t *c);
+
+
+static void
+ngx_esi_expr_space(ngx_esi_expr_compiler_t *c)
+{
+  while (c->p < c->last && (*c->p == ' ' || *c->p == '\t' || *c->p == '\r' || *c->p == '\n')) {
+    c->p++;
+  }
+}
+
+static ngx_esi_expr_code_t *
+ngx_esi_expr_emit(ngx_esi_expr_compiler_t *c, ngx_esi_expr_op_e op)
+{
+  ngx_esi_expr_code_t  *code = NULL;
+
+  switch (op) {
+  case NGX_ESI_EXPR_STR:
+  case NGX_ESI_EXPR_NUM:
+  case NGX_ESI_EXPR_VAR:
+    if (++c->depth > c->max) {
+      c->max = c->depth;
+    }
+    break;
+  case NGX_ESI_EXPR_NOT:
+    break;
+  default: /* binary, two operands make one */
+    c->depth--;
+    break;
+  }
+
+  if (c->code) {
+    code = &c->code[c->n];
+    code->op = op;
+  }
+  c->n++;
+
+  return code;
+}
+
+/* 12, -3, 1.5 */
+static ngx_int_t
+ngx_esi_expr_number(u_char *p, u_char *last, u_char **end, double *num)
+{
+  double      n, scale;
+  u_char     *start;
+  ngx_uint_t  neg = 0;
+
+  if (p < last && *p == '-') {
+    neg = 1;
+    p++;
+  }
+
+  start = p;
+  n = 0;
+
+  while (p < last && *p >= '0' && *p <= '9') {
+    n = n * 10 + (*p++ - '0');
+  }
+
+  if (p < last && *p == '.') {
+    p++;
+    for (scale = 0.1; p < last && *p >= '0' && *p <= '9'; scale /= 10) {
+      n += (*p++ - '0') * scale;
+    }
+  }
+
+  if (p == start) {
+    return NGX_ERROR;
+  }
+
+  *end = p;
+  *num = neg ? -n : n;
+
+  return NGX_OK;
+}
+
+static void
+ngx_esi_expr_primary(ngx_esi_expr_compiler_t *c)
+{
+  u_char               *end;
+  double                num;
+  ngx_esi_var_op_t      var;
+  ngx_esi_expr_code_t  *code;
+
+  ngx_esi_expr_space(c);
+
+  if (c->p == c->last) {
+    c->error = 1;
+    return;
+  }
+
+  switch (*c->p) {
+
+  case '(':
+    if (++c->nest > NGX_ESI_EXPR_STACK) {
+      c->error = 1;
+      return;
+    }
+    c->p++;
+    ngx_esi_expr_or(c);
+    ngx_esi_expr_space(c);
+    if (c->p == c->last || *c->p != ')') {
+      c->error = 1;
+      return;
+    }
+    c->p++;
+    c->nest--;
+    return;
+
+  case '\'':
+    /*
+     * 'literal', the attribute parser trims a quote closing the whole test
+     * so a literal may run to the end of the text
+     */
+    end = ngx_strlchr(c->p + 1, c->last, '\'');
+    code = ngx_esi_expr_emit(c, NGX_ESI_EXPR_STR);
+    if (code) {
+      code->u.str.data = c->p + 1;
+      code->u.str.len = (end ? end : c->last) - (c->p + 1);
+    }
+    c->p = end ? end + 1 : c->last;
+    return;
+
+  case '$':
+    end = ngx_esi_vars_parse(c->p, c->last, &var);
+    if (end == NULL) {
+      c->error = 1;
+      return;
+    }
+    code = ngx_esi_expr_emit(c, NGX_ESI_EXPR_VAR);
+    if (code) {
+      code->u.var = var;
+    }
+    c->p = end;
+    return;
+
+  default:
+    if (ngx_esi_expr_number(c->p, c->last, &end, &num) != NGX_OK) {
+      c->error = 1;
+      return;
+    }
+    code = ngx_esi_expr_emit(c, NGX_ESI_EXPR_NUM);
+    if (code) {
+      code->u.num = num;
+    }
+    c->p = end;
+    return;
+  }
+}
+
+static void
+ngx_esi_expr_compare(ngx_esi_expr_compiler_t *c)
+{
+  u_char             *p;
+  ngx_esi_expr_op_e   op;
+
+  ngx_esi_expr_primary(c);
+  ngx_esi_expr_space(c);
+
+  if (c->error || c->last - c->p < 1) {
+    return;
+  }
+
+  p = c->p;
+
+  if (c->last - p > 1 && p[1] == '=' && (p[0] == '=' || p[0] == '!' || p[0] == '<' || p[0] == '>')) {
+    op = p[0] == '=' ? NGX_ESI_EXPR_EQ
+       : p[0] == '!' ? NGX_ESI_EXPR_NE
+       : p[0] == '<' ? NGX_ESI_EXPR_LE : NGX_ESI_EXPR_GE;
+    c->p += 2;
+  }
+  else if (p[0] == '<' || p[0] == '>') {
+    op = p[0] == '<' ? NGX_ESI_EXPR_LT : NGX_ESI_EXPR_GT;
+    c->p++;
+  }
+  else {
+    return;
+  }
+
+  ngx_esi_expr_primary(c);
+  ngx_esi_expr_emit(c, op);
+}
+
+static void
+ngx_esi_expr_unary(ngx_esi_expr_compiler_t *c)
+{
+  ngx_esi_expr_space(c);
+
+  if (c->p < c->last && *c->p == '!') {
+    if (++c->nest > NGX_ESI_EXPR_STACK) {
+      c->error = 1;
+      return;
+    }
+    c->p++;
+    ngx_esi_expr_unary(c);
+    ngx_esi_expr_emit(c, NGX_ESI_EXPR_NOT);
+    c->nest--;
+    return;
+  }
+
+  ngx_esi_expr_compare(c);
+}
+
+static void
+ngx_esi_expr_and(ngx_esi_expr_compiler_t *c)
+{
+  ngx_esi_expr_unary(c);
+
+  for ( ;; ) {
+    ngx_esi_expr_space(c);
+    if (c->error || c->p == c->last || *c->p != '&') {
+      return;
+    }
+    /* & as in the spec, && as people tend to write it */
+    c->p += (c->last - c->p > 1 && c->p[1] == '&') ? 2 : 1;
+    ngx_esi_expr_unary(c);
+    ngx_esi_expr_emit(c, NGX_ESI_EXPR_AND);
+  }
+}
+
+static void
+ngx_esi_expr_or(ngx_esi_expr_compiler_t *c)
+{
+  ngx_esi_expr_and(c);
+
+  for ( ;; ) {
+    ngx_esi_expr_space(c);
+    if (c->error || c->p == c->last || *c->p != '|') {
+      return;
+    }
+    c->p += (c->last - c->p > 1 && c->p[1] == '|') ? 2 : 1;
+    ngx_esi_expr_and(c);
+    ngx_esi_expr_emit(c, NGX_ESI_EXPR_OR);
+  }
+}
+
+static ngx_uint_t
+ngx_esi_expr_parse(ngx_esi_expr_t *expr, ngx_esi_expr_code_t *code)
+{
+  ngx_esi_expr_compiler_t  c;
+
+  ngx_memzero(&c, sizeof(ngx_esi_expr_compiler_t));
+  c.p = expr->text.data;
+  c.last = expr->text.data + expr->text.len;
+  c.code = code;
+
+  ngx_esi_expr_or(&c);
+  ngx_esi_expr_space(&c);
+
+  if (c.error || c.p != c.last || c.max > NGX_ESI_EXPR_STACK) {
+    return 0;
+  }
+
+  return c.n;
+}
+
+ngx_esi_expr_t *
+ngx_esi_expr_compile(ngx_log_t *log, ngx_str_t *text)
+{
+  ngx_uint_t       hash, n;
+  ngx_esi_expr_t  *expr, **slot;
+
+  hash = ngx_hash_key(text->data, text->len);
+  slot = &ngx_esi_expr_cache[hash % NGX_ESI_EXPR_CACHE];
+  expr = *slot;
+
+  if (expr && expr->hash == hash && expr->text.len == text->len
+      && ngx_strncmp(expr->text.data, text->data, text->len) == 0)
+  {
+    return expr;
+  }
+
+  /* size the code first, it is then compiled against a copy of the text kept with it */
+  expr = ngx_alloc(sizeof(ngx_esi_expr_t) + text->len, log);
+  if (expr == NULL) {
+    return NULL;
+  }
+
+  expr->text.data = (u_char *) (expr + 1);
+  expr->text.len = text->len;
+  expr->hash = hash;
+  expr->code = NULL;
+  ngx_memcpy(expr->text.data, text->data, text->len);
+
+  n = ngx_esi_expr_parse(expr, NULL);
+
+  if (n) {
+    expr->code = ngx_alloc(n * sizeof(ngx_esi_expr_code_t), log);
+    if (expr->code == NULL) {
+      ngx_free(expr);
+      return NULL;
+    }
+    ngx_esi_expr_parse(expr, expr->code);
+  }
+  else {
+    ngx_log_error(NGX_LOG_ERR, log, 0, "invalid esi expression \"%V\"", text);
+  }
+
+  expr->n = n;
+
+  /* the slot holds the latest expression hashed to it */
+  if (*slot) {
+    if ((*slot)->code) {
+      ngx_free((*slot)->code);
+    }
+    ngx_free(*slot);
+  }
+  *slot = expr;
+
+  return expr;
+}
+
+static ngx_uint_t
+ngx_esi_expr_true(ngx_esi_expr_value_t *v)
+{
+  if (v->type != NGX_ESI_EXPR_TYPE_STR) {
+    return v->num != 0;
+  }
+  /* a variable such as $(HTTP_ACCEPT_LANGUAGE{en}) evaluates to true or false */
+  return v->str.len && !(v->str.len == 5 && ngx_strncmp(v->str.data, "false", 5) == 0);
+}
+
+static ngx_int_t
+ngx_esi_expr_to_number(ngx_esi_expr_value_t *v, double *num)
+{
+  u_char  *end;
+
+  if (v->type != NGX_ESI_EXPR_TYPE_STR) {
+    *num = v->num;
+    return NGX_OK;
+  }
+
+  if (ngx_esi_expr_number(v->str.data, v->str.data + v->str.len, &end, num) != NGX_OK
+      || end != v->str.data + v->str.len)
+  {
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+/* numbers compare as numbers, anything else as strings */
+static ngx_int_t
+ngx_esi_expr_cmp(ngx_esi_expr_value_t *a, ngx_esi_expr_value_t *b)
+{
+  double  x, y;
+
+  if (ngx_esi_expr_to_number(a, &x) == NGX_OK && ngx_esi_expr_to_number(b, &y) == NGX_OK) {
+    return x < y ? -1 : x > y;
+  }
+
+  if (a->type != NGX_ESI_EXPR_TYPE_STR || b->type != NGX_ESI_EXPR_TYPE_STR) {
+    return 1; /* a string is never equal to a number */
+  }
+
+  return ngx_memn2cmp(a->str.data, b->str.data, a->str.len, b->str.len);
+}
+
+ngx_uint_t
+ngx_esi_expr_eval(ngx_http_esi_ctx_t *ctx, ngx_esi_expr_t *expr)
+{
+  ngx_int_t              cmp;
+  ngx_uint_t             i, sp, r;
+  ngx_esi_expr_code_t   *code = expr->code;
+  ngx_esi_expr_value_t   stack[NGX_ESI_EXPR_STACK], *a, *b;
+
+  sp = 0;
+
+  for (i = 0; i < expr->n; i++) {
+
+    switch (code[i].op) {
+
+    case NGX_ESI_EXPR_STR:
+      a = &stack[sp++];
+      a->type = NGX_ESI_EXPR_TYPE_STR;
+      a->str = code[i].u.str;
+      continue;
+
+    case NGX_ESI_EXPR_NUM:
+      a = &stack[sp++];
+      a->type = NGX_ESI_EXPR_TYPE_NUM;
+      a->num = code[i].u.num;
+      continue;
+
+    case NGX_ESI_EXPR_VAR:
+      a = &stack[sp++];
+      a->type = NGX_ESI_EXPR_TYPE_STR;
+      ngx_esi_vars_value(ctx, &code[i].u.var, &a->str);
+      if (a->str.len == 0) {
+        a->str = code[i].u.var.def;
+      }
+      continue;
+
+    case NGX_ESI_EXPR_NOT:
+      a = &stack[sp - 1];
+      a->num = !ngx_esi_expr_true(a);
+      a->type = NGX_ESI_EXPR_TYPE_BOOL;
+      continue;
+
+    default:
+      break;
+    }
+
+    /* binary operators leave their result in place of the left operand */
+    b = &stack[--sp];
+    a = &stack[sp - 1];
+
+    switch (code[i].op) {
+    case NGX_ESI_EXPR_AND:
+      r = ngx_esi_expr_true(a) && ngx_esi_expr_true(b);
+      break;
+    case NGX_ESI_EXPR_OR:
+      r = ngx_esi_expr_true(a) || ngx_esi_expr_true(b);
+      break;
+    default:
+      cmp = ngx_esi_expr_cmp(a, b);
+      r = code[i].op == NGX_ESI_EXPR_EQ ? cmp == 0
+        : code[i].op == NGX_ESI_EXPR_NE ? cmp != 0
+        : code[i].op == NGX_ESI_EXPR_LT ? cmp < 0
+        : code[i].op == NGX_ESI_EXPR_LE ? cmp <= 0
+        : code[i].op == NGX_ESI_EXPR_GT ? cmp > 0 : cmp >= 0;
+      break;
+    }
+
+    a->type = NGX_ESI_EXPR_TYPE_BOOL;
+    a->num = r;
+  }
+
+  return sp ? ngx_esi_expr_true(&stack[0]) : 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) Todd A. Fisher
+ */
+#ifndef NGX_ESI_EXPR_H
+#define NGX_ESI_EXPR_H
+
+#include "ngx_http_esi_filter_module.h"
+#include "ngx_esi_vars.h"
+
+/*
+ * ESI expressions, the test of esi:when e.g.
+ *
+ *  $(HTTP_COOKIE{group})=='beta' & !($(QUERY_STRING{page}) > 10)
+ *
+ * An expression is compiled once per worker into postfix code that is evaluated
+ * on a fixed size stack, so testing it for a request allocates nothing
+ */
+#define NGX_ESI_EXPR_STACK  32   /* deepest operand stack an expression may need */
+#define NGX_ESI_EXPR_CACHE  256  /* compiled expressions kept per worker */
+
+typedef enum {
+  NGX_ESI_EXPR_STR = 0,
+  NGX_ESI_EXPR_NUM,
+  NGX_ESI_EXPR_VAR,
+  NGX_ESI_EXPR_NOT,
+  NGX_ESI_EXPR_AND,
+  NGX_ESI_EXPR_OR,
+  NGX_ESI_EXPR_EQ,
+  NGX_ESI_EXPR_NE,
+  NGX_ESI_EXPR_LT,
+  NGX_ESI_EXPR_LE,
+  NGX_ESI_EXPR_GT,
+  NGX_ESI_EXPR_GE
+} ngx_esi_expr_op_e;
+
+typedef struct {
+  ngx_esi_expr_op_e   op;
+  union {
+    ngx_str_t         str;
+    double            num;
+    ngx_esi_var_op_t  var;
+  } u;
+} ngx_esi_expr_code_t;
+
+typedef struct {
+  ngx_str_t             text;  /* source, literals and variables point into it */
+  ngx_uint_t            hash;
+  ngx_uint_t            n;     /* 0 when the expression is invalid, it is then false */
+  ngx_esi_expr_code_t  *code;
+} ngx_esi_expr_t;
+
+/* compiled expression for text, from the worker cache when it was seen before */
+ngx_esi_expr_t *ngx_esi_expr_compile(ngx_log_t *log, ngx_str_t *text);
+
+/* 1 when the expression holds for the request */
+ngx_uint_t ngx_esi_expr_eval(ngx_http_esi_ctx_t *ctx, ngx_esi_expr_t *expr);
+
+#endif
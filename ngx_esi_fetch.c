@@ -0,0 +1,785 @@
+/*
+ * Copyright (C) Todd A. Fisher
+ *
+ * Fragment fetches over kept alive upstream connections, esi_fragment_pass
+ */
+#include "ngx_esi_fetch.h"
+
+/* ngx_esi_fetch_t.chunk_state */
+enum {
+  NGX_ESI_FETCH_CHUNK_SIZE = 0,
+  NGX_ESI_FETCH_CHUNK_EXT,
+  NGX_ESI_FETCH_CHUNK_DATA,
+  NGX_ESI_FETCH_CHUNK_DATA_END,
+  NGX_ESI_FETCH_CHUNK_TRAILER,
+  NGX_ESI_FETCH_CHUNK_TRAILER_LINE,
+  NGX_ESI_FETCH_CHUNK_DONE
+};
+
+static void ngx_esi_fetch_write_handler(ngx_event_t *wev);
+static void ngx_esi_fetch_read_handler(ngx_event_t *rev);
+
+static void
+ngx_esi_fetch_idle_dummy(ngx_event_t *ev)
+{
+}
+
+/* an idle connection only hears from the upstream when it closes it */
+static void
+ngx_esi_fetch_idle_handler(ngx_event_t *ev)
+{
+  int                    n;
+  char                   buf[1];
+  ngx_connection_t      *c = ev->data;
+  ngx_esi_fetch_idle_t  *idle = c->data;
+
+  if (c->close || ev->timedout) {
+    goto close;
+  }
+
+  n = recv(c->fd, buf, 1, MSG_PEEK);
+
+  if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
+    ev->ready = 0;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+      goto close;
+    }
+
+    return;
+  }
+
+close:
+
+  ngx_queue_remove(&idle->queue);
+  ngx_queue_insert_head(&idle->pass->free, &idle->queue);
+  idle->connection = NULL;
+
+  ngx_close_connection(c);
+}
+
+/* park the connection in the keepalive pool, the least recently used one makes room */
+static void
+ngx_esi_fetch_keep(ngx_esi_fetch_pass_t *pass, ngx_connection_t *c)
+{
+  ngx_queue_t           *q;
+  ngx_esi_fetch_idle_t  *idle;
+
+  if (pass->keepalive == 0 || c->read->eof || c->read->error || c->write->error) {
+    ngx_close_connection(c);
+    return;
+  }
+
+  if (ngx_queue_empty(&pass->free)) {
+    q = ngx_queue_last(&pass->idle);
+    ngx_queue_remove(q);
+    idle = ngx_queue_data(q, ngx_esi_fetch_idle_t, queue);
+    ngx_close_connection(idle->connection);
+  }
+  else {
+    q = ngx_queue_head(&pass->free);
+    ngx_queue_remove(q);
+    idle = ngx_queue_data(q, ngx_esi_fetch_idle_t, queue);
+  }
+
+  ngx_queue_insert_head(&pass->idle, q);
+  idle->connection = c;
+
+  if (c->read->timer_set) {
+    ngx_del_timer(c->read);
+  }
+  if (c->write->timer_set) {
+    ngx_del_timer(c->write);
+  }
+
+  /* the request the connection was used for and its log go away */
+  c->data = idle;
+  c->idle = 1;
+  c->log = ngx_cycle->log;
+  c->read->log = ngx_cycle->log;
+  c->write->log = ngx_cycle->log;
+  c->read->handler = ngx_esi_fetch_idle_handler;
+  c->write->handler = ngx_esi_fetch_idle_dummy;
+
+  ngx_add_timer(c->read, NGX_ESI_FETCH_IDLE_TIMEOUT);
+
+  if (c->read->ready) {
+    ngx_esi_fetch_idle_handler(c->read);
+  }
+}
+
+static ngx_connection_t *
+ngx_esi_fetch_idle_get(ngx_esi_fetch_pass_t *pass)
+{
+  ngx_queue_t           *q;
+  ngx_connection_t      *c;
+  ngx_esi_fetch_idle_t  *idle;
+
+  if (ngx_queue_empty(&pass->idle)) {
+    return NULL;
+  }
+
+  q = ngx_queue_head(&pass->idle);
+  ngx_queue_remove(q);
+  ngx_queue_insert_head(&pass->free, q);
+
+  idle = ngx_queue_data(q, ngx_esi_fetch_idle_t, queue);
+  c = idle->connection;
+  idle->connection = NULL;
+
+  if (c->read->timer_set) {
+    ngx_del_timer(c->read);
+  }
+  c->idle = 0;
+
+  return c;
+}
+
+/* the connection is done with, the handler gets the fetch */
+static void
+ngx_esi_fetch_finalize(ngx_esi_fetch_t *fetch, ngx_uint_t ok)
+{
+  ngx_chain_t      **ll;
+  ngx_connection_t  *c = fetch->peer.connection;
+
+  fetch->peer.connection = NULL;
+
+  /* a buffer read nothing into when the upstream closed, or chunk framing only */
+  for (ll = &fetch->body; *ll; /* void */) {
+    if ((*ll)->buf->pos == (*ll)->buf->last) {
+      *ll = (*ll)->next;
+      continue;
+    }
+    ll = &(*ll)->next;
+  }
+
+  if (c) {
+    if (ok && fetch->keepalive) {
+      ngx_esi_fetch_keep(fetch->pass, c);
+    }
+    else {
+      ngx_close_connection(c);
+    }
+  }
+
+  if (!ok) {
+    fetch->status = 0;
+  }
+
+  fetch->handler(fetch);
+}
+
+/* take a kept alive connection, or open a new one when reuse is 0 or none is idle */
+static ngx_int_t
+ngx_esi_fetch_connect(ngx_esi_fetch_t *fetch, ngx_uint_t reuse)
+{
+  ngx_int_t               rc;
+  ngx_addr_t             *addr;
+  ngx_connection_t       *c;
+  ngx_esi_fetch_pass_t   *pass = fetch->pass;
+  ngx_peer_connection_t  *pc = &fetch->peer;
+
+  c = reuse ? ngx_esi_fetch_idle_get(pass) : NULL;
+
+  if (c) {
+    fetch->reused = 1;
+    pc->connection = c;
+    rc = NGX_OK;
+  }
+  else {
+    addr = &pass->addrs[pass->current++ % pass->naddrs];
+
+    pc->sockaddr = addr->sockaddr;
+    pc->socklen = addr->socklen;
+    pc->name = &addr->name;
+    pc->get = ngx_event_get_peer;
+    pc->log = fetch->log;
+    pc->log_error = NGX_ERROR_ERR;
+    pc->tries = 1;
+
+    rc = ngx_event_connect_peer(pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+      ngx_log_error(NGX_LOG_ERR, fetch->log, 0,
+                    "esi fragment pass could not connect to \"%V\"", pc->name);
+      if (pc->connection) {
+        ngx_close_connection(pc->connection);
+        pc->connection = NULL;
+      }
+      return NGX_ERROR;
+    }
+
+    c = pc->connection;
+  }
+
+  c->data = fetch;
+  c->log = fetch->log;
+  c->read->log = fetch->log;
+  c->write->log = fetch->log;
+  c->read->handler = ngx_esi_fetch_read_handler;
+  c->write->handler = ngx_esi_fetch_write_handler;
+
+  fetch->request->pos = fetch->request->start;
+
+  if (rc == NGX_AGAIN) {
+    ngx_add_timer(c->write, fetch->timeout);
+    return NGX_OK;
+  }
+
+  /* the caller hears back from an event, never from within ngx_esi_fetch_start */
+  ngx_post_event(c->write, &ngx_posted_events);
+
+  return NGX_OK;
+}
+
+/* a connection from the pool may have been closed by the upstream meanwhile, try a fresh one */
+static void
+ngx_esi_fetch_error(ngx_esi_fetch_t *fetch)
+{
+  if (fetch->reused && !fetch->received) {
+    ngx_close_connection(fetch->peer.connection);
+    fetch->peer.connection = NULL;
+    fetch->reused = 0;
+
+    if (ngx_esi_fetch_connect(fetch, 0) == NGX_OK) {
+      return;
+    }
+  }
+
+  ngx_esi_fetch_finalize(fetch, 0);
+}
+
+static void
+ngx_esi_fetch_write_handler(ngx_event_t *wev)
+{
+  ssize_t            n;
+  ngx_connection_t  *c = wev->data;
+  ngx_esi_fetch_t   *fetch = c->data;
+  ngx_buf_t         *b = fetch->request;
+
+  if (wev->timedout) {
+    ngx_log_error(NGX_LOG_ERR, fetch->log, NGX_ETIMEDOUT, "esi fragment pass timed out sending");
+    ngx_esi_fetch_finalize(fetch, 0);
+    return;
+  }
+
+  while (b->pos < b->last) {
+    n = c->send(c, b->pos, b->last - b->pos);
+
+    if (n == NGX_ERROR) {
+      ngx_esi_fetch_error(fetch);
+      return;
+    }
+
+    if (n == NGX_AGAIN) {
+      if (!wev->timer_set) {
+        ngx_add_timer(wev, fetch->timeout);
+      }
+      if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+        ngx_esi_fetch_finalize(fetch, 0);
+      }
+      return;
+    }
+
+    b->pos += n;
+  }
+
+  if (wev->timer_set) {
+    ngx_del_timer(wev);
+  }
+  wev->handler = ngx_esi_fetch_idle_dummy;
+
+  if (!c->read->timer_set) {
+    ngx_add_timer(c->read, fetch->timeout);
+  }
+
+  if (c->read->ready) {
+    ngx_esi_fetch_read_handler(c->read);
+    return;
+  }
+
+  if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+    ngx_esi_fetch_finalize(fetch, 0);
+  }
+}
+
+/* room to read the body into, appended to the fragment when the last buffer is full */
+static ngx_buf_t *
+ngx_esi_fetch_buf(ngx_esi_fetch_t *fetch, size_t least)
+{
+  size_t        size;
+  ngx_buf_t    *b = fetch->buf;
+  ngx_chain_t  *cl;
+
+  if (b && b->last < b->end && (size_t) (b->end - b->last) >= least) {
+    return b;
+  }
+
+  size = NGX_ESI_FETCH_BUFFER_SIZE;
+  if (!fetch->chunked && fetch->rest > 0 && fetch->rest < (off_t) size) {
+    size = (size_t) fetch->rest;
+  }
+  size = ngx_max(size, least);
+
+  b = ngx_create_temp_buf(fetch->pool, size);
+  cl = ngx_alloc_chain_link(fetch->pool);
+  if (b == NULL || cl == NULL) {
+    return NULL;
+  }
+
+  cl->buf = b;
+  cl->next = NULL;
+  *fetch->last = cl;
+  fetch->last = &cl->next;
+  fetch->buf = b;
+
+  return b;
+}
+
+/*
+ * n bytes were read in at buf->last, take them into the body. A chunked body is
+ * decoded in place. Returns 1 once the body is complete
+ */
+static ngx_uint_t
+ngx_esi_fetch_input(ngx_esi_fetch_t *fetch, size_t n)
+{
+  u_char      c, *src, *dst, *end;
+  size_t      m;
+  ngx_int_t   v;
+  ngx_buf_t  *b = fetch->buf;
+
+  if (!fetch->chunked) {
+    if (fetch->rest >= 0 && (off_t) n > fetch->rest) {
+      /* more than the upstream said, the connection is not trusted again */
+      n = (size_t) fetch->rest;
+      fetch->keepalive = 0;
+    }
+
+    b->last += n;
+
+    if (fetch->rest >= 0) {
+      fetch->rest -= n;
+      return fetch->rest == 0;
+    }
+
+    return 0;
+  }
+
+  src = dst = b->last;
+  end = src + n;
+
+  while (src < end) {
+
+    switch (fetch->chunk_state) {
+
+    case NGX_ESI_FETCH_CHUNK_SIZE:
+      c = *src++;
+      v = ngx_hextoi(&c, 1);
+      if (v != NGX_ERROR) {
+        if (fetch->chunk > (NGX_MAX_OFF_T_VALUE >> 4)) {
+          fetch->status = 0;
+          return 1;
+        }
+        fetch->chunk = fetch->chunk * 16 + v;
+        break;
+      }
+      if (c == LF) {
+        fetch->chunk_state = fetch->chunk ? NGX_ESI_FETCH_CHUNK_DATA : NGX_ESI_FETCH_CHUNK_TRAILER;
+        break;
+      }
+      fetch->chunk_state = NGX_ESI_FETCH_CHUNK_EXT;
+      break;
+
+    case NGX_ESI_FETCH_CHUNK_EXT:
+      if (*src++ == LF) {
+        fetch->chunk_state = fetch->chunk ? NGX_ESI_FETCH_CHUNK_DATA : NGX_ESI_FETCH_CHUNK_TRAILER;
+      }
+      break;
+
+    case NGX_ESI_FETCH_CHUNK_DATA:
+      m = (size_t) ngx_min(fetch->chunk, (off_t) (end - src));
+      ngx_memmove(dst, src, m);
+      dst += m;
+      src += m;
+      fetch->chunk -= m;
+      if (fetch->chunk == 0) {
+        fetch->chunk_state = NGX_ESI_FETCH_CHUNK_DATA_END;
+      }
+      break;
+
+    case NGX_ESI_FETCH_CHUNK_DATA_END:
+      if (*src++ == LF) {
+        fetch->chunk_state = NGX_ESI_FETCH_CHUNK_SIZE;
+      }
+      break;
+
+    case NGX_ESI_FETCH_CHUNK_TRAILER:
+      c = *src++;
+      if (c == LF) {
+        fetch->chunk_state = NGX_ESI_FETCH_CHUNK_DONE;
+      }
+      else if (c != CR) {
+        fetch->chunk_state = NGX_ESI_FETCH_CHUNK_TRAILER_LINE;
+      }
+      break;
+
+    case NGX_ESI_FETCH_CHUNK_TRAILER_LINE:
+      if (*src++ == LF) {
+        fetch->chunk_state = NGX_ESI_FETCH_CHUNK_TRAILER;
+      }
+      break;
+
+    default: /* NGX_ESI_FETCH_CHUNK_DONE */
+      fetch->keepalive = 0;
+      src = end;
+      break;
+    }
+  }
+
+  b->last = dst;
+
+  return fetch->chunk_state == NGX_ESI_FETCH_CHUNK_DONE;
+}
+
+/* does the header value hold s, case insensitive */
+static ngx_uint_t
+ngx_esi_fetch_has(u_char *p, u_char *last, char *s)
+{
+  size_t  n = ngx_strlen(s);
+
+  return (size_t) (last - p) >= n
+         && ngx_strlcasestrn(p, last, (u_char *) s, n - 1) != NULL;
+}
+
+/* the response head is in [start, end), returns NGX_ERROR if it is not HTTP */
+static ngx_int_t
+ngx_esi_fetch_head(ngx_esi_fetch_t *fetch, u_char *start, u_char *end)
+{
+  u_char     *p, *eol, *colon, *value, *last;
+  ngx_int_t   status;
+  off_t       length = -1;
+
+  eol = ngx_strlchr(start, end, LF);
+
+  if (eol == NULL || eol - start < 12 || ngx_strncmp(start, "HTTP/1.", 7) != 0) {
+    return NGX_ERROR;
+  }
+
+  status = ngx_atoi(start + 9, 3);
+  if (status == NGX_ERROR) {
+    return NGX_ERROR;
+  }
+
+  fetch->status = (ngx_uint_t) status;
+  fetch->keepalive = (start[7] == '1');
+
+  for (p = eol + 1; p < end; p = eol + 1) {
+    eol = ngx_strlchr(p, end, LF);
+    if (eol == NULL) {
+      break;
+    }
+
+    last = (eol > p && eol[-1] == CR) ? eol - 1 : eol;
+
+    colon = ngx_strlchr(p, last, ':');
+    if (colon == NULL) {
+      continue;
+    }
+
+    for (value = colon + 1; value < last && *value == ' '; value++) { /* void */ }
+
+#define ngx_esi_fetch_header(name)                                            \
+    ((size_t) (colon - p) == sizeof(name) - 1                                 \
+     && ngx_strncasecmp(p, (u_char *) name, sizeof(name) - 1) == 0)
+
+    if (ngx_esi_fetch_header("Content-Length")) {
+      length = ngx_atoof(value, last - value);
+      if (length == NGX_ERROR) {
+        return NGX_ERROR;
+      }
+    }
+    else if (ngx_esi_fetch_header("Transfer-Encoding")) {
+      fetch->chunked = ngx_esi_fetch_has(value, last, "chunked");
+    }
+    else if (ngx_esi_fetch_header("Connection")) {
+      if (ngx_esi_fetch_has(value, last, "close")) {
+        fetch->keepalive = 0;
+      }
+    }
+    else if (ngx_esi_fetch_header("Surrogate-Control")) {
+      fetch->plain = !ngx_esi_fetch_has(value, last, "ESI/1.0");
+    }
+
+#undef ngx_esi_fetch_header
+  }
+
+  if (fetch->status < 200 || fetch->status == NGX_HTTP_NO_CONTENT
+      || fetch->status == NGX_HTTP_NOT_MODIFIED)
+  {
+    fetch->chunked = 0;
+    fetch->rest = 0;
+  }
+  else if (!fetch->chunked) {
+    /* without a length the body ends with the connection */
+    fetch->rest = length;
+    if (length < 0) {
+      fetch->keepalive = 0;
+    }
+  }
+
+  return NGX_OK;
+}
+
+static void
+ngx_esi_fetch_read_handler(ngx_event_t *rev)
+{
+  u_char            *p;
+  size_t             left;
+  ssize_t            n;
+  ngx_buf_t         *b;
+  ngx_connection_t  *c = rev->data;
+  ngx_esi_fetch_t   *fetch = c->data;
+
+  if (rev->timedout) {
+    ngx_log_error(NGX_LOG_ERR, fetch->log, NGX_ETIMEDOUT, "esi fragment pass timed out reading");
+    ngx_esi_fetch_finalize(fetch, 0);
+    return;
+  }
+
+  for ( ;; ) {
+
+    if (fetch->header) {
+      b = fetch->header;
+      if (b->last == b->end) {
+        ngx_log_error(NGX_LOG_ERR, fetch->log, 0, "esi fragment pass response head is too large");
+        ngx_esi_fetch_finalize(fetch, 0);
+        return;
+      }
+    }
+    else {
+      b = ngx_esi_fetch_buf(fetch, 1);
+      if (b == NULL) {
+        ngx_esi_fetch_finalize(fetch, 0);
+        return;
+      }
+    }
+
+    n = c->recv(c, b->last, b->end - b->last);
+
+    if (n == NGX_AGAIN) {
+      if (!rev->timer_set) {
+        ngx_add_timer(rev, fetch->timeout);
+      }
+      if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_esi_fetch_finalize(fetch, 0);
+      }
+      return;
+    }
+
+    if (n == NGX_ERROR || n == 0) {
+      if (n == 0 && fetch->header == NULL && !fetch->chunked && fetch->rest < 0) {
+        /* the end of a body without a length */
+        ngx_esi_fetch_finalize(fetch, 1);
+        return;
+      }
+      ngx_esi_fetch_error(fetch);
+      return;
+    }
+
+    fetch->received = 1;
+
+    if (fetch->header == NULL) {
+      if (ngx_esi_fetch_input(fetch, n)) {
+        ngx_esi_fetch_finalize(fetch, fetch->status != 0);
+        return;
+      }
+      continue;
+    }
+
+    b->last += n;
+
+    p = ngx_strlcasestrn(b->pos, b->last, (u_char *) "\r\n\r\n", 3);
+    if (p == NULL) {
+      continue;
+    }
+    p += 4;
+
+    if (ngx_esi_fetch_head(fetch, b->pos, p) != NGX_OK) {
+      ngx_log_error(NGX_LOG_ERR, fetch->log, 0, "esi fragment pass got an invalid response head");
+      ngx_esi_fetch_finalize(fetch, 0);
+      return;
+    }
+
+    fetch->header = NULL;
+
+    if (!fetch->chunked && fetch->rest == 0) {
+      fetch->keepalive = fetch->keepalive && p == b->last;
+      ngx_esi_fetch_finalize(fetch, 1);
+      return;
+    }
+
+    /* what came in after the head is the start of the body */
+    left = b->last - p;
+    if (left) {
+      b = ngx_esi_fetch_buf(fetch, left);
+      if (b == NULL) {
+        ngx_esi_fetch_finalize(fetch, 0);
+        return;
+      }
+      ngx_memcpy(b->last, p, left);
+
+      if (ngx_esi_fetch_input(fetch, left)) {
+        ngx_esi_fetch_finalize(fetch, fetch->status != 0);
+        return;
+      }
+    }
+  }
+}
+
+ngx_esi_fetch_t *
+ngx_esi_fetch_start(ngx_esi_fetch_pass_t *pass, ngx_pool_t *pool, ngx_log_t *log,
+                    ngx_str_t *uri, ngx_str_t *args, ngx_msec_t timeout,
+                    ngx_esi_fetch_handler_pt handler, void *data)
+{
+  size_t            len;
+  ngx_buf_t        *b;
+  ngx_esi_fetch_t  *fetch;
+
+  fetch = ngx_pcalloc(pool, sizeof(ngx_esi_fetch_t));
+  if (fetch == NULL) {
+    return NULL;
+  }
+
+  len = sizeof("GET ") - 1 + uri->len + 1 + args->len
+        + sizeof(" HTTP/1.1" CRLF "Host: ") - 1 + pass->host.len
+        + sizeof(CRLF "Connection: keep-alive" CRLF CRLF) - 1;
+
+  b = ngx_create_temp_buf(pool, len);
+  fetch->header = ngx_create_temp_buf(pool, NGX_ESI_FETCH_HEADER_SIZE);
+  if (b == NULL || fetch->header == NULL) {
+    return NULL;
+  }
+
+  b->last = ngx_cpymem(b->last, "GET ", sizeof("GET ") - 1);
+  b->last = ngx_cpymem(b->last, uri->data, uri->len);
+  if (args->len) {
+    *b->last++ = '?';
+    b->last = ngx_cpymem(b->last, args->data, args->len);
+  }
+  b->last = ngx_cpymem(b->last, " HTTP/1.1" CRLF "Host: ", sizeof(" HTTP/1.1" CRLF "Host: ") - 1);
+  b->last = ngx_cpymem(b->last, pass->host.data, pass->host.len);
+  b->last = ngx_cpymem(b->last, CRLF "Connection: keep-alive" CRLF CRLF,
+                       sizeof(CRLF "Connection: keep-alive" CRLF CRLF) - 1);
+
+  fetch->pass = pass;
+  fetch->pool = pool;
+  fetch->log = log;
+  fetch->timeout = timeout ? timeout : NGX_ESI_FETCH_TIMEOUT;
+  fetch->request = b;
+  fetch->last = &fetch->body;
+  fetch->rest = -1;
+  fetch->handler = handler;
+  fetch->data = data;
+
+  if (ngx_esi_fetch_connect(fetch, 1) != NGX_OK) {
+    return NULL;
+  }
+
+  return fetch;
+}
+
+void
+ngx_esi_fetch_cancel(ngx_esi_fetch_t *fetch)
+{
+  if (fetch->peer.connection) {
+    ngx_close_connection(fetch->peer.connection);
+    fetch->peer.connection = NULL;
+  }
+}
+
+/* esi_fragment_pass host:port [keepalive=n] | off */
+char *
+ngx_esi_fetch_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_esi_loc_conf_t  *slcf = conf;
+
+  ngx_int_t                 n;
+  ngx_str_t                *value;
+  ngx_uint_t                i;
+  ngx_url_t                 u;
+  ngx_esi_fetch_idle_t     *idle;
+  ngx_esi_fetch_pass_t     *pass;
+
+  if (slcf->fragment_pass != NGX_CONF_UNSET_PTR) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+
+  if (ngx_strcmp(value[1].data, "off") == 0) {
+    slcf->fragment_pass = NULL;
+    return NGX_CONF_OK;
+  }
+
+  pass = ngx_pcalloc(cf->pool, sizeof(ngx_esi_fetch_pass_t));
+  if (pass == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  pass->keepalive = 16;
+
+  for (i = 2; i < cf->args->nelts; i++) {
+    if (ngx_strncmp(value[i].data, "keepalive=", sizeof("keepalive=") - 1) == 0) {
+      n = ngx_atoi(value[i].data + sizeof("keepalive=") - 1,
+                   value[i].len - (sizeof("keepalive=") - 1));
+      if (n == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+      }
+      pass->keepalive = (ngx_uint_t) n;
+      continue;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+  }
+
+  ngx_memzero(&u, sizeof(ngx_url_t));
+  u.url = value[1];
+  u.default_port = 80;
+
+  if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+    if (u.err) {
+      ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%s in \"%V\"", u.err, &u.url);
+    }
+    return NGX_CONF_ERROR;
+  }
+
+  if (u.naddrs == 0) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no addresses for \"%V\"", &u.url);
+    return NGX_CONF_ERROR;
+  }
+
+  pass->addrs = u.addrs;
+  pass->naddrs = u.naddrs;
+  pass->host = u.url;
+
+  ngx_queue_init(&pass->idle);
+  ngx_queue_init(&pass->free);
+
+  if (pass->keepalive) {
+    idle = ngx_pcalloc(cf->pool, pass->keepalive * sizeof(ngx_esi_fetch_idle_t));
+    if (idle == NULL) {
+      return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < pass->keepalive; i++) {
+      idle[i].pass = pass;
+      ngx_queue_insert_head(&pass->free, &idle[i].queue);
+    }
+  }
+
+  slcf->fragment_pass = pass;
+
+  return NGX_CONF_OK;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (C) Todd A. Fisher
+ */
+#ifndef NGX_ESI_FETCH_H
+#define NGX_ESI_FETCH_H
+
+#include "ngx_http_esi_filter_module.h"
+
+/*
+ * esi_fragment_pass, fragments are fetched by a small HTTP/1.1 client of the
+ * module instead of a subrequest, e.g.
+ *
+ *  esi_fragment_pass 127.0.0.1:8080 keepalive=32;
+ *
+ * Connections to the upstream are kept open and reused, each worker keeps up to
+ * keepalive idle ones. The response body is read straight into the buffers the
+ * fragment is linked into the page with
+ */
+#define NGX_ESI_FETCH_HEADER_SIZE  4096   /* largest response head */
+#define NGX_ESI_FETCH_BUFFER_SIZE  8192   /* body is read in buffers of this size at most */
+#define NGX_ESI_FETCH_TIMEOUT      60000  /* connect, send and read timeout when the include sets none */
+#define NGX_ESI_FETCH_IDLE_TIMEOUT 60000  /* an idle connection is closed after */
+
+typedef struct ngx_esi_fetch_s ngx_esi_fetch_t;
+
+typedef void (*ngx_esi_fetch_handler_pt)(ngx_esi_fetch_t *fetch);
+
+/* idle connection of the keepalive pool */
+typedef struct {
+  ngx_queue_t                  queue;
+  ngx_connection_t            *connection;
+  struct ngx_esi_fetch_pass_s *pass;
+} ngx_esi_fetch_idle_t;
+
+typedef struct ngx_esi_fetch_pass_s {
+  ngx_addr_t               *addrs;
+  ngx_uint_t                naddrs;
+  ngx_uint_t                current;  /* round robin over addrs */
+  ngx_str_t                 host;     /* Host header of the fetches */
+  ngx_uint_t                keepalive;
+  ngx_queue_t               idle;     /* of this worker, most recently used first */
+  ngx_queue_t               free;
+} ngx_esi_fetch_pass_t;
+
+struct ngx_esi_fetch_s {
+  ngx_esi_fetch_pass_t     *pass;
+  ngx_pool_t               *pool;
+  ngx_log_t                *log;
+  ngx_peer_connection_t     peer;
+  ngx_msec_t                timeout;
+
+  ngx_buf_t                *request;
+  ngx_buf_t                *header;   /* response head until it is complete */
+  ngx_chain_t              *body;     /* the fragment */
+  ngx_chain_t             **last;
+  ngx_buf_t                *buf;      /* body buffer being read into */
+
+  ngx_uint_t                status;   /* 0 when the fetch failed */
+  off_t                     rest;     /* body bytes still to come, -1 until the connection closes */
+  off_t                     chunk;    /* bytes left in the current chunk */
+  ngx_uint_t                chunk_state;
+
+  ngx_esi_fetch_handler_pt  handler;
+  void                     *data;
+
+  unsigned                  chunked:1;
+  unsigned                  keepalive:1; /* the connection may be reused */
+  unsigned                  reused:1;    /* taken from the keepalive pool */
+  unsigned                  received:1;  /* something came back on the connection */
+  unsigned                  plain:1;     /* Surrogate-Control without content="ESI/1.0" */
+};
+
+char *ngx_esi_fetch_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/*
+ * send GET uri?args to the upstream, handler is called once the response is in
+ * or the fetch failed, never from within this call. NULL if nothing was sent
+ */
+ngx_esi_fetch_t *ngx_esi_fetch_start(ngx_esi_fetch_pass_t *pass, ngx_pool_t *pool, ngx_log_t *log,
+                                     ngx_str_t *uri, ngx_str_t *args, ngx_msec_t timeout,
+                                     ngx_esi_fetch_handler_pt handler, void *data);
+
+/* give up on the fetch, its handler is not called */
+void ngx_esi_fetch_cancel(ngx_esi_fetch_t *fetch);
+
+#endif
@@ -82,6 +82,16 @@ typedef struct _ESIParser {
   char output_buffer[ESI_OUTPUT_BUFFER_SIZE+1];
   size_t output_buffer_size;
 
+  int skip; /* content up to the next esi tag is discarded, see esi_parser_skip */
+
+  int in_comment;         /* between <!--esi and --> */
+  size_t comment_matched; /* bytes of a wrapper seen at the end of the last buffer */
+
+  const char *hint_base;  /* data the hints were found in, see esi_parser_hints */
+  const char *hint_end;
+  const size_t *hints;
+  size_t hints_n;
+
   esi_start_tag_cb start_tag_handler;
   esi_end_tag_cb end_tag_handler;
   esi_output_cb output_handler;
@@ -92,6 +102,13 @@ typedef struct _ESIParser {
 ESIParser *esi_parser_new();
 void esi_parser_free( ESIParser *parser );
 
+/*
+ * put the parser back in the state esi_parser_new and esi_parser_init leave it in, to
+ * parse another document. Its handlers and user_data are kept, so is its scratch memory
+ * while there is no more than keep bytes of it
+ */
+void esi_parser_reset( ESIParser *parser, size_t keep );
+
 /* initialize the parser */
 int esi_parser_init( ESIParser *parser );
 
@@ -113,6 +130,32 @@ void esi_parser_start_tag_handler( ESIParser *parser, esi_start_tag_cb callback
 
 void esi_parser_end_tag_handler( ESIParser *parser, esi_end_tag_cb callback );
 
+/*
+ * while set the parser jumps from one esi tag to the next, content in between is not
+ * run through the machine or sent to the output handler, e.g. for <esi:remove>.
+ * tags are still reported so the caller can find where the discarded region ends
+ */
+void esi_parser_skip( ESIParser *parser, int skip );
+
+/*
+ * offsets of the tag candidates in data that begin in [from,to): a < followed by any
+ * of / e s i and a : (<esi: and </esi: but also what only looks like them), <!--esi
+ * and -->. A candidate may run past to but not past length, so a document scanned in
+ * pieces finds the same ones. One cut short by length is kept, so a piece may be
+ * scanned with length at to before what follows it is read, it then finds a few more.
+ * Returns how many were found, more than max when the hints array is too small and
+ * only the first max were stored. Touches nothing else, it may run in another thread
+ */
+size_t esi_parser_scan_hints( const char *data, size_t length, size_t from, size_t to,
+                              size_t *hints, size_t max );
+
+/*
+ * the next esi_parser_execute of data is told where its tag candidates are, text in
+ * between is not scanned again. Hints must hold every candidate, NULL clears them
+ */
+void esi_parser_hints( ESIParser *parser, const char *data, size_t length,
+                       const size_t *hints, size_t n );
+
 /* setup a callback to recieve data ready for output */
 void esi_parser_output_handler( ESIParser *parser, esi_output_cb output_handler );
 
@@ -2,6 +2,9 @@
  * Copyright (c) 2008 Todd A. Fisher
  * see LICENSE
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* memmem, memrchr */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -138,6 +141,36 @@ static void rtrim_pointer( const char **ptr, const char *bounds, size_t *len )
   }
 }
 
+/*
+ * find where the machine has to pick up again while the module discards content,
+ * that is the next <esi: or </esi: in [p,pe). when there is none the end of the data
+ * is returned, less a trailing '<' that may start a tag continued in the next buffer
+ */
+static const char *esi_parser_skip_to_tag( const char *p, const char *pe )
+{
+  const char *start = p, *tag, *tail;
+
+  while( p < pe ) {
+    tag = (const char*)memmem( p, pe - p, "esi:", 4 );
+    if( !tag ) {
+      break;
+    }
+    if( tag - start >= 1 && tag[-1] == '<' ) {
+      return tag - 1;
+    }
+    if( tag - start >= 2 && tag[-1] == '/' && tag[-2] == '<' ) {
+      return tag - 2;
+    }
+    p = tag + 1;
+  }
+
+  /* </esi is the longest start of a tag that ends a buffer */
+  tail = ( pe - start > 5 ) ? pe - 5 : start;
+  tag = (const char*)memchr( tail, '<', pe - tail );
+
+  return tag ? tag : pe;
+}
+
 %%{
   machine esi;
 
@@ -181,6 +214,11 @@ static void rtrim_pointer( const char **ptr, const char *bounds, size_t *len )
 
     /* clear out the echo buffer */
     esi_parser_echobuffer_clear( parser );
+
+    /* the module discards what follows, jump to the next esi tag instead of echoing it */
+    if( parser->skip ) {
+      fexec esi_parser_skip_to_tag( p + 1, pe );
+    }
   }
 
   # block tag start, with attributes
@@ -206,6 +244,11 @@ static void rtrim_pointer( const char **ptr, const char *bounds, size_t *len )
     
     /* clear out the echo buffer */
     esi_parser_echobuffer_clear( parser );
+
+    /* the module discards what follows, jump to the next esi tag instead of echoing it */
+    if( parser->skip ) {
+      fexec esi_parser_skip_to_tag( p + 1, pe );
+    }
   }
   
   # see an attribute key, /foo\s*=/
@@ -272,6 +315,11 @@ static void rtrim_pointer( const char **ptr, const char *bounds, size_t *len )
     }
 
     esi_parser_echobuffer_clear( parser );
+
+    /* the module discards what follows, jump to the next esi tag instead of echoing it */
+    if( parser->skip ) {
+      fexec esi_parser_skip_to_tag( p + 1, pe );
+    }
   }
 
   # block end tag detected, e.g. </esi:try>
@@ -290,6 +338,11 @@ static void rtrim_pointer( const char **ptr, const char *bounds, size_t *len )
     esi_parser_flush_output( parser );
 
     esi_parser_echobuffer_clear( parser );
+
+    /* the module discards what follows, jump to the next esi tag instead of echoing it */
+    if( parser->skip ) {
+      fexec esi_parser_skip_to_tag( p + 1, pe );
+    }
   }
 
   # process each character in the input stream for output
@@ -309,6 +362,11 @@ static void rtrim_pointer( const char **ptr, const char *bounds, size_t *len )
       esi_parser_echobuffer_clear( parser );
       break;
     default:
+      /* a < starting over cuts short what looked like a tag, it was text, e.g. <e<esi:try> */
+      if( cs == 1 && *p == '<' && parser->echobuffer_index != (size_t)-1 ) {
+        esi_parser_echo_buffer( parser );
+        esi_parser_echobuffer_clear( parser );
+      }
       /* append to the echo buffer */
       esi_parser_concat_to_echobuffer( parser, *p );
     }
@@ -379,6 +437,9 @@ void esi_attribute_free( ESIAttribute *attribute )
 ESIParser *esi_parser_new()
 {
   ESIParser *parser = (ESIParser*)malloc(sizeof(ESIParser));
+  if( !parser ) {
+    return NULL;
+  }
   parser->cs = esi_start;
   parser->mark = NULL;
   parser->tag_text = NULL;
@@ -391,16 +452,23 @@ ESIParser *esi_parser_new()
   parser->echobuffer_allocated = ESI_OUTPUT_BUFFER_SIZE;
   parser->echobuffer_index = -1;
   parser->echobuffer = (char*)malloc(sizeof(char)*parser->echobuffer_allocated);
+  if( !parser->echobuffer ) {
+    free( parser );
+    return NULL;
+  }
 
   parser->attributes = NULL;
   parser->last = NULL;
+  parser->skip = 0;
+  parser->in_comment = 0;
+  parser->comment_matched = 0;
+  parser->hint_base = NULL;
 
   parser->start_tag_handler = esi_parser_default_start_cb;
   parser->end_tag_handler = esi_parser_default_end_cb;
   parser->output_handler = esi_parser_default_output_cp;
 
   parser->output_buffer_size = 0;
-  memset( parser->output_buffer, 0, ESI_OUTPUT_BUFFER_SIZE );
 
   return parser;
 }
@@ -414,6 +482,41 @@ void esi_parser_free( ESIParser *parser )
   free( parser );
 }
 
+void esi_parser_reset( ESIParser *parser, size_t keep )
+{
+  char *echobuffer;
+
+  if( parser->overflow_data ){ free( parser->overflow_data ); }
+  parser->overflow_data = NULL;
+  parser->overflow_data_size = 0;
+
+  /* a long tag grew the echobuffer, don't hold on to all of it */
+  if( parser->echobuffer_allocated > keep && parser->echobuffer_allocated > ESI_OUTPUT_BUFFER_SIZE ) {
+    echobuffer = (char*)realloc( parser->echobuffer, ESI_OUTPUT_BUFFER_SIZE );
+    if( echobuffer ) {
+      parser->echobuffer = echobuffer;
+      parser->echobuffer_allocated = ESI_OUTPUT_BUFFER_SIZE;
+    }
+  }
+  parser->echobuffer_index = -1;
+
+  esi_attribute_free( parser->attributes );
+  parser->attributes = NULL;
+  parser->last = NULL;
+
+  parser->mark = NULL;
+  parser->tag_text = NULL;
+  parser->attr_key = NULL;
+  parser->attr_value = NULL;
+  parser->output_buffer_size = 0;
+  parser->skip = 0;
+  parser->in_comment = 0;
+  parser->comment_matched = 0;
+  parser->hint_base = NULL;
+
+  esi_parser_init( parser );
+}
+
 void esi_parser_output_handler( ESIParser *parser, esi_output_cb output_handler )
 {
   parser->output_handler = output_handler;
@@ -487,7 +590,7 @@ esi_parser_scan_for_start( ESIParser *parser, const char *data, size_t length )
  * when invoked next, it reuses that internable buffer copying all pointers into the 
  * newly allocated buffer. if it exits in a terminal state, e.g. 0 then it will dump these buffers
  */
-int esi_parser_execute( ESIParser *parser, const char *data, size_t length )
+static int esi_parser_run( ESIParser *parser, const char *data, size_t length )
 {
   int cs = parser->cs;
   const char *p = data;
@@ -497,6 +600,16 @@ int esi_parser_execute( ESIParser *parser, const char *data, size_t length )
 
   if( length == 0 || data == 0 ){ return cs; }
 
+  /* the module discards content up to the next tag, don't run it through the machine */
+  if( parser->skip && ( cs == 0 || cs >= esi_first_final ) ) {
+    p = esi_parser_skip_to_tag( data, pe );
+    if( p == pe ) {
+      return cs;
+    }
+    length -= p - data;
+    data = p;
+  }
+
   /* scan data for any '<esi:' start sequences, /<$/, /<e$/, /<es$/, /<esi$/, /<esi:$/ */
   if( cs == 0 ) { 
     pindex = esi_parser_scan_for_start( parser, data, length );
@@ -556,13 +669,7 @@ int esi_parser_execute( ESIParser *parser, const char *data, size_t length )
       int attr_value_offset = compute_offset( parser->attr_value, data );
       //debug_string( "mark before move", parser->mark, 1 );
 
-      if( ESI_OUTPUT_BUFFER_SIZE > length ) {
-        parser->echobuffer_allocated = ESI_OUTPUT_BUFFER_SIZE;
-      }
-      else {
-        parser->echobuffer_allocated = length;
-      }
-      parser->overflow_data = (char*)malloc( sizeof( char ) * parser->echobuffer_allocated );
+      parser->overflow_data = (char*)malloc( sizeof( char ) * ( ESI_OUTPUT_BUFFER_SIZE > length ? ESI_OUTPUT_BUFFER_SIZE : length ) );
       memcpy( parser->overflow_data, data, length );
       parser->overflow_data_size = length;
       //printf( "allocate overflow data: %ld\n", parser->echobuffer_allocated );
@@ -584,8 +691,241 @@ int esi_parser_execute( ESIParser *parser, const char *data, size_t length )
 
   return cs;
 }
+
+/* is [p,pe) within the data the hints were found in */
+static int esi_parser_hinted( ESIParser *parser, const char *p, const char *pe )
+{
+  return parser->hint_base && p >= parser->hint_base && pe <= parser->hint_end;
+}
+
+/* the first hint at or after p, the end of the data when there is none */
+static const char *esi_parser_next_hint( ESIParser *parser, const char *p )
+{
+  size_t offset = p - parser->hint_base, lo = 0, hi = parser->hints_n, mid;
+
+  while( lo < hi ) {
+    mid = lo + ( hi - lo ) / 2;
+    if( parser->hints[mid] < offset ) {
+      lo = mid + 1;
+    }
+    else {
+      hi = mid;
+    }
+  }
+
+  return ( lo == parser->hints_n ) ? parser->hint_end : parser->hint_base + parser->hints[lo];
+}
+
+/* memmem, or the hints when the data has them */
+static const char *esi_parser_find( ESIParser *parser, const char *p, const char *pe,
+                                    const char *wrapper, size_t length )
+{
+  const char *h;
+
+  if( !esi_parser_hinted( parser, p, pe ) ) {
+    return (const char*)memmem( p, pe - p, wrapper, length );
+  }
+
+  for( h = esi_parser_next_hint( parser, p ); h + length <= pe; h = esi_parser_next_hint( parser, h + 1 ) ) {
+    if( !memcmp( h, wrapper, length ) ) {
+      return h;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * esi_parser_scan_for_start, with hints only the candidates and the end of the text
+ * where a tag may begin that goes on in the next buffer are looked at
+ */
+static int esi_parser_scan_text( ESIParser *parser, const char *p, const char *pe )
+{
+  const char *h, *tail;
+  int pindex;
+
+  if( !esi_parser_hinted( parser, p, pe ) ) {
+    return esi_parser_scan_for_start( parser, p, pe - p );
+  }
+
+  for( h = esi_parser_next_hint( parser, p ); h < pe; h = esi_parser_next_hint( parser, h + 1 ) ) {
+    if( *h == '<' && h[1] != '!' ) {
+      return h - p;
+    }
+  }
+
+  /* a tag cut by the end of the text starts at its last < */
+  tail = (const char*)memrchr( p, '<', pe - p );
+  if( tail == NULL ) {
+    return -1;
+  }
+  pindex = esi_parser_scan_for_start( parser, tail, pe - tail );
+
+  return ( pindex == -1 ) ? -1 : (int)( tail - p ) + pindex;
+}
+
+/*
+ * text outside of tags is handed to the output handler as it is, straight from the
+ * caller's buffer, and only the tags are run through the machine a '>' at a time.
+ * The machine sees the same bytes as if the data had come in smaller buffers
+ */
+static int esi_parser_execute_data( ESIParser *parser, const char *data, size_t length )
+{
+  const char *p = data, *pe = data + length, *q;
+  int pindex;
+
+  while( p < pe ) {
+
+    if( parser->cs == 0 || parser->cs == esi_start ) {
+      if( parser->skip ) {
+        /* discarded, the machine picks up at the next tag */
+        p = esi_parser_skip_to_tag( p, pe );
+        if( p == pe ) {
+          break;
+        }
+      }
+      else {
+        pindex = esi_parser_scan_text( parser, p, pe );
+        if( pindex == -1 ) {
+          pindex = pe - p;
+        }
+        if( pindex > 0 ) {
+          esi_parser_flush_output( parser );
+          parser->output_handler( (void*)p, pindex, parser->user_data );
+          p += pindex;
+          continue;
+        }
+      }
+    }
+
+    q = (const char*)memchr( p, '>', pe - p );
+    q = q ? q + 1 : pe;
+
+    esi_parser_run( parser, p, q - p );
+    p = q;
+  }
+
+  return parser->cs;
+}
+
+/*
+ * <!--esi ... --> hides esi markup from clients when the page is served without
+ * processing, the wrappers are dropped and what is inside is parsed as usual
+ */
+static const char esi_comment_start[] = "<!--esi";
+static const char esi_comment_end[] = "-->";
+
+/* not inside a tag, a wrapper found here is not part of an attribute value */
+static int esi_parser_in_text( int cs )
+{
+  return cs == 0 || cs >= esi_first_final;
+}
+
+/* start of the longest suffix of [p,pe) that is a prefix of the wrapper */
+static const char *esi_parser_partial( const char *p, const char *pe, const char *wrapper, size_t length )
+{
+  size_t n = ( (size_t)(pe - p) < length - 1 ) ? (size_t)(pe - p) : length - 1;
+
+  for( ; n > 0; --n ) {
+    if( !memcmp( pe - n, wrapper, n ) ) {
+      return pe - n;
+    }
+  }
+  return pe;
+}
+
+/* longest proper suffix of the first matched bytes of the wrapper that is a prefix of it */
+static size_t esi_parser_overlap( const char *wrapper, size_t matched )
+{
+  size_t n;
+
+  for( n = matched - 1; n > 0; --n ) {
+    if( !memcmp( wrapper + matched - n, wrapper, n ) ) {
+      return n;
+    }
+  }
+  return 0;
+}
+
+/*
+ * split the buffer on the comment wrappers and run what is between them through the machine,
+ * the wrappers are found with memmem and only a wrapper cut by the end of a buffer is held back
+ */
+int esi_parser_execute( ESIParser *parser, const char *data, size_t length )
+{
+  const char *p = data, *pe = data + length, *wrapper, *found;
+  size_t wrapper_length, n;
+
+  if( length == 0 || data == 0 ){ return parser->cs; }
+
+  while( p < pe ) {
+    wrapper = parser->in_comment ? esi_comment_end : esi_comment_start;
+    wrapper_length = parser->in_comment ? sizeof(esi_comment_end) - 1 : sizeof(esi_comment_start) - 1;
+
+    /* the previous buffer ended in what may be a wrapper */
+    if( parser->comment_matched ) {
+      n = wrapper_length - parser->comment_matched;
+      if( (size_t)(pe - p) < n ) {
+        n = pe - p;
+      }
+      if( !memcmp( p, wrapper + parser->comment_matched, n ) ) {
+        parser->comment_matched += n;
+        p += n;
+        if( parser->comment_matched == wrapper_length ) {
+          parser->comment_matched = 0;
+          parser->in_comment = !parser->in_comment;
+        }
+        continue;
+      }
+      /* it was content after all, but for its end that may still start the wrapper, e.g. the -- of --- */
+      n = esi_parser_overlap( wrapper, parser->comment_matched );
+      esi_parser_execute_data( parser, wrapper, parser->comment_matched - n );
+      parser->comment_matched = n;
+      continue;
+    }
+
+    found = esi_parser_find( parser, p, pe, wrapper, wrapper_length );
+
+    if( !found ) {
+      found = esi_parser_partial( p, pe, wrapper, wrapper_length );
+      esi_parser_execute_data( parser, p, found - p );
+      if( found == pe ) {
+        break;
+      }
+      if( esi_parser_in_text( parser->cs ) ) {
+        parser->comment_matched = pe - found;
+        break;
+      }
+      /* inside a tag, a shorter wrapper start may still follow as it would in a whole buffer */
+      esi_parser_execute_data( parser, found, 1 );
+      p = found + 1;
+      continue;
+    }
+
+    esi_parser_execute_data( parser, p, found - p );
+
+    if( esi_parser_in_text( parser->cs ) ) {
+      parser->in_comment = !parser->in_comment;
+      p = found + wrapper_length;
+    }
+    else {
+      /* inside a tag, e.g. src='/a-->b' */
+      esi_parser_execute_data( parser, found, 1 );
+      p = found + 1;
+    }
+  }
+
+  return parser->cs;
+}
+
 int esi_parser_finish( ESIParser *parser )
 {
+  /* the document ended in what looked like the start of a wrapper */
+  if( parser->comment_matched && !parser->in_comment ) {
+    esi_parser_execute_data( parser, esi_comment_start, parser->comment_matched );
+  }
+  parser->comment_matched = 0;
+
   esi_parser_flush_output( parser );
   return 0;
 }
@@ -599,3 +939,48 @@ void esi_parser_end_tag_handler( ESIParser *parser, esi_end_tag_cb callback )
 {
   parser->end_tag_handler = callback;
 }
+
+void esi_parser_skip( ESIParser *parser, int skip )
+{
+  parser->skip = skip;
+}
+
+size_t esi_parser_scan_hints( const char *data, size_t length, size_t from, size_t to,
+                              size_t *hints, size_t max )
+{
+  const char *p = data + from, *pe = data + to, *end = data + length;
+  size_t n = 0;
+
+  const char *q;
+
+  for( ; p < pe; ++p ) {
+    /* a candidate cut by length is kept, what follows may make it one */
+    if( *p == '<' ) {
+      /* what esi_parser_scan_for_start takes for the start of a tag */
+      for( q = p + 1; q < end && ( *q == '/' || *q == 'e' || *q == 's' || *q == 'i' ); ++q ) { }
+      if( !( q == end || *q == ':' )
+          && memcmp( p, esi_comment_start, ( end - p < 7 ? (size_t)( end - p ) : 7 ) ) ) {
+        continue;
+      }
+    }
+    else if( *p != '-' || memcmp( p, esi_comment_end, ( end - p < 3 ? (size_t)( end - p ) : 3 ) ) ) {
+      continue;
+    }
+
+    if( n < max ) {
+      hints[n] = p - data;
+    }
+    n++;
+  }
+
+  return n;
+}
+
+void esi_parser_hints( ESIParser *parser, const char *data, size_t length,
+                       const size_t *hints, size_t n )
+{
+  parser->hint_base = data;
+  parser->hint_end = data ? data + length : NULL;
+  parser->hints = hints;
+  parser->hints_n = n;
+}
@@ -0,0 +1,596 @@
+/*
+ * Copyright (C) Todd A. Fisher
+ *
+ * Shared memory zone used to coordinate fragment fetches across workers
+ */
+#include "ngx_esi_shm.h"
+#include "ngx_buf_util.h"
+
+static ngx_int_t
+ngx_esi_shm_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+  ngx_esi_shm_ctx_t  *octx = data;
+
+  size_t              len;
+  ngx_esi_shm_ctx_t  *ctx;
+
+  ctx = shm_zone->data;
+
+  if (octx) {
+    ctx->sh = octx->sh;
+    ctx->shpool = octx->shpool;
+    return NGX_OK;
+  }
+
+  ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+  if (shm_zone->shm.exists) {
+    ctx->sh = ctx->shpool->data;
+    return NGX_OK;
+  }
+
+  ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_esi_shctx_t));
+  if (ctx->sh == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_memzero(ctx->sh, sizeof(ngx_esi_shctx_t));
+  ctx->shpool->data = ctx->sh;
+
+  ngx_rbtree_init(&ctx->sh->origins, &ctx->sh->sentinel,
+                  ngx_rbtree_insert_value);
+  ngx_rbtree_init(&ctx->sh->latencies, &ctx->sh->latency_sentinel,
+                  ngx_rbtree_insert_value);
+  ngx_queue_init(&ctx->sh->latency_lru);
+
+  len = sizeof(" in esi zone \"\"") + shm_zone->shm.name.len;
+
+  ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+  if (ctx->shpool->log_ctx == NULL) {
+    return NGX_ERROR;
+  }
+
+  ngx_sprintf(ctx->shpool->log_ctx, " in esi zone \"%V\"%Z",
+              &shm_zone->shm.name);
+
+  return NGX_OK;
+}
+
+/* esi_zone name:size */
+char *
+ngx_esi_shm_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_esi_main_conf_t *emcf = conf;
+
+  u_char              *p;
+  ssize_t              size;
+  ngx_str_t           *value, name, s;
+  ngx_esi_shm_ctx_t   *ctx;
+
+  if (emcf->shm_zone) {
+    return "is duplicate";
+  }
+
+  value = cf->args->elts;
+
+  p = (u_char *) ngx_strchr(value[1].data, ':');
+  if (p == NULL) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid esi zone \"%V\", expected name:size", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  name.data = value[1].data;
+  name.len = p - value[1].data;
+
+  s.data = p + 1;
+  s.len = value[1].data + value[1].len - s.data;
+
+  size = ngx_parse_size(&s);
+  if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid esi zone size \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+  }
+
+  ctx = ngx_pcalloc(cf->pool, sizeof(ngx_esi_shm_ctx_t));
+  if (ctx == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  emcf->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                         &ngx_http_esi_filter_module);
+  if (emcf->shm_zone == NULL) {
+    return NGX_CONF_ERROR;
+  }
+
+  if (emcf->shm_zone->data) {
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "esi zone \"%V\" is already in use", &name);
+    return NGX_CONF_ERROR;
+  }
+
+  emcf->shm_zone->init = ngx_esi_shm_init_zone;
+  emcf->shm_zone->data = ctx;
+
+  return NGX_CONF_OK;
+}
+
+/*
+ * the origin is the scheme and host of an absolute src, or the first path
+ * segment of a relative one, which is typically the location proxying to it
+ */
+void
+ngx_esi_origin_key(ngx_str_t *uri, ngx_str_t *key)
+{
+  u_char  *p, *last;
+
+  p = uri->data;
+  last = uri->data + uri->len;
+
+  key->data = p;
+
+  if (uri->len > sizeof("http://") - 1
+      && ngx_strncasecmp(p, (u_char *) "http://", sizeof("http://") - 1) == 0)
+  {
+    p += sizeof("http://") - 1;
+  }
+  else if (uri->len > sizeof("https://") - 1
+           && ngx_strncasecmp(p, (u_char *) "https://", sizeof("https://") - 1) == 0)
+  {
+    p += sizeof("https://") - 1;
+  }
+  else if (p < last && *p == '/') {
+    p++;
+  }
+
+  while (p < last && *p != '/' && *p != '?') {
+    p++;
+  }
+
+  key->len = p - key->data;
+}
+
+/*
+ * nodes of both trees start with an ngx_rbtree_node_t keyed on the crc32 of
+ * their name and keep the name as u_short len; u_char name[] at offset off
+ */
+ngx_rbtree_node_t *
+ngx_esi_shm_lookup(ngx_rbtree_t *tree, ngx_str_t *name, uint32_t hash, size_t off)
+{
+  ngx_int_t           rc;
+  u_short            *len;
+  ngx_rbtree_node_t  *node, *sentinel;
+
+  node = tree->root;
+  sentinel = tree->sentinel;
+
+  while (node != sentinel) {
+
+    if (hash < node->key) {
+      node = node->left;
+      continue;
+    }
+
+    if (hash > node->key) {
+      node = node->right;
+      continue;
+    }
+
+    /* hash == node->key */
+
+    len = (u_short *) ((u_char *) node + off);
+
+    rc = ngx_memn2cmp(name->data, (u_char *) (len + 1), name->len, (size_t) *len);
+
+    if (rc == 0) {
+      return node;
+    }
+
+    node = (rc < 0) ? node->left : node->right;
+  }
+
+  return NULL;
+}
+
+/* find the origin node for name, creating it on first use. Origins are never
+ * removed, a template only ever points at a handful of them */
+ngx_esi_origin_t *
+ngx_esi_origin_get(ngx_shm_zone_t *zone, ngx_str_t *name)
+{
+  uint32_t             hash;
+  ngx_esi_shm_ctx_t   *ctx = zone->data;
+  ngx_esi_origin_t    *origin;
+
+  hash = ngx_crc32_short(name->data, name->len);
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+
+  origin = (ngx_esi_origin_t *) ngx_esi_shm_lookup(&ctx->sh->origins, name, hash,
+                                                    offsetof(ngx_esi_origin_t, len));
+
+  if (origin == NULL) {
+    origin = ngx_slab_calloc_locked(ctx->shpool,
+                                    offsetof(ngx_esi_origin_t, name) + name->len);
+    if (origin) {
+      origin->node.key = hash;
+      origin->len = (u_short) name->len;
+      ngx_memcpy(origin->name, name->data, name->len);
+      ngx_rbtree_insert(&ctx->sh->origins, &origin->node);
+    }
+  }
+
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+  return origin;
+}
+
+ngx_int_t
+ngx_esi_origin_acquire(ngx_shm_zone_t *zone, ngx_esi_origin_t *origin,
+                       ngx_uint_t limit, ngx_uint_t queued)
+{
+  ngx_int_t            rc = NGX_BUSY;
+  ngx_esi_shm_ctx_t   *ctx = zone->data;
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+
+  /* a fresh include may not jump ahead of those already waiting */
+  if (origin->active < limit && (queued || origin->queued == 0)) {
+    origin->active++;
+    origin->dispatched++;
+    if (queued) {
+      origin->queued--;
+    }
+    rc = NGX_OK;
+  }
+
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+  return rc;
+}
+
+ngx_int_t
+ngx_esi_origin_enqueue(ngx_shm_zone_t *zone, ngx_esi_origin_t *origin,
+                       ngx_uint_t max)
+{
+  ngx_int_t            rc = NGX_BUSY;
+  ngx_esi_shm_ctx_t   *ctx = zone->data;
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+
+  if (origin->queued < max) {
+    origin->queued++;
+    if (origin->queued > origin->max_queued) {
+      origin->max_queued = origin->queued;
+    }
+    rc = NGX_OK;
+  }
+
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+  return rc;
+}
+
+void
+ngx_esi_origin_dequeue(ngx_shm_zone_t *zone, ngx_esi_origin_t *origin)
+{
+  ngx_esi_shm_ctx_t   *ctx = zone->data;
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+  if (origin->queued) {
+    origin->queued--;
+  }
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+void
+ngx_esi_origin_release(ngx_shm_zone_t *zone, ngx_esi_origin_t *origin)
+{
+  ngx_esi_shm_ctx_t   *ctx = zone->data;
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+  if (origin->active) {
+    origin->active--;
+  }
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+void
+ngx_esi_origin_reject(ngx_shm_zone_t *zone, ngx_esi_origin_t *origin)
+{
+  ngx_esi_shm_ctx_t   *ctx = zone->data;
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+  origin->rejected++;
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+void
+ngx_esi_shm_degrade(ngx_shm_zone_t *zone, ngx_uint_t on)
+{
+  ngx_esi_shm_ctx_t   *ctx = zone->data;
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+  if (on) {
+    ctx->sh->degraded++;
+    ctx->sh->degrade_entered++;
+  }
+  else {
+    if (ctx->sh->degraded) {
+      ctx->sh->degraded--;
+    }
+    ctx->sh->degrade_left++;
+  }
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+static ngx_uint_t
+ngx_esi_latency_bucket(ngx_msec_t ms)
+{
+  ngx_uint_t  i = 0;
+
+  while (ms) {
+    ms >>= 1;
+    i++;
+  }
+
+  return ngx_min(i, NGX_ESI_LATENCY_BUCKETS - 1);
+}
+
+void
+ngx_esi_latency_record(ngx_shm_zone_t *zone, ngx_str_t *key, ngx_msec_t ms)
+{
+  uint32_t             hash;
+  ngx_uint_t           i, n;
+  ngx_queue_t         *q;
+  ngx_esi_shm_ctx_t   *ctx = zone->data;
+  ngx_esi_latency_t   *lat;
+
+  hash = ngx_crc32_short(key->data, key->len);
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+
+  lat = (ngx_esi_latency_t *) ngx_esi_shm_lookup(&ctx->sh->latencies, key, hash,
+                                                  offsetof(ngx_esi_latency_t, len));
+
+  if (lat == NULL) {
+    n = offsetof(ngx_esi_latency_t, name) + key->len;
+
+    lat = ngx_slab_calloc_locked(ctx->shpool, n);
+
+    /* make room by forgetting the fragments that have not been fetched for the longest */
+    for (i = 0; lat == NULL && i < 3 && !ngx_queue_empty(&ctx->sh->latency_lru); i++) {
+      q = ngx_queue_last(&ctx->sh->latency_lru);
+      ngx_queue_remove(q);
+      lat = ngx_queue_data(q, ngx_esi_latency_t, queue);
+      ngx_rbtree_delete(&ctx->sh->latencies, &lat->node);
+      ngx_slab_free_locked(ctx->shpool, lat);
+      lat = ngx_slab_calloc_locked(ctx->shpool, n);
+    }
+
+    if (lat == NULL) {
+      ngx_shmtx_unlock(&ctx->shpool->mutex);
+      return;
+    }
+
+    lat->node.key = hash;
+    lat->len = (u_short) key->len;
+    ngx_memcpy(lat->name, key->data, key->len);
+    ngx_rbtree_insert(&ctx->sh->latencies, &lat->node);
+  }
+  else {
+    ngx_queue_remove(&lat->queue);
+  }
+
+  ngx_queue_insert_head(&ctx->sh->latency_lru, &lat->queue);
+
+  if (lat->samples >= NGX_ESI_LATENCY_WINDOW) {
+    lat->samples = 0;
+    for (i = 0; i < NGX_ESI_LATENCY_BUCKETS; i++) {
+      lat->buckets[i] >>= 1;
+      lat->samples += lat->buckets[i];
+    }
+  }
+
+  lat->buckets[ngx_esi_latency_bucket(ms)]++;
+  lat->samples++;
+
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+/* linear interpolation inside the bucket holding the 99th percentile sample */
+static ngx_msec_t
+ngx_esi_latency_percentile(ngx_esi_latency_t *lat, ngx_uint_t percent)
+{
+  ngx_uint_t  i, target, seen, lo, hi;
+
+  target = (lat->samples * percent + 99) / 100;
+  seen = 0;
+
+  for (i = 0; i < NGX_ESI_LATENCY_BUCKETS; i++) {
+    if (lat->buckets[i] && seen + lat->buckets[i] >= target) {
+      lo = i ? (ngx_uint_t) 1 << (i - 1) : 0;
+      hi = (ngx_uint_t) 1 << i;
+      return (ngx_msec_t) (lo + (hi - lo) * (target - seen) / lat->buckets[i]);
+    }
+    seen += lat->buckets[i];
+  }
+
+  return 0;
+}
+
+ngx_msec_t
+ngx_esi_latency_p99(ngx_shm_zone_t *zone, ngx_str_t *key, ngx_uint_t *samples)
+{
+  uint32_t             hash;
+  ngx_msec_t           ms = 0;
+  ngx_esi_shm_ctx_t   *ctx = zone->data;
+  ngx_esi_latency_t   *lat;
+
+  *samples = 0;
+
+  hash = ngx_crc32_short(key->data, key->len);
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+
+  lat = (ngx_esi_latency_t *) ngx_esi_shm_lookup(&ctx->sh->latencies, key, hash,
+                                                  offsetof(ngx_esi_latency_t, len));
+  if (lat) {
+    *samples = lat->samples;
+    ms = ngx_esi_latency_percentile(lat, 99);
+  }
+
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+  return ms;
+}
+
+static ngx_chain_t *
+ngx_esi_shm_status_latencies(ngx_http_request_t *r, ngx_esi_shm_ctx_t *ctx,
+                             ngx_chain_t *last)
+{
+  ngx_buf_t          *b;
+  ngx_queue_t        *q;
+  ngx_esi_latency_t  *lat;
+
+  for (q = ngx_queue_head(&ctx->sh->latency_lru);
+       q != ngx_queue_sentinel(&ctx->sh->latency_lru) && last;
+       q = ngx_queue_next(q))
+  {
+    lat = ngx_queue_data(q, ngx_esi_latency_t, queue);
+
+    b = ngx_create_temp_buf(r->pool, sizeof("fragment  samples  p50  p99 " CRLF)
+                                     + lat->len + 3 * NGX_ATOMIC_T_LEN);
+    if (b == NULL) {
+      return NULL;
+    }
+
+    b->last = ngx_sprintf(b->last, "fragment %*s samples %ui p50 %M p99 %M" CRLF,
+                          (size_t) lat->len, lat->name, lat->samples,
+                          ngx_esi_latency_percentile(lat, 50),
+                          ngx_esi_latency_percentile(lat, 99));
+
+    last = ngx_chain_append_buffer(r->pool, last, b);
+  }
+
+  return last;
+}
+
+static ngx_chain_t *
+ngx_esi_shm_status_origins(ngx_http_request_t *r, ngx_esi_shm_ctx_t *ctx,
+                           ngx_rbtree_node_t *node, ngx_chain_t *last)
+{
+  ngx_buf_t         *b;
+  ngx_esi_origin_t  *origin;
+
+  if (node == ctx->sh->origins.sentinel || last == NULL) {
+    return last;
+  }
+
+  last = ngx_esi_shm_status_origins(r, ctx, node->left, last);
+  if (last == NULL) {
+    return NULL;
+  }
+
+  origin = (ngx_esi_origin_t *) node;
+
+  b = ngx_create_temp_buf(r->pool, sizeof("origin  active  queued  max_queued"
+                                          "  dispatched  rejected " CRLF)
+                                   + origin->len + 5 * NGX_ATOMIC_T_LEN);
+  if (b == NULL) {
+    return NULL;
+  }
+
+  b->last = ngx_sprintf(b->last, "origin %*s active %ui queued %ui max_queued %ui"
+                        " dispatched %ui rejected %ui" CRLF,
+                        (size_t) origin->len, origin->name,
+                        origin->active, origin->queued, origin->max_queued,
+                        origin->dispatched, origin->rejected);
+
+  last = ngx_chain_append_buffer(r->pool, last, b);
+
+  return ngx_esi_shm_status_origins(r, ctx, node->right, last);
+}
+
+static ngx_int_t
+ngx_esi_shm_status_handler(ngx_http_request_t *r)
+{
+  ngx_int_t                  rc;
+  ngx_chain_t               *out, *last;
+  ngx_buf_t                 *b;
+  ngx_esi_shm_ctx_t         *ctx;
+  ngx_http_esi_main_conf_t  *emcf;
+
+  if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  rc = ngx_http_discard_request_body(r);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  emcf = ngx_http_get_module_main_conf(r, ngx_http_esi_filter_module);
+  if (emcf->shm_zone == NULL) {
+    return NGX_HTTP_NOT_FOUND;
+  }
+
+  ctx = emcf->shm_zone->data;
+
+  ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+  out = last = ngx_alloc_chain_link(r->pool);
+  if (out == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  out->buf = NULL;
+  out->next = NULL;
+
+  b = ngx_create_temp_buf(r->pool, sizeof("esi zone \"\"" CRLF)
+                                   + emcf->shm_zone->shm.name.len
+                                   + sizeof("degraded  entered  left " CRLF)
+                                   + 3 * NGX_INT_T_LEN);
+  if (b == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  b->last = ngx_sprintf(b->last, "esi zone \"%V\"" CRLF,
+                        &emcf->shm_zone->shm.name);
+  last = ngx_chain_append_buffer(r->pool, last, b);
+
+  ngx_shmtx_lock(&ctx->shpool->mutex);
+  b->last = ngx_sprintf(b->last, "degraded %ui entered %ui left %ui" CRLF,
+                        ctx->sh->degraded, ctx->sh->degrade_entered,
+                        ctx->sh->degrade_left);
+  last = ngx_esi_shm_status_origins(r, ctx, ctx->sh->origins.root, last);
+  last = ngx_esi_shm_status_latencies(r, ctx, last);
+  ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+  if (last == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  last->buf->last_buf = (r == r->main) ? 1 : 0;
+  last->buf->last_in_chain = 1;
+
+  r->headers_out.status = NGX_HTTP_OK;
+  r->headers_out.content_length_n = -1;
+
+  rc = ngx_http_send_header(r);
+  if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+    return rc;
+  }
+
+  return ngx_http_output_filter(r, out);
+}
+
+/* esi_status, report the shared origin counters and fragment latencies */
+char *
+ngx_esi_shm_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  ngx_http_core_loc_conf_t  *clcf;
+
+  clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+  clcf->handler = ngx_esi_shm_status_handler;
+
+  return NGX_CONF_OK;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) Todd A. Fisher
+ */
+#ifndef NGX_ESI_SHM_H
+#define NGX_ESI_SHM_H
+
+#include "ngx_http_esi_filter_module.h"
+
+/*
+ * State shared by every worker through the esi_zone shared memory zone.
+ *
+ * Each fragment origin gets a node keyed on the crc32 of its name, e.g.
+ *
+ *  <esi:include src='http://frags.example.com/nav'/>  => "http://frags.example.com"
+ *  <esi:include src='/fragments/nav.html'/>           => "/fragments"
+ *
+ * the node counts fetches in flight and includes waiting for a free slot
+ */
+typedef struct ngx_esi_origin_s {
+  ngx_rbtree_node_t  node;
+  ngx_uint_t         active;     /* fetches in flight across all workers */
+  ngx_uint_t         queued;     /* includes waiting for an active slot */
+  ngx_uint_t         max_queued; /* high water mark of queued */
+  ngx_uint_t         dispatched; /* fetches started */
+  ngx_uint_t         rejected;   /* includes that fell back without fetching */
+  u_short            len;
+  u_char             name[1];
+} ngx_esi_origin_t;
+
+/* buckets of the latency histogram, bucket i counts fetches that took [2^(i-1), 2^i) ms */
+#define NGX_ESI_LATENCY_BUCKETS 24
+/* samples kept before the histogram decays, older samples count for less */
+#define NGX_ESI_LATENCY_WINDOW  1024
+
+/* fetch latency of a fragment, keyed on the include path */
+typedef struct {
+  ngx_rbtree_node_t  node;
+  ngx_queue_t        queue;      /* least recently updated first, evicted when the zone is full */
+  ngx_uint_t         samples;    /* samples in the (decayed) histogram */
+  uint32_t           buckets[NGX_ESI_LATENCY_BUCKETS];
+  u_short            len;
+  u_char             name[1];
+} ngx_esi_latency_t;
+
+typedef struct {
+  ngx_rbtree_t       origins;
+  ngx_rbtree_node_t  sentinel;
+  ngx_rbtree_t       latencies;
+  ngx_rbtree_node_t  latency_sentinel;
+  ngx_queue_t        latency_lru;
+  ngx_uint_t         degraded;          /* workers in degraded mode */
+  ngx_uint_t         degrade_entered;   /* times a worker entered degraded mode */
+  ngx_uint_t         degrade_left;
+} ngx_esi_shctx_t;
+
+typedef struct {
+  ngx_esi_shctx_t   *sh;
+  ngx_slab_pool_t   *shpool;
+} ngx_esi_shm_ctx_t;
+
+char *ngx_esi_shm_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+char *ngx_esi_shm_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+/* find a node whose name is stored as u_short len; u_char name[] at offset off, the zone must be locked */
+ngx_rbtree_node_t *ngx_esi_shm_lookup(ngx_rbtree_t *tree, ngx_str_t *name, uint32_t hash, size_t off);
+
+void ngx_esi_origin_key(ngx_str_t *uri, ngx_str_t *key);
+ngx_esi_origin_t *ngx_esi_origin_get(ngx_shm_zone_t *zone, ngx_str_t *name);
+
+/* take an active slot, NGX_OK on success or NGX_BUSY if limit slots are in use.
+ * when queued is set the caller is giving up its place in the queue */
+ngx_int_t ngx_esi_origin_acquire(ngx_shm_zone_t *zone, ngx_esi_origin_t *origin,
+                                 ngx_uint_t limit, ngx_uint_t queued);
+/* wait for a slot, NGX_OK if there was room in the queue else NGX_BUSY */
+ngx_int_t ngx_esi_origin_enqueue(ngx_shm_zone_t *zone, ngx_esi_origin_t *origin,
+                                 ngx_uint_t max);
+void ngx_esi_origin_dequeue(ngx_shm_zone_t *zone, ngx_esi_origin_t *origin);
+void ngx_esi_origin_release(ngx_shm_zone_t *zone, ngx_esi_origin_t *origin);
+void ngx_esi_origin_reject(ngx_shm_zone_t *zone, ngx_esi_origin_t *origin);
+
+void ngx_esi_latency_record(ngx_shm_zone_t *zone, ngx_str_t *key, ngx_msec_t ms);
+/* estimated 99th percentile latency of key in ms, *samples is set to how many fetches it is based on */
+ngx_msec_t ngx_esi_latency_p99(ngx_shm_zone_t *zone, ngx_str_t *key, ngx_uint_t *samples);
+
+/* count a worker entering (on) or leaving degraded mode */
+void ngx_esi_shm_degrade(ngx_shm_zone_t *zone, ngx_uint_t on);
+
+#endif
@@ -1,158 +1,2820 @@
 #include "ngx_regex.h"
 #include "ngx_esi_tag.h"
 #include "ngx_buf_util.h"
+#include "ngx_esi_shm.h"
+#include "ngx_esi_cache.h"
+#include "ngx_esi_vars.h"
+#include "ngx_esi_expr.h"
+#include "ngx_esi_fetch.h"
 
-ESITag *esi_tag_new(esi_tag_t type, ngx_http_esi_ctx_t *ctx)
+ESITag *esi_tag_push(ngx_http_esi_ctx_t *ctx, esi_tag_t type)
 {
-  ESITag *t = (ESITag*)malloc(sizeof(ESITag));
+  ESITag *t;
+
+  if( ctx->tags == NULL ) {
+    ctx->tags = ngx_palloc( ctx->request->pool, NGX_ESI_TAG_DEPTH * sizeof(ESITag) );
+    if( ctx->tags == NULL ) {
+      return NULL;
+    }
+  }
+
+  if( ctx->ntags == NGX_ESI_TAG_DEPTH ) {
+    return NULL;
+  }
+
+  t = &ctx->tags[ctx->ntags++];
   t->type = type;
   t->ctx = ctx;
-  t->next = NULL;
+  t->try = NULL;
+
+  ctx->open_tag = t;
   return t;
 }
-void esi_tag_free(ESITag *tag)
+
+void esi_tag_pop(ngx_http_esi_ctx_t *ctx, esi_tag_t type)
+{
+  ngx_uint_t i;
+
+  /* mostly the innermost one */
+  for( i = ctx->ntags; i > ctx->tags_base; i-- ) {
+    if( ctx->tags[i - 1].type == type ) {
+      break;
+    }
+  }
+
+  if( i == ctx->tags_base ) {
+    return; /* not open, ignored */
+  }
+
+  while( ctx->ntags >= i ) {
+    ctx->ntags--;
+    esi_tag_close( &ctx->tags[ctx->ntags] );
+  }
+
+  ctx->open_tag = ctx->ntags > ctx->tags_base ? &ctx->tags[ctx->ntags - 1] : NULL;
+}
+
+esi_tag_t esi_tag_str_to_type( const char *tag_name, size_t length )
+{
+  if( !strncmp("esi:try",tag_name,length) ) {
+    return ESI_TRY;
+  }
+  else if( !strncmp("esi:attempt",tag_name,length) ) {
+    return ESI_ATTEMPT;
+  }
+  else if( !strncmp("esi:except",tag_name,length) ) {
+    return ESI_EXCEPT;
+  }
+  else if( !strncmp("esi:include",tag_name,length) ) {
+    return ESI_INCLUDE;
+  }
+  else if( !strncmp("esi:invalidate",tag_name,length) ) {
+    return ESI_INVALIDATE;
+  }
+  else if( !strncmp("esi:vars",tag_name,length) ) {
+    return ESI_VARS;
+  }
+  else if( !strncmp("esi:remove",tag_name,length) ) {
+    return ESI_REMOVE;
+  }
+  else if( !strncmp("esi:choose",tag_name,length) ) {
+    return ESI_CHOOSE;
+  }
+  else if( !strncmp("esi:when",tag_name,length) ) {
+    return ESI_WHEN;
+  }
+  else if( !strncmp("esi:otherwise",tag_name,length) ) {
+    return ESI_OTHERWISE;
+  }
+  else if( !strncmp("esi:comment",tag_name,length) ) {
+    return ESI_COMMENT;
+  }
+  else if( !strncmp("esi:inline",tag_name,length) ) {
+    return ESI_INLINE;
+  }
+  return ESI_NONE;
+}
+
+/* fetches seen before the adaptive timeout trusts the latency histogram */
+#define NGX_HTTP_ESI_TIMEOUT_SAMPLES 20
+/* most fragments asked for in one esi_batch_pass request */
+#define NGX_HTTP_ESI_BATCH_MAX 32
+
+/* script standing in for an include that missed its deadline, it retries while the fetch is still going */
+#define NGX_HTTP_ESI_FALLBACK_SCRIPT_START                                     \
+  "<script>(function(s,u,n){var x=new XMLHttpRequest();"                      \
+  "x.onload=function(){if(x.status==200){var r=document.createRange();"       \
+  "r.selectNode(s);s.parentNode.replaceChild(r.createContextualFragment("     \
+  "x.responseText),s)}else if(n<5){setTimeout(function(){x.open(\"GET\",u);" \
+  "x.send()},++n*500)}};x.open(\"GET\",u);x.send()})(document.currentScript,\"%V"
+#define NGX_HTTP_ESI_FALLBACK_SCRIPT_END "\",0)</script>"
+#define NGX_HTTP_ESI_FALLBACK_SCRIPT                                           \
+  NGX_HTTP_ESI_FALLBACK_SCRIPT_START NGX_HTTP_ESI_FALLBACK_SCRIPT_END
+
+/* placeholder of a deferred include and the script following its fragment */
+#define NGX_HTTP_ESI_PIPE_ELEMENT "<div id=\"esi-pipe-%ui\"></div>"
+#define NGX_HTTP_ESI_PIPE_SCRIPT                                               \
+  "</template><script>(function(s){var t=s.previousElementSibling,"           \
+  "p=document.getElementById(\"esi-pipe-%ui\");"                              \
+  "p.parentNode.replaceChild(t.content,p);t.parentNode.removeChild(t);"       \
+  "s.parentNode.removeChild(s)})(document.currentScript)</script>"
+
+static void ngx_http_esi_include_start(ngx_http_esi_include_t *include);
+static void ngx_http_esi_try_update(ngx_http_esi_try_t *t);
+static void ngx_http_esi_include_resolve(ngx_http_esi_include_t *include, ngx_chain_t *body);
+static void ngx_http_esi_include_error(ngx_http_esi_include_t *include);
+static void ngx_http_esi_include_share(ngx_http_esi_include_t *include, ngx_chain_t *body,
+    ngx_uint_t failed);
+static void esi_tag_vars_flush(ngx_http_esi_ctx_t *ctx);
+static void esi_tag_close_try(ngx_http_esi_ctx_t *ctx);
+
+/* includes of this worker queued for an origin slot, oldest first */
+static ngx_queue_t  ngx_http_esi_waiters;
+
+/* a queued include looks at its origin again after 10ms, 20ms, ... 160ms */
+#define NGX_HTTP_ESI_QUEUE_RECHECK      10
+#define NGX_HTTP_ESI_QUEUE_RECHECK_MAX  160
+
+/* ctx->fetches, by what ngx_http_esi_include_fetch_key makes of the include */
+typedef struct {
+  ngx_str_node_t           sn;
+  ngx_http_esi_include_t  *include;
+} ngx_http_esi_fetch_t;
+
+typedef struct {
+  ngx_rbtree_t             tree;
+  ngx_rbtree_node_t        sentinel;
+} ngx_http_esi_fetches_t;
+
+/*
+ * a slot of origin was given back, the oldest include of this worker queued for
+ * it tries to take it. Slots given back by other workers are seen by the waiters
+ * at their next recheck
+ */
+static void
+ngx_http_esi_origin_wake(ngx_esi_origin_t *origin)
+{
+  ngx_queue_t             *q;
+  ngx_http_esi_include_t  *include;
+
+  if( ngx_http_esi_waiters.next == NULL ) {
+    return;
+  }
+
+  for( q = ngx_queue_head( &ngx_http_esi_waiters );
+       q != ngx_queue_sentinel( &ngx_http_esi_waiters );
+       q = ngx_queue_next( q ) )
+  {
+    include = ngx_queue_data( q, ngx_http_esi_include_t, waiting );
+
+    /* one already woken has this slot in hand, try the next one */
+    if( include->origin == origin && !include->wait.posted ) {
+      ngx_post_event( &include->wait, &ngx_posted_events );
+      return;
+    }
+  }
+}
+
+/* the include stopped waiting for a slot, whether it got one or gave up */
+static void
+ngx_http_esi_include_unqueue(ngx_http_esi_include_t *include)
+{
+  include->queued = 0;
+  ngx_queue_remove( &include->waiting );
+
+  if( include->wait.timer_set ) {
+    ngx_del_timer( &include->wait );
+  }
+  if( include->wait.posted ) {
+    ngx_delete_posted_event( &include->wait );
+  }
+}
+
+/* drop any claim the include holds on its origin */
+static void
+ngx_http_esi_include_release(ngx_http_esi_include_t *include)
+{
+  ngx_http_esi_main_conf_t  *emcf;
+
+  if (!include->active && !include->queued) {
+    return;
+  }
+
+  emcf = ngx_http_get_module_main_conf(include->ctx->request, ngx_http_esi_filter_module);
+
+  if (include->active) {
+    ngx_esi_origin_release(emcf->shm_zone, include->origin);
+    include->active = 0;
+    ngx_http_esi_origin_wake(include->origin);
+  }
+
+  if (include->queued) {
+    ngx_esi_origin_dequeue(emcf->shm_zone, include->origin);
+    ngx_http_esi_include_unqueue(include);
+  }
+}
+
+/* the abandoned subrequest sr is done, or with sr NULL the page is, their origin slots are given back */
+static void
+ngx_http_esi_include_forget(ngx_http_esi_include_t *include, ngx_http_request_t *sr)
+{
+  ngx_http_esi_abandoned_t  *a;
+  ngx_http_esi_main_conf_t  *emcf;
+
+  for( a = include->abandoned; a; a = a->next ) {
+    if( a->origin && (sr == NULL || a->sr == sr) ) {
+      emcf = ngx_http_get_module_main_conf(include->ctx->request, ngx_http_esi_filter_module);
+      ngx_esi_origin_release( emcf->shm_zone, a->origin );
+      ngx_http_esi_origin_wake( a->origin );
+      a->origin = NULL;
+    }
+  }
+}
+
+static void
+ngx_http_esi_include_cleanup_list(ngx_http_esi_include_t *include)
+{
+  ngx_uint_t  i;
+
+  for( ; include; include = include->next ) {
+    if( include->try ) {
+      for( i = 0; i < 3; i++ ) {
+        ngx_http_esi_include_cleanup_list( include->try->includes[i] );
+      }
+    }
+    if( include->wait.timer_set ) {
+      ngx_del_timer( &include->wait );
+    }
+    if( include->wait.posted ) {
+      ngx_delete_posted_event( &include->wait );
+    }
+    if( include->expire.timer_set ) {
+      ngx_del_timer( &include->expire );
+    }
+    if( include->fetch ) {
+      ngx_esi_fetch_cancel( include->fetch );
+      include->fetch = NULL;
+    }
+    ngx_http_esi_include_release( include );
+    ngx_http_esi_include_forget( include, NULL );
+    ngx_http_esi_fetches -= include->fetching;
+    include->fetching = 0;
+  }
+}
+
+/* runs when the request pool is destroyed, an aborted page must not hold origin slots */
+static void
+ngx_http_esi_include_cleanup(void *data)
+{
+  ngx_http_esi_ctx_t        *ctx = data;
+  ngx_http_esi_batch_t      *batch;
+  ngx_http_esi_main_conf_t  *emcf;
+
+  ngx_http_esi_include_cleanup_list( ctx->includes );
+
+  if( ctx->batch_event.posted ) {
+    ngx_delete_posted_event( &ctx->batch_event );
+  }
+
+  emcf = ngx_http_get_module_main_conf(ctx->request, ngx_http_esi_filter_module);
+
+  for( batch = ctx->batches; batch; batch = batch->next ) {
+    if( batch->active ) {
+      ngx_esi_origin_release( emcf->shm_zone, batch->origin );
+      batch->active = 0;
+      ngx_http_esi_origin_wake( batch->origin );
+    }
+    if( batch->fetching ) {
+      batch->fetching = 0;
+      ngx_http_esi_fetches--;
+    }
+  }
+}
+
+/* the placeholder was the last link of its output, appending continues after tail */
+static void
+ngx_http_esi_include_retail(ngx_http_esi_include_t *include, ngx_chain_t *tail)
+{
+  ngx_http_esi_ctx_t  *ctx = include->ctx;
+  ngx_http_esi_try_t  *t = include->owner;
+
+  if( ctx->last_buf == include->link ) {
+    ctx->last_buf = tail;
+  }
+  if( t && t->last[include->branch] == include->link ) {
+    t->last[include->branch] = tail;
+  }
+}
+
+/* the include has its content, pass on what is ready or see if its esi:try can be decided */
+static void
+ngx_http_esi_include_settle(ngx_http_esi_include_t *include)
+{
+  ngx_http_esi_ctx_t  *ctx = include->ctx;
+  ngx_http_esi_try_t  *t = include->owner;
+
+  if( t == NULL ) {
+    while( ctx->pending && ( ctx->pending->done || ctx->pending->deferred ) ) {
+      ctx->pending = ctx->pending->next;
+    }
+    return;
+  }
+
+  if( include->counted ) {
+    include->counted = 0;
+    t->waiting[include->branch]--;
+  }
+
+  ngx_http_esi_try_update( t );
+}
+
+/* a copy of a fragment buffer to link into the page */
+static ngx_buf_t *
+ngx_http_esi_include_buf(ngx_pool_t *pool, ngx_buf_t *buf)
+{
+  ngx_buf_t  *b;
+
+  b = ngx_calloc_buf( pool );
+  if( b == NULL ) {
+    return NULL;
+  }
+  *b = *buf;
+  b->last_buf = 0;
+  b->last_in_chain = 0;
+  b->flush = 0;
+  b->sync = 0;
+  b->shadow = NULL;
+  b->recycled = 0;
+
+  return b;
+}
+
+/*
+ * a deferred fragment arrived, it is queued after the page wrapped in a template
+ * and a script that moves it into its placeholder element. The placeholder is out
+ * already, a fragment that cannot be queued fails the response
+ */
+static ngx_int_t
+ngx_http_esi_include_pipe(ngx_http_esi_include_t *include, ngx_chain_t *body)
+{
+  static u_char        open[] = "<template>";
+  ngx_http_esi_ctx_t  *ctx = include->ctx;
+  ngx_pool_t          *pool = ctx->request->pool;
+  ngx_chain_t         *cl, *out, **ll;
+  ngx_buf_t           *b;
+
+  if( ctx->pipe == NULL ) {
+    ctx->pipe = ctx->pipe_last = ngx_alloc_chain_link( pool );
+    if( ctx->pipe == NULL ) {
+      return NGX_ERROR;
+    }
+    ctx->pipe->buf = NULL;
+    ctx->pipe->next = NULL;
+  }
+
+  /* built aside, ctx->pipe only ever holds whole fragments */
+  b = ngx_calloc_buf( pool );
+  out = ngx_alloc_chain_link( pool );
+  if( b == NULL || out == NULL ) {
+    return NGX_ERROR;
+  }
+  b->pos = open;
+  b->last = open + sizeof(open) - 1;
+  b->memory = 1;
+  out->buf = b;
+  ll = &out->next;
+
+  for( cl = body; cl; cl = cl->next ) {
+    if( ngx_buf_size( cl->buf ) == 0 ) {
+      continue;
+    }
+    b = ngx_http_esi_include_buf( pool, cl->buf );
+    *ll = ngx_alloc_chain_link( pool );
+    if( b == NULL || *ll == NULL ) {
+      return NGX_ERROR;
+    }
+    (*ll)->buf = b;
+    ll = &(*ll)->next;
+  }
+
+  b = ngx_create_temp_buf( pool, sizeof(NGX_HTTP_ESI_PIPE_SCRIPT) + NGX_INT_T_LEN );
+  *ll = ngx_alloc_chain_link( pool );
+  if( b == NULL || *ll == NULL ) {
+    return NGX_ERROR;
+  }
+  b->last = ngx_sprintf( b->last, NGX_HTTP_ESI_PIPE_SCRIPT, include->pipe_id );
+  (*ll)->buf = b;
+  (*ll)->next = NULL;
+
+  /* the empty head link of ctx->pipe takes the first buffer */
+  if( ctx->pipe_last->buf == NULL ) {
+    *ctx->pipe_last = *out;
+  }
+  else {
+    ctx->pipe_last->next = out;
+  }
+  ctx->pipe_last = *ll;
+
+  include->done = 1;
+  ctx->piped--;
+
+  return NGX_OK;
+}
+
+/* pipe the fragment, or fail the response if it cannot be */
+static void
+ngx_http_esi_include_stream(ngx_http_esi_include_t *include, ngx_chain_t *body)
+{
+  ngx_http_esi_ctx_t  *ctx = include->ctx;
+
+  if( ngx_http_esi_include_pipe( include, body ) != NGX_OK ) {
+    ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0,
+                  "esi:include \"%V\" could not be streamed after the page", &include->uri);
+    ctx->error = 1;
+  }
+}
+
+/* longest marker ngx_http_esi_include_markup looks for, less one */
+#define NGX_HTTP_ESI_MARKUP_HELD  (sizeof("<!--esi") - 2)
+
+/* is there a marker in [p,last) */
+static ngx_uint_t
+ngx_http_esi_markup_in(u_char *p, u_char *last)
+{
+  for( ; ( p = ngx_strlchr( p, last, '<' ) ) != NULL; p++ ) {
+    if( ( last - p >= 5 && ngx_strncmp( p, "<esi:", 5 ) == 0 )
+        || ( last - p >= 7 && ngx_strncmp( p, "<!--esi", 7 ) == 0 ) ) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* does the fragment hold esi markup that has to be processed */
+static ngx_uint_t
+ngx_http_esi_include_markup(ngx_chain_t *body)
+{
+  u_char        seam[2 * NGX_HTTP_ESI_MARKUP_HELD];
+  size_t        held = 0, size, n;
+  ngx_chain_t  *cl;
+
+  for( cl = body; cl; cl = cl->next ) {
+    if( !ngx_buf_in_memory( cl->buf ) ) {
+      return 0;
+    }
+  }
+
+  for( cl = body; cl; cl = cl->next ) {
+    size = cl->buf->last - cl->buf->pos;
+
+    /* a marker cut by the end of the buffers before, kept as their last few bytes */
+    n = ngx_min( size, NGX_HTTP_ESI_MARKUP_HELD );
+    ngx_memcpy( seam + held, cl->buf->pos, n );
+    if( held && ngx_http_esi_markup_in( seam, seam + held + n ) ) {
+      return 1;
+    }
+
+    if( ngx_http_esi_markup_in( cl->buf->pos, cl->buf->last ) ) {
+      return 1;
+    }
+
+    if( size >= NGX_HTTP_ESI_MARKUP_HELD ) {
+      ngx_memcpy( seam, cl->buf->last - NGX_HTTP_ESI_MARKUP_HELD, NGX_HTTP_ESI_MARKUP_HELD );
+      held = NGX_HTTP_ESI_MARKUP_HELD;
+    }
+    else if( held + n > NGX_HTTP_ESI_MARKUP_HELD ) {
+      ngx_memmove( seam, seam + held + n - NGX_HTTP_ESI_MARKUP_HELD, NGX_HTTP_ESI_MARKUP_HELD );
+      held = NGX_HTTP_ESI_MARKUP_HELD;
+    }
+    else {
+      held += n;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * the fragment holds esi markup, it is parsed in place by a parser of its own.
+ * The include becomes the slot of an esi:try with only an attempt, the includes
+ * found in the fragment are started as soon as the parser reaches them and the
+ * slot is filled once they are all in
+ */
+static ngx_int_t
+ngx_http_esi_include_expand(ngx_http_esi_include_t *include, ngx_chain_t *body)
+{
+  ngx_uint_t           i;
+  ngx_chain_t         *cl;
+  ngx_http_esi_try_t  *t;
+  ESIParser           *parser;
+  ngx_http_esi_ctx_t   saved;
+  ngx_http_esi_ctx_t  *ctx = include->ctx;
+  ngx_pool_t          *pool = ctx->request->pool;
+
+  t = ngx_pcalloc( pool, sizeof(ngx_http_esi_try_t) );
+  if( t == NULL ) {
+    return NGX_ERROR;
+  }
+
+  for( i = 0; i < 3; i++ ) {
+    t->out[i] = t->last[i] = ngx_alloc_chain_link( pool );
+    if( t->out[i] == NULL ) {
+      return NGX_ERROR;
+    }
+    t->out[i]->buf = NULL;
+    t->out[i]->next = NULL;
+  }
+
+  parser = ngx_http_esi_parser_create( ctx );
+  if( parser == NULL ) {
+    return NGX_ERROR;
+  }
+
+  t->slot = include;
+  t->fragment = 1;
+  t->active = 1;
+  t->attempted = 1;
+  include->try = t;
+  include->expanded = 1;
+
+  /* the page parser may be anywhere, the fragment starts from a clean state */
+  saved = *ctx;
+
+  ctx->parser = parser;
+  ctx->tags_base = ctx->ntags;
+  ctx->open_tag = NULL;
+  ctx->try = t;
+  ctx->branch = NGX_HTTP_ESI_ATTEMPT;
+  ctx->last_buf = t->last[NGX_HTTP_ESI_ATTEMPT];
+  ctx->choose = NULL;
+  ctx->skip = 0;
+  ctx->inline_fragment = NULL;
+  ctx->vars_text = NULL;
+  ctx->fragment = include;
+
+  for( cl = body; cl; cl = cl->next ) {
+    esi_parser_execute( parser, (const char*)cl->buf->pos, (size_t)ngx_buf_size( cl->buf ) );
+  }
+  esi_parser_finish( parser );
+  ngx_http_esi_parser_release( parser );
+
+  /* close what the fragment left open */
+  esi_tag_vars_flush( ctx );
+  while( ctx->try != t ) {
+    esi_tag_close_try( ctx );
+  }
+
+  t->last[NGX_HTTP_ESI_ATTEMPT] = ctx->last_buf;
+  t->closed = 1;
+
+  ctx->parser = saved.parser;
+  ctx->ntags = saved.ntags;
+  ctx->tags_base = saved.tags_base;
+  ctx->open_tag = saved.open_tag;
+  ctx->deep = saved.deep;
+  ctx->try = saved.try;
+  ctx->branch = saved.branch;
+  ctx->last_buf = saved.last_buf;
+  ctx->choose = saved.choose;
+  ctx->skip = saved.skip;
+  ctx->inline_fragment = saved.inline_fragment;
+  ctx->vars_text = saved.vars_text;
+  ctx->fragment = saved.fragment;
+
+  /* the page output may have to move past the slot, so only now */
+  ngx_http_esi_try_update( t );
+
+  return NGX_OK;
+}
+
+/*
+ * fill the include placeholder with the fragment body, the buffers are
+ * linked into the output chain in place of the placeholder
+ */
+static void
+ngx_http_esi_include_resolve(ngx_http_esi_include_t *include, ngx_chain_t *body)
+{
+  ngx_http_esi_ctx_t       *ctx = include->ctx;
+  ngx_pool_t               *pool = ctx->request->pool;
+  ngx_chain_t              *link = include->link;
+  ngx_chain_t              *next = link->next;
+  ngx_chain_t              *cl, *nl;
+  ngx_buf_t                *b;
+  ngx_uint_t                first = 1;
+  size_t                    size = 0;
+  ngx_http_esi_loc_conf_t  *slcf;
+
+  include->body = body;
+  ngx_http_esi_include_share( include, body, 0 );
+
+  slcf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_esi_filter_module);
+
+  for( cl = body; cl; cl = cl->next ) {
+    size += ngx_buf_size( cl->buf );
+  }
+
+  /* esi_max_bytes is shared by all fragments of the page, nested ones included */
+  if( slcf->max_bytes && ctx->fragment_bytes + size > slcf->max_bytes ) {
+    ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0,
+                  "esi:include \"%V\" dropped, page is over esi_max_bytes", &include->uri);
+    body = NULL;
+  }
+  else {
+    ctx->fragment_bytes += size;
+  }
+
+  /* leaf fragments, most of them, are linked in without a parser */
+  if( body && include->markup
+      && ngx_http_esi_include_expand( include, body ) == NGX_OK ) {
+    return;
+  }
+
+  if( include->deferred ) {
+    ngx_http_esi_include_stream( include, body );
+    return;
+  }
+
+  for( cl = body; cl; cl = cl->next ) {
+    if( ngx_buf_size( cl->buf ) == 0 ) {
+      continue;
+    }
+
+    b = ngx_http_esi_include_buf( pool, cl->buf );
+    if( b == NULL ) {
+      break;
+    }
+
+    if( first ) {
+      link->buf = b;
+      first = 0;
+      continue;
+    }
+
+    nl = ngx_alloc_chain_link( pool );
+    if( nl == NULL ) {
+      break;
+    }
+    nl->buf = b;
+    link->next = nl;
+    link = nl;
+  }
+
+  link->next = next;
+  if( next == NULL ) {
+    ngx_http_esi_include_retail( include, link );
+  }
+
+  include->done = 1;
+
+  ngx_http_esi_include_settle( include );
+}
+
+/*
+ * decide the esi:try once the parser is past it and the part it will be filled with
+ * has all its includes. The part's output is linked in after the slot as is
+ */
+static void
+ngx_http_esi_try_update(ngx_http_esi_try_t *t)
+{
+  ngx_uint_t               b, i;
+  ngx_chain_t             *link, *tail;
+  ngx_http_esi_try_t      *owner;
+  ngx_http_esi_include_t  *slot = t->slot;
+  ngx_http_esi_ctx_t      *ctx = slot->ctx;
+
+  if( slot->done || !t->active || !t->closed ) {
+    return;
+  }
+
+  b = t->failed ? NGX_HTTP_ESI_EXCEPT : NGX_HTTP_ESI_ATTEMPT;
+  if( t->waiting[b] ) {
+    return;
+  }
+
+  link = slot->link;
+  tail = t->last[b];
+
+  if( slot->deferred ) {
+    /* a deferred fragment with esi markup, its placeholder element is out already */
+    ngx_http_esi_include_stream( slot, t->out[b]->buf ? t->out[b] : NULL );
+  }
+  else if( t->out[b]->buf ) {
+    tail->next = link->next;
+    link->next = t->out[b];
+    if( tail->next == NULL ) {
+      ngx_http_esi_include_retail( slot, tail );
+    }
+  }
+
+  /*
+   * the parts not taken were never output, their esi_buffers buffers are free again.
+   * Those of the part taken belong to the enclosing part until that is decided too
+   */
+  owner = slot->owner;
+  for( i = 0; i < 3; i++ ) {
+    if( t->pooled[i] == NULL ) {
+      continue;
+    }
+
+    if( i != b || (owner && owner->slot->done
+                   && slot->branch != (owner->failed ? NGX_HTTP_ESI_EXCEPT : NGX_HTTP_ESI_ATTEMPT)) )
+    {
+      t->pooled_last[i]->next = ctx->free;
+      ctx->free = t->pooled[i];
+    }
+    else if( owner && !owner->slot->done ) {
+      if( owner->pooled[slot->branch] ) {
+        owner->pooled_last[slot->branch]->next = t->pooled[i];
+      }
+      else {
+        owner->pooled[slot->branch] = t->pooled[i];
+      }
+      owner->pooled_last[slot->branch] = t->pooled_last[i];
+    }
+
+    t->pooled[i] = NULL;
+  }
+
+  slot->done = 1;
+
+  ngx_http_esi_include_settle( slot );
+}
+
+/* can includes in this part of the esi:try be fetched */
+static ngx_uint_t
+ngx_http_esi_try_live(ngx_http_esi_try_t *t, ngx_uint_t branch)
+{
+  if( t == NULL ) {
+    return 1;
+  }
+
+  if( !t->active ) {
+    return 0;
+  }
+
+  switch( branch ) {
+    case NGX_HTTP_ESI_ATTEMPT:
+      return !t->failed;
+    case NGX_HTTP_ESI_EXCEPT:
+      return t->failed;
+    default:
+      return 0;
+  }
+}
+
+static void ngx_http_esi_include_activate(ngx_http_esi_include_t *include);
+
+/* an include of the attempt failed, the except is fetched now and the attempt is dropped */
+static void
+ngx_http_esi_try_fail(ngx_http_esi_try_t *t)
+{
+  ngx_http_esi_include_t  *include;
+
+  if( t->failed ) {
+    return;
+  }
+
+  t->failed = 1;
+
+  if( t->active ) {
+    for( include = t->includes[NGX_HTTP_ESI_EXCEPT]; include; include = include->next ) {
+      ngx_http_esi_include_activate( include );
+    }
+  }
+
+  ngx_http_esi_try_update( t );
+}
+
+/* the fragment could not be fetched, it renders empty and raises an exception for the enclosing attempt */
+static void
+ngx_http_esi_include_error(ngx_http_esi_include_t *include)
+{
+  ngx_uint_t                branch;
+  ngx_http_esi_try_t       *t;
+  ngx_http_esi_ctx_t       *ctx = include->ctx;
+  ngx_http_esi_loc_conf_t  *slcf;
+
+  if( include->stale_copy ) {
+    /* stale if error, an old copy beats an empty fragment */
+    ngx_log_error(NGX_LOG_INFO, ctx->request->connection->log, 0,
+                  "esi:include \"%V\" failed, serving expired copy", &include->uri);
+    ngx_http_esi_include_resolve( include, include->stale_copy->buf ? include->stale_copy : NULL );
+    return;
+  }
+
+  include->failed = 1;
+  ngx_http_esi_include_share( include, NULL, 1 );
+
+  slcf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_esi_filter_module);
+
+  if( !include->optional && !slcf->silent_errors ) {
+    ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0,
+                  "esi:include \"%V\" failed", &include->uri);
+
+    /* a fragment has no except of its own, the exception goes up to the esi:try around it */
+    t = include->owner;
+    branch = include->branch;
+    while( t && t->fragment ) {
+      branch = t->slot->branch;
+      t = t->slot->owner;
+    }
+
+    /* failed before the placeholder settles, or the attempt could be taken without it */
+    if( t && branch == NGX_HTTP_ESI_ATTEMPT ) {
+      ngx_http_esi_try_fail( t );
+    }
+  }
+
+  ngx_http_esi_include_resolve( include, NULL );
+}
+
+/* switch to the alt src, returns 0 when there is nothing left to try */
+static ngx_uint_t
+ngx_http_esi_include_use_alt(ngx_http_esi_include_t *include)
+{
+  ngx_uint_t  flags = 0;
+
+  if( include->use_alt || include->alt.len == 0 ) {
+    return 0;
+  }
+
+  include->use_alt = 1;
+  include->origin = NULL;
+  include->uri = include->alt;
+  include->args.len = 0;
+  include->args.data = NULL;
+
+  if( ngx_http_parse_unsafe_uri(include->ctx->request, &include->uri, &include->args, &flags) != NGX_OK ) {
+    return 0;
+  }
+
+  return 1;
+}
+
+static ngx_chain_t *
+ngx_http_esi_include_body(ngx_http_request_t *sr)
+{
+  ngx_buf_t    *b;
+  ngx_chain_t  *cl;
+
+  /* newer nginx collects in memory subrequest output here for any handler */
+  if( sr->out ) {
+    return sr->out;
+  }
+
+  if( sr->upstream == NULL ) {
+    return NULL;
+  }
+
+  b = ngx_calloc_buf( sr->pool );
+  cl = ngx_alloc_chain_link( sr->pool );
+  if( b == NULL || cl == NULL ) {
+    return NULL;
+  }
+
+  b->pos = sr->upstream->buffer.pos;
+  b->last = sr->upstream->buffer.last;
+  b->memory = 1;
+
+  cl->buf = b;
+  cl->next = NULL;
+
+  return cl;
+}
+
+/*
+ * the origin tells the fragment is a leaf by sending Surrogate-Control
+ * without content="ESI/1.0", the body is then not even scanned
+ */
+static ngx_uint_t
+ngx_http_esi_include_plain(ngx_http_request_t *sr)
+{
+  ngx_uint_t        i;
+  ngx_list_part_t  *part;
+  ngx_table_elt_t  *h;
+
+  part = &sr->headers_out.headers.part;
+  h = part->elts;
+
+  for( i = 0; /* void */ ; i++ ) {
+    if( i >= part->nelts ) {
+      if( part->next == NULL ) {
+        break;
+      }
+      part = part->next;
+      h = part->elts;
+      i = 0;
+    }
+
+    if( h[i].hash == 0 || h[i].key.len != sizeof("Surrogate-Control") - 1
+        || ngx_strncasecmp( h[i].key.data, (u_char *) "Surrogate-Control", h[i].key.len ) != 0 ) {
+      continue;
+    }
+
+    return ngx_strlcasestrn( h[i].value.data, h[i].value.data + h[i].value.len,
+                             (u_char *) "ESI/1.0", sizeof("ESI/1.0") - 2 ) == NULL;
+  }
+
+  return 0;
+}
+
+/* keep a copy of a fetched fragment for later pages */
+static void
+ngx_http_esi_include_store(ngx_http_esi_include_t *include, ngx_chain_t *body)
+{
+  time_t                     fresh, stale;
+  ngx_uint_t                 flags;
+  ngx_http_request_t        *r = include->ctx->request;
+  ngx_http_esi_main_conf_t  *emcf;
+  ngx_http_esi_loc_conf_t   *slcf;
+
+  emcf = ngx_http_get_module_main_conf(r, ngx_http_esi_filter_module);
+  if( emcf->cache_zone == NULL || include->use_alt ) {
+    return;
+  }
+
+  if( include->has_max_age ) {
+    fresh = include->max_age;
+    stale = include->max_stale;
+  }
+  else {
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_esi_filter_module);
+    fresh = slcf->cache_valid;
+    stale = slcf->cache_stale;
+  }
+
+  /* a late fragment the client is waiting for is stored already expired, only esi_fragment serves it */
+  if( fresh == 0 && stale == 0 && !include->fallback ) {
+    return;
+  }
+
+  flags = ( include->markup ? NGX_ESI_CACHE_MARKUP : 0 ) | ( include->personal ? NGX_ESI_CACHE_PRIVATE : 0 );
+
+  if( ngx_esi_cache_put( emcf->cache_zone, &include->key, body, fresh, stale, flags ) != NGX_OK ) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "esi:include \"%V\" not cached", &include->key);
+  }
+}
+
+/* the fetch failed, try the alt src or give up on the fragment */
+static void
+ngx_http_esi_include_failed(ngx_http_esi_include_t *include)
+{
+  if( include->done || include->expanded ) {
+    /* a failed refresh leaves the cached copy as it is */
+    return;
+  }
+
+  if( ngx_http_esi_include_use_alt( include ) ) {
+    /* the alt fetch is started from an event, not from within this subrequest */
+    ngx_post_event( &include->wait, &ngx_posted_events );
+    return;
+  }
+
+  ngx_http_esi_include_error( include );
+}
+
+/* the fragment is in, markup tells whether it holds esi markup */
+static void
+ngx_http_esi_include_fetched(ngx_http_esi_include_t *include, ngx_chain_t *body, ngx_uint_t markup)
+{
+  include->markup = markup;
+
+  ngx_http_esi_include_store( include, body );
+
+  if( !include->done && !include->expanded ) {
+    ngx_http_esi_include_resolve( include, body );
+  }
+}
+
+/* late fragments are measured too, they are what the timeout has to learn from */
+static void
+ngx_http_esi_include_latency(ngx_http_request_t *sr, ngx_str_t *uri)
+{
+  ngx_msec_int_t             ms;
+  ngx_time_t                *tp;
+  ngx_http_esi_main_conf_t  *emcf;
+
+  emcf = ngx_http_get_module_main_conf(sr, ngx_http_esi_filter_module);
+  if( emcf->shm_zone ) {
+    tp = ngx_timeofday();
+    ms = (ngx_msec_int_t) ((tp->sec - sr->start_sec) * 1000 + (tp->msec - sr->start_msec));
+    ngx_esi_latency_record( emcf->shm_zone, uri, (ngx_msec_t) ngx_max(ms, 0) );
+  }
+}
+
+static ngx_int_t
+ngx_http_esi_include_done(ngx_http_request_t *sr, void *data, ngx_int_t rc)
+{
+  ngx_chain_t               *body;
+  ngx_http_esi_include_t    *include = data;
+
+  if( include->fetching ) {
+    include->fetching--;
+    ngx_http_esi_fetches--;
+  }
+
+  ngx_http_esi_include_latency( sr, &sr->uri );
+
+  if( sr != include->sr ) {
+    /* abandoned after a timeout, only its origin slot was still held */
+    ngx_http_esi_include_forget( include, sr );
+    return rc;
+  }
+
+  include->sr = NULL;
+  ngx_http_esi_include_release( include );
+
+  if( include->expire.timer_set ) {
+    ngx_del_timer( &include->expire );
+  }
+
+  if( rc == NGX_ERROR || sr->connection->error
+      || sr->headers_out.status >= NGX_HTTP_SPECIAL_RESPONSE )
+  {
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, sr->connection->log, 0,
+                   "esi:include \"%V\" returned %ui", &include->uri, sr->headers_out.status);
+
+    ngx_http_esi_include_failed( include );
+  }
+  else {
+    body = ngx_http_esi_include_body( sr );
+
+    /* found once here, cached copies keep it */
+    ngx_http_esi_include_fetched( include, body,
+                                  !ngx_http_esi_include_plain( sr ) && ngx_http_esi_include_markup( body ) );
+  }
+
+  /* a background subrequest does not wake the page when it is done */
+  ngx_http_post_request( include->ctx->request, NULL );
+
+  return rc;
+}
+
+/* an esi_fragment_pass fetch is in, it ends as a subrequest would in include_done */
+static void
+ngx_http_esi_include_fetch_done(ngx_esi_fetch_t *fetch)
+{
+  ngx_connection_t          *c;
+  ngx_http_esi_include_t    *include = fetch->data;
+  ngx_http_request_t        *r = include->ctx->request;
+  ngx_http_esi_main_conf_t  *emcf;
+
+  include->fetch = NULL;
+
+  if( include->fetching ) {
+    include->fetching--;
+    ngx_http_esi_fetches--;
+  }
+
+  emcf = ngx_http_get_module_main_conf(r, ngx_http_esi_filter_module);
+  if( emcf->shm_zone ) {
+    ngx_esi_latency_record( emcf->shm_zone, &include->uri, ngx_current_msec - include->started );
+  }
+
+  ngx_http_esi_include_release( include );
+
+  if( include->expire.timer_set ) {
+    ngx_del_timer( &include->expire );
+  }
+
+  if( fetch->status == 0 || fetch->status >= NGX_HTTP_SPECIAL_RESPONSE ) {
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "esi:include \"%V\" returned %ui", &include->uri, fetch->status);
+
+    ngx_http_esi_include_failed( include );
+  }
+  else {
+    ngx_http_esi_include_fetched( include, fetch->body,
+                                  !fetch->plain && ngx_http_esi_include_markup( fetch->body ) );
+  }
+
+  /* called from an event of the upstream connection, the page is run from here */
+  c = r->connection;
+  ngx_http_post_request( r, NULL );
+  ngx_http_run_posted_requests( c );
+}
+
+/*
+ * the explicit timeout attribute wins, otherwise with esi_adaptive_timeout the
+ * p99 latency seen for the fragment scaled by esi_adaptive_timeout_factor and
+ * clamped to [esi_adaptive_timeout_min, esi_adaptive_timeout_max].
+ * Until enough fetches have been seen the max is used, 0 means no timeout
+ */
+static ngx_msec_t
+ngx_http_esi_include_timeout(ngx_http_esi_include_t *include)
+{
+  ngx_uint_t                 samples;
+  ngx_msec_t                 p99, timeout;
+  ngx_http_request_t        *r = include->ctx->request;
+  ngx_http_esi_main_conf_t  *emcf;
+  ngx_http_esi_loc_conf_t   *slcf;
+
+  if( include->timeout ) {
+    return include->timeout;
+  }
+
+  emcf = ngx_http_get_module_main_conf(r, ngx_http_esi_filter_module);
+  slcf = ngx_http_get_module_loc_conf(r, ngx_http_esi_filter_module);
+
+  if( !slcf->adaptive_timeout || emcf->shm_zone == NULL ) {
+    return 0;
+  }
+
+  p99 = ngx_esi_latency_p99( emcf->shm_zone, &include->uri, &samples );
+
+  if( samples < NGX_HTTP_ESI_TIMEOUT_SAMPLES ) {
+    timeout = slcf->timeout_max;
+  }
+  else {
+    timeout = p99 * slcf->timeout_factor / 100;
+    timeout = ngx_max( timeout, slcf->timeout_min );
+    timeout = ngx_min( timeout, slcf->timeout_max );
+  }
+
+  ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                 "esi:include \"%V\" timeout %M, p99 %M over %ui samples",
+                 &include->uri, timeout, p99, samples);
+
+  return timeout;
+}
+
+/*
+ * start the subrequest for the include, or its esi_fragment_pass fetch, once
+ * the origin has a free slot.
+ *
+ * returns NGX_OK once the fetch is started, NGX_AGAIN while the include waits in
+ * the origin queue and NGX_DECLINED if the origin is saturated or the fetch failed
+ */
+static ngx_int_t
+ngx_http_esi_include_dispatch(ngx_http_esi_include_t *include)
+{
+  ngx_int_t                      rc;
+  ngx_uint_t                     flags;
+  ngx_str_t                      key;
+  ngx_msec_t                     timeout;
+  ngx_msec_int_t                 left;
+  ngx_http_request_t            *sr;
+  ngx_http_request_t            *r = include->ctx->request;
+  ngx_http_post_subrequest_t    *psr;
+  ngx_http_esi_main_conf_t      *emcf;
+  ngx_http_esi_loc_conf_t       *slcf;
+
+  emcf = ngx_http_get_module_main_conf(r, ngx_http_esi_filter_module);
+  slcf = ngx_http_get_module_loc_conf(r, ngx_http_esi_filter_module);
+
+  if( slcf->origin_limit && emcf->shm_zone ) {
+
+    if( include->origin == NULL ) {
+      ngx_esi_origin_key( &include->uri, &key );
+      include->origin = ngx_esi_origin_get( emcf->shm_zone, &key );
+    }
+
+    /* a full zone only costs us the limit, never the fragment */
+    if( include->origin ) {
+
+      rc = ngx_esi_origin_acquire( emcf->shm_zone, include->origin,
+                                   slcf->origin_limit, include->queued );
+
+      if( rc == NGX_BUSY ) {
+
+        if( !include->queued && slcf->origin_queue
+            && ngx_esi_origin_enqueue( emcf->shm_zone, include->origin, slcf->origin_queue ) == NGX_OK )
+        {
+          if( ngx_http_esi_waiters.next == NULL ) {
+            ngx_queue_init( &ngx_http_esi_waiters );
+          }
+          ngx_queue_insert_tail( &ngx_http_esi_waiters, &include->waiting );
+          include->queued = 1;
+          include->deadline = ngx_current_msec + slcf->origin_queue_timeout;
+          include->recheck = NGX_HTTP_ESI_QUEUE_RECHECK;
+        }
+
+        /*
+         * woken at once when a slot of this worker is given back, the timer backs off
+         * to catch those of other workers and ends the wait at the deadline
+         */
+        if( include->queued ) {
+          left = (ngx_msec_int_t) (include->deadline - ngx_current_msec);
+          if( left > 0 ) {
+            if( !include->wait.timer_set ) {
+              ngx_add_timer( &include->wait, ngx_min( (ngx_msec_t) left, include->recheck ) );
+              include->recheck = ngx_min( include->recheck * 2, NGX_HTTP_ESI_QUEUE_RECHECK_MAX );
+            }
+            return NGX_AGAIN;
+          }
+          ngx_esi_origin_dequeue( emcf->shm_zone, include->origin );
+          ngx_http_esi_include_unqueue( include );
+        }
+
+        ngx_esi_origin_reject( emcf->shm_zone, include->origin );
+
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "esi origin \"%*s\" is saturated, esi:include \"%V\" rejected",
+                      (size_t) include->origin->len, include->origin->name, &include->uri);
+
+        return NGX_DECLINED;
+      }
+
+      if( include->queued ) {
+        ngx_http_esi_include_unqueue( include );
+      }
+      include->active = 1;
+    }
+  }
+
+  timeout = ngx_http_esi_include_timeout( include );
+
+  if( slcf->fragment_pass ) {
+    include->fetch = ngx_esi_fetch_start( slcf->fragment_pass, r->pool, r->connection->log,
+                                          &include->uri, &include->args, timeout,
+                                          ngx_http_esi_include_fetch_done, include );
+    if( include->fetch == NULL ) {
+      ngx_http_esi_include_release( include );
+      return NGX_DECLINED;
+    }
+  }
+  else {
+    psr = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+    if( psr == NULL ) {
+      ngx_http_esi_include_release( include );
+      return NGX_DECLINED;
+    }
+    psr->handler = ngx_http_esi_include_done;
+    psr->data = include;
+
+    flags = NGX_HTTP_SUBREQUEST_IN_MEMORY;
+#ifdef NGX_HTTP_SUBREQUEST_BACKGROUND
+    /*
+     * the placeholders keep the document in order, the postpone filter would
+     * otherwise hold back the page behind a fragment that was already given up on
+     */
+    flags |= NGX_HTTP_SUBREQUEST_BACKGROUND;
+#endif
+
+    rc = ngx_http_subrequest(r, &include->uri, &include->args, &sr, psr, flags);
+    if( rc != NGX_OK ) {
+      ngx_http_esi_include_release( include );
+      return NGX_DECLINED;
+    }
+
+    include->sr = sr;
+  }
+
+  include->fetching++;
+  ngx_http_esi_fetches++;
+
+  include->started = ngx_current_msec;
+
+  if( timeout ) {
+    if( include->expire.timer_set ) {
+      ngx_del_timer( &include->expire );
+    }
+    ngx_add_timer( &include->expire, timeout );
+  }
+
+  return NGX_OK;
+}
+
+/* start fetching the include, falling back to the alt src and finally to an empty fragment */
+static void
+ngx_http_esi_include_start(ngx_http_esi_include_t *include)
+{
+  ngx_int_t  rc;
+
+  do {
+    rc = ngx_http_esi_include_dispatch( include );
+    if( rc == NGX_OK || rc == NGX_AGAIN ) {
+      return;
+    }
+  } while( !include->revalidate && ngx_http_esi_include_use_alt( include ) );
+
+  if( !include->done && !include->expanded ) {
+    ngx_http_esi_include_error( include );
+  }
+}
+
+/*
+ * serve the include from the fragment cache, returns NGX_OK if the placeholder
+ * was filled and NGX_DECLINED if the fragment has to be fetched.
+ *
+ * A stale copy is served while one page refreshes it in the background. In
+ * degraded mode any copy is served no matter its age without a refresh, and
+ * an optional fragment that is not cached renders empty as it would on error
+ */
+static ngx_int_t
+ngx_http_esi_include_cached(ngx_http_esi_include_t *include)
+{
+  ngx_uint_t                 degraded, refresh, flags;
+  ngx_chain_t               *body;
+  ngx_http_request_t        *r = include->ctx->request;
+  ngx_http_esi_main_conf_t  *emcf;
+  ngx_esi_cache_status_e     status;
+
+  emcf = ngx_http_get_module_main_conf(r, ngx_http_esi_filter_module);
+
+  degraded = ngx_http_esi_degraded( r );
+
+  if( emcf->cache_zone == NULL ) {
+    status = NGX_ESI_CACHE_MISS;
+  }
+  else {
+    status = ngx_esi_cache_get( emcf->cache_zone, &include->key, r->pool, &body, &refresh, &flags );
+    include->markup = ( flags & NGX_ESI_CACHE_MARKUP ) ? 1 : 0;
+  }
+
+  ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                 "esi:include \"%V\" cache %ui degraded %ui",
+                 &include->key, (ngx_uint_t) status, degraded);
+
+  switch( status ) {
+    case NGX_ESI_CACHE_FRESH:
+      ngx_http_esi_include_resolve( include, body );
+      return NGX_OK;
+
+    case NGX_ESI_CACHE_STALE:
+      ngx_http_esi_include_resolve( include, body );
+      if( refresh && !degraded ) {
+        include->revalidate = 1;
+        ngx_http_esi_include_start( include );
+      }
+      return NGX_OK;
+
+    case NGX_ESI_CACHE_EXPIRED:
+      if( degraded ) {
+        ngx_http_esi_include_resolve( include, body );
+        return NGX_OK;
+      }
+      /* kept in case the fetch fails */
+      include->stale_copy = ngx_alloc_chain_link( r->pool );
+      if( include->stale_copy ) {
+        include->stale_copy->buf = body ? body->buf : NULL;
+        include->stale_copy->next = NULL;
+      }
+      return NGX_DECLINED;
+
+    default:
+      if( degraded && include->optional ) {
+        /* the src is not fetched while degraded, its alt still may be */
+        if( ngx_http_esi_include_use_alt( include ) ) {
+          return NGX_DECLINED;
+        }
+        ngx_http_esi_include_resolve( include, NULL );
+        return NGX_OK;
+      }
+      return NGX_DECLINED;
+  }
+}
+
+/* esi_bigpipe, only includes outside of esi:try as the try has to be decided in place */
+static ngx_uint_t
+ngx_http_esi_include_pipeable(ngx_http_esi_include_t *include)
+{
+  ngx_http_request_t       *r = include->ctx->request;
+  ngx_http_esi_loc_conf_t  *slcf;
+
+  if( include->owner || r != r->main ) {
+    return 0;
+  }
+
+  slcf = ngx_http_get_module_loc_conf(r, ngx_http_esi_filter_module);
+
+  switch( slcf->bigpipe ) {
+    case NGX_HTTP_ESI_BIGPIPE_ON:
+      return include->pipe_on;
+    case NGX_HTTP_ESI_BIGPIPE_ALL:
+      return !include->pipe_off;
+    default:
+      return 0;
+  }
+}
+
+/* the fetch is on its way, leave a placeholder element and let the page go on */
+static void
+ngx_http_esi_include_defer(ngx_http_esi_include_t *include)
+{
+  ngx_buf_t           *b;
+  ngx_http_esi_ctx_t  *ctx = include->ctx;
+
+  b = ngx_create_temp_buf( ctx->request->pool, sizeof(NGX_HTTP_ESI_PIPE_ELEMENT) + NGX_INT_T_LEN );
+  if( b == NULL ) {
+    return;
+  }
+
+  include->pipe_id = ++ctx->pipe_seq;
+  b->last = ngx_sprintf( b->last, NGX_HTTP_ESI_PIPE_ELEMENT, include->pipe_id );
+
+  include->link->buf = b;
+  include->deferred = 1;
+  ctx->piped++;
+
+  ngx_http_esi_include_settle( include );
+}
+
+/* the fetch is done, includes of the same fragment that waited on it get what it got */
+static void
+ngx_http_esi_include_share(ngx_http_esi_include_t *include, ngx_chain_t *body, ngx_uint_t failed)
+{
+  ngx_http_esi_include_t  *same, *next;
+
+  same = include->same;
+  include->same = NULL;
+
+  for( ; same; same = next ) {
+    next = same->same;
+    same->same = NULL;
+    same->markup = include->markup;
+
+    if( failed ) {
+      ngx_http_esi_include_error( same );
+    }
+    else {
+      ngx_http_esi_include_resolve( same, body );
+    }
+  }
+}
+
+/*
+ * the uri the include fetches with duplicate slashes and /./ dropped, then its
+ * args, onerror and alt: /a.html, //a.html and /./a.html are one fetch
+ */
+static ngx_int_t
+ngx_http_esi_include_fetch_key(ngx_http_esi_include_t *include, ngx_str_t *key)
+{
+  u_char  *p, *s, *end;
+
+  key->data = ngx_pnalloc( include->ctx->request->pool,
+                           include->uri.len + 1 + include->args.len + 2 + include->alt.len );
+  if( key->data == NULL ) {
+    return NGX_ERROR;
+  }
+
+  p = key->data;
+  end = include->uri.data + include->uri.len;
+
+  for( s = include->uri.data; s < end; s++ ) {
+    if( *s == '/' && p > key->data && p[-1] == '/' ) {
+      continue;
+    }
+    if( *s == '.' && p > key->data && p[-1] == '/' && (s + 1 == end || s[1] == '/') ) {
+      continue;
+    }
+    *p++ = *s;
+  }
+
+  if( include->args.len ) {
+    *p++ = '?';
+    p = ngx_cpymem( p, include->args.data, include->args.len );
+  }
+
+  *p++ = '\0';
+  *p++ = include->optional ? 'c' : 'e';
+  p = ngx_cpymem( p, include->alt.data, include->alt.len );
+
+  key->len = p - key->data;
+
+  return NGX_OK;
+}
+
+/*
+ * a fragment is fetched once per page. Later includes of it wait for the first
+ * one and link in the same buffers, returns NGX_DECLINED if this one has to be
+ * fetched. Includes share only with the same src, alt and onerror, whatever the
+ * first one got, its alt or an error, is what this one would have got
+ */
+static ngx_int_t
+ngx_http_esi_include_dedup(ngx_http_esi_include_t *include)
+{
+  uint32_t                 hash;
+  ngx_str_t                key;
+  ngx_http_esi_fetch_t    *fetch;
+  ngx_http_esi_fetches_t  *fetches;
+  ngx_http_esi_include_t  *first;
+  ngx_http_esi_ctx_t      *ctx = include->ctx;
+
+  if( ctx->fetches == NULL ) {
+    fetches = ngx_palloc( ctx->request->pool, sizeof(ngx_http_esi_fetches_t) );
+    if( fetches == NULL ) {
+      return NGX_DECLINED;
+    }
+    ngx_rbtree_init( &fetches->tree, &fetches->sentinel, ngx_str_rbtree_insert_value );
+    ctx->fetches = &fetches->tree;
+  }
+
+  if( ngx_http_esi_include_fetch_key( include, &key ) != NGX_OK ) {
+    return NGX_DECLINED;
+  }
+
+  hash = ngx_crc32_short( key.data, key.len );
+
+  fetch = (ngx_http_esi_fetch_t *) ngx_str_rbtree_lookup( ctx->fetches, &key, hash );
+
+  if( fetch == NULL ) {
+    fetch = ngx_palloc( ctx->request->pool, sizeof(ngx_http_esi_fetch_t) );
+    if( fetch ) {
+      fetch->sn.node.key = hash;
+      fetch->sn.str = key;
+      fetch->include = include;
+      ngx_rbtree_insert( ctx->fetches, &fetch->sn.node );
+    }
+    return NGX_DECLINED;
+  }
+
+  first = fetch->include;
+
+  /* a deferred fragment comes after the page, this one is wanted in place */
+  if( first->deferred && !first->done ) {
+    return NGX_DECLINED;
+  }
+
+  ctx->deduped++;
+
+  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+                 "esi:include \"%V\" shares an earlier fetch", &include->key);
+
+  if( first->done || first->expanded ) {
+    include->markup = first->markup;
+    if( first->failed ) {
+      ngx_http_esi_include_error( include );
+    }
+    else {
+      ngx_http_esi_include_resolve( include, first->body );
+    }
+    return NGX_OK;
+  }
+
+  include->same = first->same;
+  first->same = include;
+
+  return NGX_OK;
+}
+
+/*
+ * esi_batch_pass, the fragments of an origin are asked for in one request
+ *
+ *   GET <esi_batch_pass>?u=%2Ffrag%2Fa.html&u=%2Ffrag%2Fb.html
+ *
+ * The response has a part for each u in the same order, a line with the status
+ * and the length of the fragment followed by the fragment itself
+ *
+ *   200 17\n<div>test1</div>\n404 0\n
+ *
+ * Includes are collected until the event that found them is over, a batch that
+ * cannot be had falls back to fetching its fragments one by one
+ */
+
+/* the batch request is done, hand each include its part */
+static ngx_int_t
+ngx_http_esi_batch_done(ngx_http_request_t *sr, void *data, ngx_int_t rc)
+{
+  u_char                    *p, *last, *sp, *nl;
+  size_t                     size;
+  ngx_int_t                  status, len;
+  ngx_buf_t                 *b;
+  ngx_chain_t               *body, *cl;
+  ngx_http_esi_batch_t      *batch = data;
+  ngx_http_esi_include_t    *include;
+  ngx_http_esi_main_conf_t  *emcf;
+
+  if( batch->fetching ) {
+    batch->fetching = 0;
+    ngx_http_esi_fetches--;
+  }
+
+  if( batch->active ) {
+    emcf = ngx_http_get_module_main_conf(sr, ngx_http_esi_filter_module);
+    ngx_esi_origin_release( emcf->shm_zone, batch->origin );
+    batch->active = 0;
+    ngx_http_esi_origin_wake( batch->origin );
+  }
+
+  p = last = NULL;
+
+  if( rc != NGX_ERROR && !sr->connection->error && sr->headers_out.status == NGX_HTTP_OK ) {
+    body = ngx_http_esi_include_body( sr );
+
+    /* parts may span buffers, they are looked at in one piece */
+    if( body && body->next ) {
+      size = 0;
+      for( cl = body; cl; cl = cl->next ) {
+        size += ngx_buf_size( cl->buf );
+      }
+      b = ngx_create_temp_buf( sr->pool, size );
+      if( b ) {
+        for( cl = body; cl; cl = cl->next ) {
+          b->last = ngx_cpymem( b->last, cl->buf->pos, cl->buf->last - cl->buf->pos );
+        }
+      }
+    }
+    else {
+      b = body ? body->buf : NULL;
+    }
+
+    if( b ) {
+      p = b->pos;
+      last = b->last;
+    }
+  }
+  else {
+    ngx_log_error(NGX_LOG_WARN, sr->connection->log, 0,
+                  "esi batch \"%V?%V\" returned %ui, fetching its fragments one by one",
+                  &sr->uri, &sr->args, sr->headers_out.status);
+  }
+
+  for( include = batch->includes; include; include = include->batch_next ) {
+    status = NGX_ERROR;
+    len = 0;
+    nl = NULL;
+
+    if( p && ( nl = ngx_strlchr( p, last, '\n' ) ) && ( sp = ngx_strlchr( p, nl, ' ' ) ) ) {
+      status = ngx_atoi( p, sp - p );
+      len = ngx_atoi( sp + 1, nl - sp - 1 - ( nl[-1] == '\r' ) );
+      if( len == NGX_ERROR || len > last - nl - 1 ) {
+        status = NGX_ERROR;
+      }
+    }
+
+    if( status == NGX_ERROR ) {
+      /* what is left of the response is of no use */
+      p = NULL;
+    }
+    else {
+      p = nl + 1 + len;
+    }
+
+    ngx_http_esi_include_latency( sr, &include->uri );
+
+    if( sr != include->sr ) {
+      /* abandoned after a timeout */
+      continue;
+    }
+
+    include->sr = NULL;
+
+    if( include->expire.timer_set ) {
+      ngx_del_timer( &include->expire );
+    }
+
+    if( status == NGX_ERROR ) {
+      /* fetched on its own from an event, not from within this subrequest */
+      ngx_post_event( &include->wait, &ngx_posted_events );
+      continue;
+    }
+
+    if( status >= NGX_HTTP_SPECIAL_RESPONSE ) {
+      ngx_log_debug2(NGX_LOG_DEBUG_HTTP, sr->connection->log, 0,
+                     "esi:include \"%V\" returned %i in batch", &include->uri, status);
+      ngx_http_esi_include_failed( include );
+      continue;
+    }
+
+    b = ngx_calloc_buf( sr->pool );
+    cl = ngx_alloc_chain_link( sr->pool );
+    if( b == NULL || cl == NULL ) {
+      ngx_post_event( &include->wait, &ngx_posted_events );
+      continue;
+    }
+    b->pos = nl + 1;
+    b->last = b->pos + len;
+    b->memory = 1;
+    cl->buf = b;
+    cl->next = NULL;
+
+    ngx_http_esi_include_fetched( include, cl, ngx_http_esi_include_markup( cl ) );
+  }
+
+  ngx_http_post_request( batch->ctx->request, NULL );
+
+  return rc;
+}
+
+/* one request for the includes, all of the same origin. NGX_DECLINED leaves them to be fetched one by one */
+static ngx_int_t
+ngx_http_esi_batch_dispatch(ngx_http_esi_ctx_t *ctx, ngx_http_esi_include_t *includes, ngx_str_t *key)
+{
+  size_t                       len;
+  uintptr_t                    n;
+  u_char                      *p;
+  ngx_str_t                    args, uri;
+  ngx_msec_t                   timeout;
+  ngx_http_request_t          *sr;
+  ngx_http_request_t          *r = ctx->request;
+  ngx_http_esi_batch_t        *batch;
+  ngx_http_esi_include_t      *include;
+  ngx_http_post_subrequest_t  *psr;
+  ngx_http_esi_main_conf_t    *emcf;
+  ngx_http_esi_loc_conf_t     *slcf;
+
+  emcf = ngx_http_get_module_main_conf(r, ngx_http_esi_filter_module);
+  slcf = ngx_http_get_module_loc_conf(r, ngx_http_esi_filter_module);
+
+  batch = ngx_pcalloc( r->pool, sizeof(ngx_http_esi_batch_t) );
+  psr = ngx_palloc( r->pool, sizeof(ngx_http_post_subrequest_t) );
+  if( batch == NULL || psr == NULL ) {
+    return NGX_DECLINED;
+  }
+
+  len = 0;
+  for( include = includes; include; include = include->batch_next ) {
+    n = ngx_escape_uri( NULL, include->uri.data, include->uri.len, NGX_ESCAPE_URI_COMPONENT )
+      + ( include->args.len ? 1 + ngx_escape_uri( NULL, include->args.data, include->args.len,
+                                                  NGX_ESCAPE_URI_COMPONENT ) : 0 );
+    len += sizeof("&u=") - 1 + include->uri.len + include->args.len + 1 + 2 * n;
+  }
+
+  args.data = ngx_pnalloc( r->pool, len );
+  if( args.data == NULL ) {
+    return NGX_DECLINED;
+  }
+
+  p = args.data;
+  for( include = includes; include; include = include->batch_next ) {
+    p = ngx_cpymem( p, "&u=", sizeof("&u=") - 1 );
+    p = (u_char *) ngx_escape_uri( p, include->uri.data, include->uri.len, NGX_ESCAPE_URI_COMPONENT );
+    if( include->args.len ) {
+      p = ngx_cpymem( p, "%3F", sizeof("%3F") - 1 );
+      p = (u_char *) ngx_escape_uri( p, include->args.data, include->args.len, NGX_ESCAPE_URI_COMPONENT );
+    }
+  }
+  args.data++;
+  args.len = p - args.data;
+
+  /* the batch takes one slot of the origin, not one per fragment */
+  if( slcf->origin_limit && emcf->shm_zone ) {
+    batch->origin = ngx_esi_origin_get( emcf->shm_zone, key );
+    if( batch->origin ) {
+      if( ngx_esi_origin_acquire( emcf->shm_zone, batch->origin, slcf->origin_limit, 0 ) != NGX_OK ) {
+        return NGX_DECLINED;
+      }
+      batch->active = 1;
+    }
+  }
+
+  batch->ctx = ctx;
+  batch->includes = includes;
+
+  psr->handler = ngx_http_esi_batch_done;
+  psr->data = batch;
+
+  uri = slcf->batch_pass;
+
+#ifdef NGX_HTTP_SUBREQUEST_BACKGROUND
+  if( ngx_http_subrequest(r, &uri, &args, &sr, psr,
+                          NGX_HTTP_SUBREQUEST_IN_MEMORY|NGX_HTTP_SUBREQUEST_BACKGROUND) != NGX_OK )
+#else
+  if( ngx_http_subrequest(r, &uri, &args, &sr, psr, NGX_HTTP_SUBREQUEST_IN_MEMORY) != NGX_OK )
+#endif
+  {
+    if( batch->active ) {
+      ngx_esi_origin_release( emcf->shm_zone, batch->origin );
+      ngx_http_esi_origin_wake( batch->origin );
+    }
+    return NGX_DECLINED;
+  }
+
+  batch->fetching = 1;
+  ngx_http_esi_fetches++;
+
+  batch->next = ctx->batches;
+  ctx->batches = batch;
+
+  for( include = includes; include; include = include->batch_next ) {
+    include->sr = sr;
+    include->started = ngx_current_msec;
+
+    timeout = ngx_http_esi_include_timeout( include );
+    if( timeout ) {
+      ngx_add_timer( &include->expire, timeout );
+    }
+  }
+
+  ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                 "esi batch \"%V\" for origin \"%V\"", &args, key);
+
+  return NGX_OK;
+}
+
+/* the event that collected includes is over, send the batches */
+static void
+ngx_http_esi_batch_handler(ngx_event_t *ev)
+{
+  ngx_str_t                key, k;
+  ngx_uint_t               n;
+  ngx_http_esi_ctx_t      *ctx = ev->data;
+  ngx_http_esi_include_t  *list, *include, *next, *group, **tail, *rest, **rest_tail;
+
+  list = ctx->batch;
+  ctx->batch = ctx->batch_last = NULL;
+
+  while( list ) {
+    /* the includes of the origin of the first one */
+    ngx_esi_origin_key( &list->uri, &key );
+
+    group = rest = NULL;
+    tail = &group;
+    rest_tail = &rest;
+    n = 0;
+
+    for( include = list; include; include = next ) {
+      next = include->batch_next;
+      include->batch_next = NULL;
+
+      if( include->done ) {
+        continue;
+      }
+
+      ngx_esi_origin_key( &include->uri, &k );
+
+      if( n < NGX_HTTP_ESI_BATCH_MAX && k.len == key.len
+          && ngx_strncmp( k.data, key.data, k.len ) == 0 ) {
+        *tail = include;
+        tail = &include->batch_next;
+        n++;
+      }
+      else {
+        *rest_tail = include;
+        rest_tail = &include->batch_next;
+      }
+    }
+
+    list = rest;
+
+    if( n > 1 && ngx_http_esi_batch_dispatch( ctx, group, &key ) == NGX_OK ) {
+      continue;
+    }
+
+    for( include = group; include; include = next ) {
+      next = include->batch_next;
+      include->batch_next = NULL;
+      ngx_http_esi_include_start( include );
+    }
+  }
+
+  ngx_http_post_request( ctx->request, NULL );
+  ngx_http_run_posted_requests( ctx->request->connection );
+}
+
+/* hold the include back for a batch, NGX_DECLINED if it is fetched on its own */
+static ngx_int_t
+ngx_http_esi_batch_add(ngx_http_esi_include_t *include)
+{
+  ngx_http_esi_ctx_t       *ctx = include->ctx;
+  ngx_http_esi_loc_conf_t  *slcf;
+
+  slcf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_esi_filter_module);
+
+  if( slcf->batch_pass.len == 0 ) {
+    return NGX_DECLINED;
+  }
+
+  if( ctx->batch_last ) {
+    ctx->batch_last->batch_next = include;
+  }
+  else {
+    ctx->batch = include;
+  }
+  ctx->batch_last = include;
+
+  if( !ctx->batch_event.posted ) {
+    ctx->batch_event.handler = ngx_http_esi_batch_handler;
+    ctx->batch_event.data = ctx;
+    ctx->batch_event.log = ctx->request->connection->log;
+    ngx_post_event( &ctx->batch_event, &ngx_posted_events );
+  }
+
+  return NGX_OK;
+}
+
+/* whether a local fragment holds esi markup, by file and modification time */
+typedef struct {
+  ngx_file_uniq_t  uniq;
+  time_t           mtime;
+  off_t            size;
+  ngx_uint_t       markup;
+} ngx_http_esi_local_file_t;
+
+#define NGX_HTTP_ESI_LOCAL_MARKUP  256
+
+static ngx_http_esi_local_file_t  ngx_http_esi_local_markup[NGX_HTTP_ESI_LOCAL_MARKUP];
+
+/* a local fragment to be scanned or parsed, its file region read into the request pool */
+static ngx_int_t
+ngx_http_esi_include_read(ngx_http_request_t *r, ngx_chain_t *cl)
+{
+  ssize_t     n;
+  ngx_buf_t  *b = cl->buf;
+  ngx_buf_t  *m;
+
+  m = ngx_create_temp_buf( r->pool, (size_t) (b->file_last - b->file_pos) );
+  if( m == NULL ) {
+    return NGX_ERROR;
+  }
+
+  n = ngx_read_file( b->file, m->pos, (size_t) (b->file_last - b->file_pos), b->file_pos );
+  if( n == NGX_ERROR ) {
+    return NGX_ERROR;
+  }
+
+  /* truncated meanwhile, a short fragment */
+  m->last = m->pos + n;
+
+  cl->buf = m;
+
+  return NGX_OK;
+}
+
+/*
+ * esi_fragment_root, an include under the uri prefix is the file under the directory.
+ * It is opened through open_file_cache and linked in as a region of the file, a
+ * fragment truncated meanwhile ends as a short sendfile. The file is read only to
+ * look for esi markup the first time it is seen and to parse it when it has some.
+ * Returns NGX_DECLINED when the include has to be fetched
+ */
+static ngx_int_t
+ngx_http_esi_include_local(ngx_http_esi_include_t *include)
+{
+  u_char                    *p;
+  ngx_str_t                  path;
+  ngx_buf_t                 *b;
+  ngx_chain_t               *cl;
+  ngx_open_file_info_t       of;
+  ngx_http_esi_local_file_t *m;
+  ngx_http_request_t        *r = include->ctx->request;
+  ngx_http_core_loc_conf_t  *clcf;
+  ngx_http_esi_loc_conf_t   *slcf;
+
+  slcf = ngx_http_get_module_loc_conf(r, ngx_http_esi_filter_module);
+
+  /* args ask for something the static file does not have */
+  if( slcf->local_prefix.len == 0 || include->args.len
+      || include->uri.len <= slcf->local_prefix.len
+      || ngx_strncmp( include->uri.data, slcf->local_prefix.data, slcf->local_prefix.len ) != 0
+      || ngx_strlcasestrn( include->uri.data, include->uri.data + include->uri.len, (u_char *) "..", 1 ) )
+  {
+    return NGX_DECLINED;
+  }
+
+  path.len = slcf->local_root.len + include->uri.len - slcf->local_prefix.len;
+  path.data = ngx_pnalloc( r->pool, path.len + 1 );
+  if( path.data == NULL ) {
+    return NGX_DECLINED;
+  }
+
+  p = ngx_cpymem( path.data, slcf->local_root.data, slcf->local_root.len );
+  p = ngx_cpymem( p, include->uri.data + slcf->local_prefix.len, include->uri.len - slcf->local_prefix.len );
+  *p = '\0';
+
+  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+  ngx_memzero( &of, sizeof(ngx_open_file_info_t) );
+
+  of.directio = NGX_OPEN_FILE_DIRECTIO_OFF;
+  of.valid = clcf->open_file_cache_valid;
+  of.min_uses = clcf->open_file_cache_min_uses;
+  of.errors = clcf->open_file_cache_errors;
+  of.events = clcf->open_file_cache_events;
+
+  if( ngx_open_cached_file( clcf->open_file_cache, &path, &of, r->pool ) != NGX_OK || !of.is_file ) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "esi:include \"%V\" is not a local file, fetching it", &include->uri);
+    return NGX_DECLINED;
+  }
+
+  if( of.size == 0 ) {
+    include->markup = 0;
+    ngx_http_esi_include_resolve( include, NULL );
+    return NGX_OK;
+  }
+
+  b = ngx_calloc_buf( r->pool );
+  cl = ngx_alloc_chain_link( r->pool );
+  if( b == NULL || cl == NULL ) {
+    return NGX_DECLINED;
+  }
+
+  b->file = ngx_pcalloc( r->pool, sizeof(ngx_file_t) );
+  if( b->file == NULL ) {
+    return NGX_DECLINED;
+  }
+
+  b->file->fd = of.fd;
+  b->file->name = path;
+  b->file->log = r->connection->log;
+  b->file->directio = of.is_directio;
+
+  b->in_file = 1;
+  b->file_pos = 0;
+  b->file_last = of.size;
+
+  cl->buf = b;
+  cl->next = NULL;
+
+  /* not stored in the fragment cache, open_file_cache keeps the file at hand */
+  include->markup = 0;
+
+  /* over esi_max_bytes the file is dropped by resolve unread */
+  if( slcf->max_bytes == 0 || include->ctx->fragment_bytes + (size_t) of.size <= slcf->max_bytes ) {
+    m = &ngx_http_esi_local_markup[of.uniq % NGX_HTTP_ESI_LOCAL_MARKUP];
+
+    if( m->uniq != of.uniq || m->mtime != of.mtime || m->size != of.size || m->markup ) {
+      /* the file is looked at once, a file with esi markup every time to be parsed */
+      if( ngx_http_esi_include_read( r, cl ) != NGX_OK ) {
+        return NGX_DECLINED;
+      }
+
+      include->markup = ngx_http_esi_include_markup( cl );
+
+      m->uniq = of.uniq;
+      m->mtime = of.mtime;
+      m->size = of.size;
+      m->markup = include->markup;
+    }
+  }
+
+  ngx_http_esi_include_resolve( include, ngx_buf_size( cl->buf ) ? cl : NULL );
+
+  return NGX_OK;
+}
+
+/* serve the include from a local file, the cache or start fetching it */
+static void
+ngx_http_esi_include_fetch(ngx_http_esi_include_t *include)
+{
+  if( include->invalid ) {
+    ngx_http_esi_include_error( include );
+    return;
+  }
+
+  if( ngx_http_esi_include_dedup( include ) == NGX_OK ) {
+    return;
+  }
+
+  if( !include->use_alt && ngx_http_esi_include_local( include ) == NGX_OK ) {
+    return;
+  }
+
+  if( !include->use_alt && ngx_http_esi_include_cached( include ) == NGX_OK ) {
+    return;
+  }
+
+  include->pipe = ngx_http_esi_include_pipeable( include );
+
+  if( ngx_http_esi_batch_add( include ) != NGX_OK ) {
+    ngx_http_esi_include_start( include );
+  }
+
+  if( include->pipe && !include->done ) {
+    ngx_http_esi_include_defer( include );
+  }
+}
+
+/* the part of the document the include is in will be used, fetch it or the attempt of its esi:try */
+static void
+ngx_http_esi_include_activate(ngx_http_esi_include_t *include)
+{
+  ngx_http_esi_try_t      *t = include->try;
+  ngx_http_esi_include_t  *i;
+
+  if( include->owner ) {
+    include->counted = 1;
+    include->owner->waiting[include->branch]++;
+  }
+
+  if( t == NULL ) {
+    ngx_http_esi_include_fetch( include );
+    return;
+  }
+
+  t->active = 1;
+
+  for( i = t->includes[NGX_HTTP_ESI_ATTEMPT]; i && !t->failed; i = i->next ) {
+    ngx_http_esi_include_activate( i );
+  }
+
+  ngx_http_esi_try_update( t );
+}
+
+/* link the include into the part of the document the parser is in */
+static void
+ngx_http_esi_include_add(ngx_http_esi_ctx_t *ctx, ngx_http_esi_include_t *include)
+{
+  ngx_http_esi_try_t  *t = ctx->try;
+
+  include->ctx = ctx;
+  include->owner = t;
+  include->branch = ctx->branch;
+
+  if( t ) {
+    if( t->last_include[ctx->branch] ) {
+      t->last_include[ctx->branch]->next = include;
+    }
+    else {
+      t->includes[ctx->branch] = include;
+    }
+    t->last_include[ctx->branch] = include;
+    return;
+  }
+
+  if( ctx->last_include ) {
+    ctx->last_include->next = include;
+  }
+  else {
+    ctx->includes = include;
+  }
+  ctx->last_include = include;
+
+  if( ctx->pending == NULL ) {
+    ctx->pending = include;
+  }
+}
+
+/* called from an event, nothing else will wake the page to pass on output that is now ready */
+static void
+ngx_http_esi_include_wake(ngx_http_esi_include_t *include)
 {
-  ESITag *n, *next = tag->next;
-  while( next ) {
-    n = next->next;
-    free(next);
-    next = n;
+  ngx_http_request_t  *r = include->ctx->request;
+  ngx_connection_t    *c = r->connection;
+
+  if( include->done ) {
+    ngx_http_post_request( r, NULL );
   }
 
-  //ngx_free_chain(tag->pool, tag->chain);
-  free(tag);
+  ngx_http_run_posted_requests( c );
 }
 
-esi_tag_t esi_tag_str_to_type( const char *tag_name, size_t length )
+/* a queued include was woken or its queue timeout passed, or the deferred start of an alt src */
+static void
+ngx_http_esi_include_wait_handler(ngx_event_t *ev)
 {
-  if( !strncmp("esi:try",tag_name,length) ) {
-    return ESI_TRY;
+  ngx_http_esi_include_t  *include = ev->data;
+
+  ngx_http_esi_include_start( include );
+  ngx_http_esi_include_wake( include );
+}
+
+/*
+ * esi_client_fallback, the include renders as a script loading the fragment from
+ * esi_fragment. The fetch goes on and its fragment is stored in the cache for it
+ */
+static ngx_int_t
+ngx_http_esi_include_fallback(ngx_http_esi_include_t *include)
+{
+  size_t                     len;
+  uintptr_t                  n;
+  ngx_buf_t                 *b;
+  ngx_chain_t               *cl;
+  ngx_http_request_t        *r = include->ctx->request;
+  ngx_http_esi_loc_conf_t   *slcf;
+
+  slcf = ngx_http_get_module_loc_conf(r, ngx_http_esi_filter_module);
+
+  /*
+   * an alt is not stored under the src and a deferred include holds nothing back.
+   * esi_fragment does not serve a src built from request variables
+   */
+  if( slcf->client_fallback.len == 0 || (include->sr == NULL && include->fetch == NULL)
+      || include->use_alt || include->deferred || include->personal )
+  {
+    return NGX_DECLINED;
   }
-  else if( !strncmp("esi:attempt",tag_name,length) ) {
-    return ESI_ATTEMPT;
+
+  n = ngx_escape_uri( NULL, include->key.data, include->key.len, NGX_ESCAPE_URI_COMPONENT );
+  len = include->key.len + 2 * n;
+
+  b = ngx_create_temp_buf( r->pool, sizeof(NGX_HTTP_ESI_FALLBACK_SCRIPT) + slcf->client_fallback.len + len );
+  cl = ngx_alloc_chain_link( r->pool );
+  if( b == NULL || cl == NULL ) {
+    return NGX_DECLINED;
   }
-  else if( !strncmp("esi:except",tag_name,length) ) {
-    return ESI_EXCEPT;
+
+  b->last = ngx_sprintf( b->last, NGX_HTTP_ESI_FALLBACK_SCRIPT_START, &slcf->client_fallback );
+  b->last = (u_char *) ngx_escape_uri( b->last, include->key.data, include->key.len, NGX_ESCAPE_URI_COMPONENT );
+  b->last = ngx_cpymem( b->last, NGX_HTTP_ESI_FALLBACK_SCRIPT_END, sizeof(NGX_HTTP_ESI_FALLBACK_SCRIPT_END) - 1 );
+
+  ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                "esi:include \"%V\" left to the client", &include->uri);
+
+  include->fallback = 1;
+  include->markup = 0;
+
+  /* kept as the body, later includes of the fragment are left to the client too */
+  cl->buf = b;
+  cl->next = NULL;
+  ngx_http_esi_include_resolve( include, cl );
+
+  return NGX_OK;
+}
+
+/*
+ * the fragment missed its timeout. The subrequest is left to finish on its own
+ * and is ignored when it does. It keeps its origin slot until then, a slow origin
+ * must not be given more fetches than esi_origin_limit by the ones given up on
+ */
+static void
+ngx_http_esi_include_expire_handler(ngx_event_t *ev)
+{
+  ngx_http_esi_include_t    *include = ev->data;
+  ngx_http_esi_abandoned_t  *a;
+
+  if( include->done || include->expanded ) {
+    return;
   }
-  else if( !strncmp("esi:include",tag_name,length) ) {
-    return ESI_INCLUDE;
+
+  ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                "esi:include \"%V\" timed out after %M ms",
+                &include->uri, ngx_current_msec - include->started);
+
+  if( ngx_http_esi_include_fallback( include ) == NGX_OK ) {
+    ngx_http_esi_include_wake( include );
+    return;
   }
-  else if( !strncmp("esi:invalidate",tag_name,length) ) {
-    return ESI_INVALIDATE;
+
+  include->timedout = 1;
+
+  if( include->sr && include->active ) {
+    /* without the memory to track it the slot is given up now, as for a fetch */
+    a = ngx_palloc( include->ctx->request->pool, sizeof(ngx_http_esi_abandoned_t) );
+    if( a ) {
+      a->sr = include->sr;
+      a->origin = include->origin;
+      a->next = include->abandoned;
+      include->abandoned = a;
+      include->active = 0;
+    }
   }
-  else if( !strncmp("esi:vars",tag_name,length) ) {
-    return ESI_VARS;
+
+  include->sr = NULL;
+  if( include->fetch ) {
+    /* unlike a subrequest the fetch is not left running */
+    ngx_esi_fetch_cancel( include->fetch );
+    include->fetch = NULL;
+    if( include->fetching ) {
+      include->fetching--;
+      ngx_http_esi_fetches--;
+    }
   }
-  else if( !strncmp("esi:remove",tag_name,length) ) {
-    return ESI_REMOVE;
+  ngx_http_esi_include_release( include );
+
+  if( ngx_http_esi_include_use_alt( include ) ) {
+    ngx_http_esi_include_start( include );
   }
-  return ESI_NONE;
+  else {
+    ngx_http_esi_include_error( include );
+  }
+
+  ngx_http_esi_include_wake( include );
 }
 
+/*
+ * the page budget shared with the fragments it pulls in. A fragment that includes
+ * itself, directly or through others, is refused instead of followed to esi_max_depth
+ */
 static ngx_int_t
-ngx_http_esi_stub_output(ngx_http_request_t *r, void *data, ngx_int_t rc)
+ngx_http_esi_include_allowed(ngx_http_esi_include_t *include)
 {
-  ngx_chain_t  *out;
-  if (rc == NGX_ERROR || r->connection->error || r->request_output) {
-      return rc;
+  ngx_http_esi_include_t   *p;
+  ngx_http_esi_ctx_t       *ctx = include->ctx;
+  ngx_log_t                *log = ctx->request->connection->log;
+  ngx_http_esi_loc_conf_t  *slcf;
+
+  slcf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_esi_filter_module);
+
+  for( p = include->parent; p; p = p->parent ) {
+    if( p->key.len == include->key.len
+        && ngx_strncmp( p->key.data, include->key.data, p->key.len ) == 0 ) {
+      ngx_log_error(NGX_LOG_ERR, log, 0,
+                    "esi:include \"%V\" includes itself", &include->key);
+      return NGX_DECLINED;
+    }
   }
 
-  ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                 "ssi stub output: \"%V?%V\"", &r->uri, &r->args);
+  if( include->depth > slcf->max_depth ) {
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+                  "esi:include \"%V\" is nested deeper than esi_max_depth %uz",
+                  &include->key, slcf->max_depth);
+    return NGX_DECLINED;
+  }
 
-  out = data;
+  if( slcf->max_includes && ++ctx->included > slcf->max_includes ) {
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+                  "esi:include \"%V\" is over esi_max_includes %ui",
+                  &include->key, slcf->max_includes);
+    return NGX_DECLINED;
+  }
 
-  if (!r->header_sent) {
-    if (ngx_http_set_content_type(r) == NGX_ERROR) {
-      return NGX_ERROR;
-    }
+  return NGX_OK;
+}
 
-    if (ngx_http_send_header(r) == NGX_ERROR) {
-      return NGX_ERROR;
-    }
+static u_char *esi_tag_attr_dup(ngx_pool_t *pool, ESIAttribute *attr, size_t *len)
+{
+  u_char *data;
+
+  *len = strlen( attr->value );
+  data = ngx_pnalloc( pool, *len + 1 );
+  if( data == NULL ) {
+    return NULL;
   }
+  ngx_memcpy( data, attr->value, *len + 1 );
+  return data;
+}
+
+/* max-age='600' or max-age='600+600', the second part is how long it may be served stale */
+static ngx_int_t esi_tag_max_age(ESIAttribute *attr, time_t *fresh, time_t *stale)
+{
+  u_char    *p, *last;
+
+  last = (u_char*)attr->value + strlen( attr->value );
+  p = ngx_strlchr( (u_char*)attr->value, last, '+' );
+
+  *fresh = ngx_atotm( (u_char*)attr->value, ( p ? p : last ) - (u_char*)attr->value );
+  *stale = p ? ngx_atotm( p + 1, last - p - 1 ) : 0;
 
-  return ngx_http_output_filter(r, out);
+  if( *fresh == NGX_ERROR || *stale == NGX_ERROR ) {
+    return NGX_ERROR;
+  }
+  return NGX_OK;
 }
 
 static void esi_tag_start_include(ESITag *tag, ESIAttribute *attributes)
 {
-  ngx_int_t                      rc; 
-  ngx_str_t                      uri, args;
-  ngx_http_request_t            *sr;
-  ESIAttribute                  *attr = attributes;
-  ngx_http_request_t            *request = tag->ctx->request;
-  ngx_pool_t                    *pool = request->pool;
+  ngx_int_t                      rc;
   ngx_uint_t                     flags = 0;
-  ngx_http_post_subrequest_t    *psr;
-  ngx_chain_t                   *link;
+  ngx_str_t                      src, value;
+  ngx_msec_t                     timeout;
+  time_t                         fresh, stale;
   ngx_buf_t                     *buf;
+  ngx_pool_cleanup_t            *cln;
+  ngx_http_esi_include_t        *include;
+  ESIAttribute                  *attr = attributes;
+  ngx_http_esi_ctx_t            *ctx = tag->ctx;
+  ngx_http_request_t            *request = ctx->request;
+  ngx_pool_t                    *pool = request->pool;
+
+  include = ngx_pcalloc(pool, sizeof(ngx_http_esi_include_t));
+  if( include == NULL ) {
+    return;
+  }
 
-  flags |= NGX_HTTP_SUBREQUEST_IN_MEMORY;
-  args.len = 0;
-  args.data = NULL;
+  src.len = 0;
+  src.data = NULL;
 
-//  printf( "esi:include\n" );
   while( attr ) {
-//    printf( "\t%s => %s\n", attr->name, attr->value );
     if( !ngx_strcmp( attr->name, "src" ) ) { 
-      uri.len = strlen(attr->value)+1;
-      uri.data =  ngx_palloc(pool, uri.len );
-      ngx_memcpy( uri.data, attr->value, uri.len );
-      printf( "uri: %s\n", uri.data );
+      src.data = esi_tag_attr_dup( pool, attr, &src.len );
+    }
+    else if( !ngx_strcmp( attr->name, "alt" ) ) {
+      include->alt.data = esi_tag_attr_dup( pool, attr, &include->alt.len );
+    }
+    else if( !ngx_strcmp( attr->name, "bigpipe" ) ) {
+      include->pipe_on = !ngx_strcmp( attr->value, "on" );
+      include->pipe_off = !ngx_strcmp( attr->value, "off" );
+    }
+    else if( !ngx_strcmp( attr->name, "onerror" ) ) {
+      include->optional = !ngx_strcmp( attr->value, "continue" );
+    }
+    else if( !ngx_strcmp( attr->name, "max-age" ) ) {
+      if( esi_tag_max_age( attr, &fresh, &stale ) == NGX_OK ) {
+        include->has_max_age = 1;
+        include->max_age = fresh;
+        include->max_stale = stale;
+      }
+    }
+    else if( !ngx_strcmp( attr->name, "timeout" ) ) {
+      /* timeout='2' is in seconds, timeout='250ms' works too */
+      value.data = (u_char*)attr->value;
+      value.len = strlen( attr->value );
+      timeout = ngx_parse_time( &value, 0 );
+      include->timeout = ( timeout == (ngx_msec_t)NGX_ERROR ) ? 0 : timeout;
     }
     attr = attr->next;
   }
 
-  if( uri.len > 0 ) {
-    psr = ngx_palloc(pool, sizeof(ngx_http_post_subrequest_t));
-    if( psr == NULL ) {
-      return; //return NGX_ERROR;
+  if( src.len == 0 || src.data == NULL ) {
+    ngx_log_error(NGX_LOG_ERR, request->connection->log, 0, "esi:include missing src attribute");
+    return;
+  }
+
+  /* src='/frag?u=$(HTTP_COOKIE{user})', the substituted src is the cache key as well */
+  rc = ngx_esi_vars_substitute( ctx, &src );
+  if( rc == NGX_ERROR
+      || ( include->alt.len && ngx_esi_vars_substitute( ctx, &include->alt ) == NGX_ERROR ) ) {
+    return;
+  }
+  include->personal = ( rc == NGX_OK );
+
+  if( !ctx->cleanup_set ) {
+    cln = ngx_pool_cleanup_add( pool, 0 );
+    if( cln == NULL ) {
+      return;
+    }
+    cln->handler = ngx_http_esi_include_cleanup;
+    cln->data = ctx;
+    ctx->cleanup_set = 1;
+  }
+
+  /* reserve the include position in the output */
+  buf = ngx_calloc_buf( pool );
+  if( buf == NULL ) {
+    return;
+  }
+  buf->sync = 1;
+
+  ctx->last_buf = ngx_chain_append_buffer( pool, ctx->last_buf, buf );
+
+  include->link = ctx->last_buf;
+  include->key = src;
+  include->uri = src;
+
+  include->wait.handler = ngx_http_esi_include_wait_handler;
+  include->wait.data = include;
+  include->wait.log = request->connection->log;
+
+  include->expire.handler = ngx_http_esi_include_expire_handler;
+  include->expire.data = include;
+  include->expire.log = request->connection->log;
+
+  ngx_http_esi_include_add( ctx, include );
+
+  if( ngx_http_parse_unsafe_uri(request, &include->uri, &include->args, &flags) != NGX_OK ) {
+    include->invalid = !ngx_http_esi_include_use_alt( include );
+  }
+
+  include->parent = ctx->fragment;
+  include->depth = ctx->fragment ? ctx->fragment->depth + 1 : 1;
+
+  if( ngx_http_esi_include_allowed( include ) != NGX_OK ) {
+    include->invalid = 1;
+  }
+
+  /* includes of an except are left alone until the attempt fails */
+  if( ngx_http_esi_try_live( include->owner, include->branch ) ) {
+    ngx_http_esi_include_activate( include );
+  }
+}
+
+static void esi_tag_start_try(ESITag *tag)
+{
+  ngx_uint_t                     i;
+  ngx_buf_t                     *buf;
+  ngx_http_esi_try_t            *t;
+  ngx_http_esi_include_t        *slot;
+  ngx_http_esi_ctx_t            *ctx = tag->ctx;
+  ngx_pool_t                    *pool = ctx->request->pool;
+
+  t = ngx_pcalloc( pool, sizeof(ngx_http_esi_try_t) );
+  slot = ngx_pcalloc( pool, sizeof(ngx_http_esi_include_t) );
+  buf = ngx_calloc_buf( pool );
+  if( t == NULL || slot == NULL || buf == NULL ) {
+    return;
+  }
+
+  for( i = 0; i < 3; i++ ) {
+    t->out[i] = t->last[i] = ngx_alloc_chain_link( pool );
+    if( t->out[i] == NULL ) {
+      return;
+    }
+    t->out[i]->buf = NULL;
+    t->out[i]->next = NULL;
+  }
+
+  /* reserve the position of the whole esi:try in the output */
+  buf->sync = 1;
+  ctx->last_buf = ngx_chain_append_buffer( pool, ctx->last_buf, buf );
+
+  slot->link = ctx->last_buf;
+  slot->try = t;
+  t->slot = slot;
+
+  ngx_http_esi_include_add( ctx, slot );
+
+  if( ngx_http_esi_try_live( slot->owner, slot->branch ) ) {
+    ngx_http_esi_include_activate( slot );
+  }
+
+  ctx->try = t;
+  ctx->branch = NGX_HTTP_ESI_TRY_BODY;
+  ctx->last_buf = t->last[NGX_HTTP_ESI_TRY_BODY];
+}
+
+/* the parser moved into another part of the innermost esi:try */
+static void esi_tag_try_part(ngx_http_esi_ctx_t *ctx, ngx_uint_t branch)
+{
+  ngx_http_esi_try_t  *t = ctx->try;
+
+  if( t == NULL ) {
+    return;
+  }
+
+  if( ctx->branch == NGX_HTTP_ESI_ATTEMPT ) {
+    t->attempted = 1;
+  }
+
+  t->last[ctx->branch] = ctx->last_buf;
+  ctx->branch = branch;
+  ctx->last_buf = t->last[branch];
+
+  /* the attempt is complete and all its includes are in, the except is never used */
+  if( branch == NGX_HTTP_ESI_EXCEPT && t->active && t->attempted && !t->failed
+      && t->waiting[NGX_HTTP_ESI_ATTEMPT] == 0 ) {
+    ctx->skip = 1;
+  }
+}
+
+static void esi_tag_close_try(ngx_http_esi_ctx_t *ctx)
+{
+  ngx_http_esi_try_t  *t = ctx->try;
+
+  if( t == NULL ) {
+    return;
+  }
+
+  t->last[ctx->branch] = ctx->last_buf;
+  t->closed = 1;
+
+  /* nothing was added to the enclosing output since the slot */
+  ctx->try = t->slot->owner;
+  ctx->branch = t->slot->branch;
+  ctx->last_buf = t->slot->link;
+
+  ngx_http_esi_try_update( t );
+}
+
+/* collect esi:vars content, the parser may hand it over in several pieces */
+static void esi_tag_vars_append(ngx_http_esi_ctx_t *ctx, const void *data, size_t length)
+{
+  size_t      size;
+  ngx_buf_t  *b = ctx->vars_text;
+
+  if( b == NULL || (size_t)(b->end - b->last) < length ) {
+    size = ngx_max( 2 * ( b ? (size_t)(b->last - b->pos) : 0 ) + length, 256 );
+    b = ngx_create_temp_buf( ctx->request->pool, size );
+    if( b == NULL ) {
+      return;
+    }
+    if( ctx->vars_text ) {
+      b->last = ngx_cpymem( b->last, ctx->vars_text->pos, ctx->vars_text->last - ctx->vars_text->pos );
+    }
+    ctx->vars_text = b;
+  }
+
+  b->last = ngx_cpymem( b->last, data, length );
+}
+
+/* substitute the esi:vars content collected so far and add it to the output */
+static void esi_tag_vars_flush(ngx_http_esi_ctx_t *ctx)
+{
+  ngx_str_t  text;
+  ngx_buf_t *b = ctx->vars_text;
+
+  if( b == NULL ) {
+    return;
+  }
+  ctx->vars_text = NULL;
+
+  text.data = b->pos;
+  text.len = b->last - b->pos;
+
+  if( ngx_esi_vars_substitute( ctx, &text ) == NGX_ERROR ) {
+    return;
+  }
+
+  b->pos = text.data;
+  b->last = text.data + text.len;
+  b->temporary = 0;
+  b->memory = 1;
+
+  if( text.len ) {
+    ctx->last_buf = ngx_chain_append_buffer( ctx->request->pool, ctx->last_buf, b );
+  }
+}
+
+static void esi_tag_start_choose(ngx_http_esi_ctx_t *ctx)
+{
+  ngx_http_esi_choose_t *choose;
+
+  choose = ngx_pcalloc( ctx->request->pool, sizeof(ngx_http_esi_choose_t) );
+  if( choose == NULL ) {
+    return;
+  }
+
+  choose->prev = ctx->choose;
+  ctx->choose = choose;
+}
+
+/*
+ * esi:when and esi:otherwise, a branch not taken is skipped by the parser callbacks
+ * until its end tag, none of its content is copied and none of its tags are opened
+ */
+static void esi_tag_start_branch(ESITag *tag, ESIAttribute *attributes)
+{
+  ngx_str_t               test;
+  ngx_esi_expr_t         *expr;
+  ESIAttribute           *attr;
+  ngx_http_esi_ctx_t     *ctx = tag->ctx;
+  ngx_http_esi_choose_t  *choose = ctx->choose;
+
+  if( choose == NULL || choose->matched ) {
+    ctx->skip = 1;
+    return;
+  }
+
+  if( tag->type == ESI_WHEN ) {
+    for( attr = attributes; attr; attr = attr->next ) {
+      if( !ngx_strcmp( attr->name, "test" ) ) {
+        break;
+      }
+    }
+
+    if( attr == NULL ) {
+      ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0, "esi:when missing test attribute");
+      ctx->skip = 1;
+      return;
+    }
+
+    test.data = (u_char*)attr->value;
+    test.len = strlen( attr->value );
+
+    expr = ngx_esi_expr_compile( ctx->request->connection->log, &test );
+    if( expr == NULL || !ngx_esi_expr_eval( ctx, expr ) ) {
+      ctx->skip = 1;
+      return;
     }
-    /* attach the handler */
-    psr->handler = ngx_http_esi_stub_output;
+  }
+
+  choose->matched = 1;
+}
+
+/*
+ * <esi:inline name="/nav.html" fetchable="yes"> is output in place and primes the fragment
+ * cache, so an esi:include of the name on this or a later page needs no fetch
+ */
+static void esi_tag_start_inline(ngx_http_esi_ctx_t *ctx, ESIAttribute *attributes)
+{
+  ESIAttribute              *attr;
+  ngx_http_esi_inline_t     *frag;
+  ngx_http_esi_main_conf_t  *emcf;
+  ngx_http_esi_loc_conf_t   *elcf;
+
+  emcf = ngx_http_get_module_main_conf( ctx->request, ngx_http_esi_filter_module );
+  if( emcf->cache_zone == NULL || ctx->inline_fragment ) {
+    return;
+  }
+
+  frag = ngx_pcalloc( ctx->request->pool, sizeof(ngx_http_esi_inline_t) );
+  if( frag == NULL ) {
+    return;
+  }
+
+  elcf = ngx_http_get_module_loc_conf( ctx->request, ngx_http_esi_filter_module );
+  frag->fresh = elcf->cache_valid;
+  frag->stale = elcf->cache_stale;
+  frag->last = &frag->body;
 
-    /* allocate a buffer */
-    buf = ngx_alloc_buf(pool);
-    if( buf == NULL ) {
-      return; //return NGX_ERROR;
+  for( attr = attributes; attr; attr = attr->next ) {
+    if( !ngx_strcmp( attr->name, "name" ) ) {
+      frag->name.data = esi_tag_attr_dup( ctx->request->pool, attr, &frag->name.len );
     }
-    link = ngx_alloc_chain_link(pool);
-    if( link == NULL ) {
-      return; //return NGX_ERROR;
+    else if( !ngx_strcmp( attr->name, "max-age" ) ) {
+      esi_tag_max_age( attr, &frag->fresh, &frag->stale );
     }
-    link->buf = buf;
-    link->next = NULL;
+    /* fetchable="no" fragments are stored all the same, nothing fetches an inline name */
+  }
+
+  if( frag->name.len == 0 || frag->name.data == NULL ) {
+    ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0, "esi:inline missing name attribute");
+    return;
+  }
+
+  if( frag->fresh == 0 && frag->stale == 0 ) {
+    return;
+  }
+
+  ctx->inline_fragment = frag;
+}
+
+/*
+ * the page output of an esi:inline goes out like any other text, as regions of
+ * the template file or in esi_buffers, either may be sent or reused before the
+ * end tag. What the zone gets is copied aside while the inline is open
+ */
+#define NGX_HTTP_ESI_INLINE_CHUNK  1024
+
+static void esi_tag_inline_copy(ngx_http_esi_ctx_t *ctx, const void *data, size_t length)
+{
+  ngx_buf_t              *b;
+  ngx_chain_t            *cl;
+  ngx_http_esi_inline_t  *frag = ctx->inline_fragment;
+
+  b = frag->tail;
+  if( b && (size_t) (b->end - b->last) >= length ) {
+    b->last = ngx_cpymem( b->last, data, length );
+    return;
+  }
+
+  b = ngx_create_temp_buf( ctx->request->pool, ngx_max( length, NGX_HTTP_ESI_INLINE_CHUNK ) );
+  cl = ngx_alloc_chain_link( ctx->request->pool );
+  if( b == NULL || cl == NULL ) {
+    frag->invalid = 1;
+    return;
+  }
+
+  b->last = ngx_cpymem( b->last, data, length );
+
+  cl->buf = b;
+  cl->next = NULL;
+  *frag->last = cl;
+  frag->last = &cl->next;
+  frag->tail = b;
+}
+
+static void esi_tag_close_inline(ngx_http_esi_ctx_t *ctx)
+{
+  ngx_http_esi_inline_t     *frag = ctx->inline_fragment;
+  ngx_http_esi_main_conf_t  *emcf;
+
+  if( frag == NULL ) {
+    return;
+  }
+  ctx->inline_fragment = NULL;
+
+  /* esi markup inside is not part of the spans */
+  if( frag->invalid || frag->body == NULL ) {
+    return;
+  }
+
+  emcf = ngx_http_get_module_main_conf( ctx->request, ngx_http_esi_filter_module );
+
+  /* an esi:inline holding markup is never stored */
+  if( ngx_esi_cache_put( emcf->cache_zone, &frag->name, frag->body, frag->fresh, frag->stale, 0 ) != NGX_OK ) {
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->request->connection->log, 0,
+                   "esi:inline \"%V\" not cached", &frag->name);
+  }
+}
+
+/* the document ended, close what the markup left open so no slot waits forever */
+void esi_tag_close_all(ngx_http_esi_ctx_t *ctx)
+{
+  esi_tag_vars_flush( ctx );
 
-    psr->data = link;
+  ctx->skip = 0;
+  ctx->choose = NULL;
+  ctx->inline_fragment = NULL;
 
-    rc = ngx_http_subrequest(request, &uri, &args, &sr, psr, flags);
+  while( ctx->try ) {
+    esi_tag_close_try( ctx );
   }
 
-  ngx_pfree( pool, uri.data );
+  ctx->ntags = ctx->tags_base;
+  ctx->open_tag = NULL;
 }
 
 void esi_tag_open(ESITag *tag, ESIAttribute *attributes)
 {
+  ngx_http_esi_try_t *t = tag->ctx->try;
+
+  esi_tag_vars_flush( tag->ctx );
+
+  if( tag->ctx->inline_fragment ) {
+    tag->ctx->inline_fragment->invalid = 1;
+  }
+
   switch(tag->type) {
     case ESI_TRY:
+      esi_tag_start_try( tag );
+      if( tag->ctx->try != t ) {
+        tag->try = tag->ctx->try;
+      }
       break;
     case ESI_ATTEMPT:
-      tag->ctx->exception_raised = 0; /* reset the exception raised state to 0 */
+      tag->try = t;
+      esi_tag_try_part( tag->ctx, NGX_HTTP_ESI_ATTEMPT );
       break;
     case ESI_EXCEPT:
-      if( !tag->ctx->exception_raised ) {
-        tag->ctx->ignore_tag = 1;
-      }
+      tag->try = t;
+      esi_tag_try_part( tag->ctx, NGX_HTTP_ESI_EXCEPT );
       break;
     case ESI_INCLUDE:
-      if( !tag->ctx->ignore_tag ) { esi_tag_start_include( tag, attributes ); }
+      esi_tag_start_include( tag, attributes );
       break;
-    case ESI_INVALIDATE:
+    case ESI_CHOOSE:
+      esi_tag_start_choose( tag->ctx );
       break;
-    case ESI_VARS:
+    case ESI_WHEN:
+    case ESI_OTHERWISE:
+      esi_tag_start_branch( tag, attributes );
       break;
     case ESI_REMOVE:
+    case ESI_COMMENT:
+      /* nothing in them is output or processed */
+      tag->ctx->skip = 1;
+      break;
+    case ESI_INLINE:
+      esi_tag_start_inline( tag->ctx, attributes );
+      break;
+    case ESI_INVALIDATE:
+      break;
+    case ESI_VARS:
       break;
     default:
       break;
@@ -161,15 +2823,20 @@ void esi_tag_open(ESITag *tag, ESIAttribute *attributes)
 }
 void esi_tag_close(ESITag *tag)
 {
+  esi_tag_vars_flush( tag->ctx );
+
+  /* a tag only ends the esi:try state it started, e.g. not the enclosing one when it failed to */
   switch(tag->type) {
     case ESI_TRY:
+      if( tag->try && tag->try == tag->ctx->try ) {
+        esi_tag_close_try( tag->ctx );
+      }
       break;
     case ESI_ATTEMPT:
-      tag->ctx->exception_raised = 0; /* reset the exception raised state to 0 */
-      break;
     case ESI_EXCEPT:
-      if( !tag->ctx->exception_raised ) { tag->ctx->ignore_tag = 0; }
-      tag->ctx->exception_raised = 0; /* reset the exception raised state to 0 */
+      if( tag->try == tag->ctx->try ) {
+        esi_tag_try_part( tag->ctx, NGX_HTTP_ESI_TRY_BODY );
+      }
       break;
     case ESI_INCLUDE:
       break;
@@ -179,11 +2846,18 @@ void esi_tag_close(ESITag *tag)
       break;
     case ESI_REMOVE:
       break;
+    case ESI_CHOOSE:
+      if( tag->ctx->choose ) {
+        tag->ctx->choose = tag->ctx->choose->prev;
+      }
+      break;
+    case ESI_INLINE:
+      esi_tag_close_inline( tag->ctx );
+      break;
     default:
       break;
   }
 //  printf("close tag: "); esi_tag_debug( tag );
-  esi_tag_free( tag );
 }
 
 void esi_tag_debug(ESITag *tag)
@@ -212,6 +2886,21 @@ void esi_tag_debug(ESITag *tag)
   case ESI_REMOVE:
     printf("esi:remove\n");
     break;
+  case ESI_CHOOSE:
+    printf("esi:choose\n");
+    break;
+  case ESI_WHEN:
+    printf("esi:when\n");
+    break;
+  case ESI_OTHERWISE:
+    printf("esi:otherwise\n");
+    break;
+  case ESI_COMMENT:
+    printf("esi:comment\n");
+    break;
+  case ESI_INLINE:
+    printf("esi:inline\n");
+    break;
   default:
     printf("unknown esi type\n");
     break;
@@ -219,27 +2908,6 @@ void esi_tag_debug(ESITag *tag)
 
 }
 
-ESITag *esi_tag_close_children( ESITag *tag, esi_tag_t type )
-{
-  ESITag *n, *next, *ptr, *prev;
-
-  ptr = tag;
-  next = tag->next;
-
-  while( next ) {
-    prev = ptr;
-    n = next->next;
-    if( next->type == type ) {
-      esi_tag_close( next );
-      prev->next = NULL;
-      return prev;
-    }
-    ptr = next;
-    next = n;
-  }
-  return NULL;
-}
-
 static ngx_buf_t *esi_tag_alloc_buf(ESITag *tag, const void *data, size_t length)
 {
   ngx_buf_t *b;
@@ -262,14 +2930,20 @@ ngx_buf_t *esi_tag_buffer(ESITag *tag, const void *data, size_t length)
 {
   //printf("buffer: %lu for tag: ", length); esi_tag_debug(tag);
   switch( tag->type ) {
-    case ESI_VARS:
+    case ESI_VARS: /* substituted once the next tag shows up */
+      esi_tag_vars_append( tag->ctx, data, length );
+      return NULL;
     case ESI_ATTEMPT:
-      return ngx_buf_from_data( tag->ctx->request->pool, data, length );
-    case ESI_EXCEPT:
-      if( tag->ctx->exception_raised ) {
-        return ngx_buf_from_data( tag->ctx->request->pool, data, length );
+    case ESI_EXCEPT: /* kept aside by the esi:try until it is decided */
+    case ESI_WHEN:
+    case ESI_OTHERWISE: /* the branch taken, the others never get here */
+      return ngx_http_esi_text( tag->ctx, data, length );
+    case ESI_INLINE:
+      if( tag->ctx->inline_fragment && !tag->ctx->inline_fragment->invalid ) {
+        esi_tag_inline_copy( tag->ctx, data, length );
       }
-      /* fall through */
+      return ngx_http_esi_text( tag->ctx, data, length );
+    case ESI_CHOOSE: /* only esi:when and esi:otherwise belong in here */
     case ESI_INCLUDE:
     case ESI_INVALIDATE:
     case ESI_REMOVE:
@@ -278,8 +2952,3 @@ ngx_buf_t *esi_tag_buffer(ESITag *tag, const void *data, size_t length)
       return NULL;
   }
 }
-
-int esi_vars_filter( ngx_chain_t *chain )
-{
-  return 0;
-}
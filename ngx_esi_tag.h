@@ -14,27 +14,34 @@ typedef enum {
   ESI_INVALIDATE,
   ESI_VARS,
   ESI_REMOVE,
+  ESI_CHOOSE,
+  ESI_WHEN,
+  ESI_OTHERWISE,
+  ESI_COMMENT,
+  ESI_INLINE,
   ESI_NONE
 }esi_tag_t;
 
+#define NGX_ESI_TAG_DEPTH 64 /* open tags of a page, those of the fragments parsed into it included */
+
+/* a frame of ctx->tags, e.g. <esi:try><esi:attempt><esi:include/> is three deep at the include */
 typedef struct _ESITag {
   ngx_http_esi_ctx_t *ctx; /* context stores request info */
   esi_tag_t type; /* tag type */
-  struct _ESITag *next; /* children of this tag e.g.
-                           <esi:try><esi:attempt><esi:include/></esi:attempt></esi:try>,
-                           try has 2 children attempt and include, and include has one child include */
+  ngx_http_esi_try_t *try; /* esi:try it started or esi:attempt/esi:except it is a part of, NULL if none */
 } ESITag;
 
-ESITag *esi_tag_new(esi_tag_t tag, ngx_http_esi_ctx_t *ctx);
-void esi_tag_free(ESITag *tag);
+/* open a new innermost tag, NULL when nested too deep */
+ESITag *esi_tag_push(ngx_http_esi_ctx_t *ctx, esi_tag_t type);
+/* close the innermost open tag of the type, and those opened after it first */
+void esi_tag_pop(ngx_http_esi_ctx_t *ctx, esi_tag_t type);
 void esi_tag_open(ESITag *tag, ESIAttribute *attributes);
 void esi_tag_close(ESITag *tag);
-ESITag *esi_tag_close_children( ESITag *tag, esi_tag_t type );
+void esi_tag_close_all(ngx_http_esi_ctx_t *ctx);
 ngx_buf_t *esi_tag_buffer(ESITag *tag, const void *data, size_t length);
 void esi_tag_debug(ESITag *tag);
 
 esi_tag_t esi_tag_str_to_type( const char *tag_name, size_t length );
-int esi_vars_filter( ngx_chain_t *chain );
 
 
 #endif
@@ -0,0 +1,512 @@
+/*
+ * Copyright (C) Todd A. Fisher
+ *
+ * ESI 1.0 variable substitution
+ */
+#include "ngx_esi_vars.h"
+
+typedef struct {
+  ngx_str_t      name;
+  ngx_str_t      variable; /* nginx variable holding the raw value */
+} ngx_esi_var_t;
+
+static ngx_esi_var_t  ngx_esi_vars[] = {
+  { ngx_null_string, ngx_null_string },
+  { ngx_string("HTTP_ACCEPT_LANGUAGE"), ngx_string("http_accept_language") },
+  { ngx_string("HTTP_COOKIE"), ngx_string("http_cookie") },
+  { ngx_string("HTTP_HOST"), ngx_string("http_host") },
+  { ngx_string("HTTP_REFERER"), ngx_string("http_referer") },
+  { ngx_string("HTTP_USER_AGENT"), ngx_string("http_user_agent") },
+  { ngx_string("QUERY_STRING"), ngx_string("args") }
+};
+
+static ngx_int_t  ngx_esi_vars_index[NGX_ESI_VAR_N];
+
+/* resolve the nginx variables behind the esi ones, called at postconfiguration */
+ngx_int_t
+ngx_esi_vars_init(ngx_conf_t *cf)
+{
+  ngx_uint_t  i;
+
+  for (i = 1; i < NGX_ESI_VAR_N; i++) {
+    ngx_esi_vars_index[i] = ngx_http_get_variable_index(cf, &ngx_esi_vars[i].variable);
+    if (ngx_esi_vars_index[i] == NGX_ERROR) {
+      return NGX_ERROR;
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* $(NAME), $(NAME{key}), $(NAME|default), $(NAME{key}|'default') */
+u_char *
+ngx_esi_vars_parse(u_char *p, u_char *last, ngx_esi_var_op_t *op)
+{
+  u_char      *name;
+  ngx_uint_t   i;
+
+  if (last - p < 3 || p[0] != '$' || p[1] != '(') {
+    return NULL;
+  }
+
+  p += 2;
+  name = p;
+
+  while (p < last && ((*p >= 'A' && *p <= 'Z') || *p == '_')) {
+    p++;
+  }
+
+  op->op = NGX_ESI_VAR_LITERAL;
+
+  for (i = 1; i < NGX_ESI_VAR_N; i++) {
+    if ((size_t) (p - name) == ngx_esi_vars[i].name.len
+        && ngx_strncmp(name, ngx_esi_vars[i].name.data, p - name) == 0)
+    {
+      op->op = (ngx_esi_var_e) i;
+      break;
+    }
+  }
+
+  if (op->op == NGX_ESI_VAR_LITERAL) {
+    return NULL;
+  }
+
+  op->keyed = 0;
+  op->text.len = 0;
+  op->def.len = 0;
+
+  if (p < last && *p == '{') {
+    op->text.data = ++p;
+    while (p < last && *p != '}') {
+      p++;
+    }
+    if (p == last) {
+      return NULL;
+    }
+    op->text.len = p++ - op->text.data;
+    op->keyed = 1;
+  }
+
+  if (p < last && *p == '|') {
+    op->def.data = ++p;
+    while (p < last && *p != ')') {
+      p++;
+    }
+    op->def.len = p - op->def.data;
+
+    if (op->def.len >= 2 && op->def.data[0] == '\''
+        && op->def.data[op->def.len - 1] == '\'')
+    {
+      op->def.data++;
+      op->def.len -= 2;
+    }
+  }
+
+  if (p == last || *p != ')') {
+    return NULL;
+  }
+
+  return p + 1;
+}
+
+ngx_int_t
+ngx_esi_vars_compile(ngx_pool_t *pool, ngx_str_t *text, ngx_array_t **plan)
+{
+  u_char            *p, *last, *literal, *end;
+  ngx_array_t       *ops;
+  ngx_esi_var_op_t  *op, var;
+
+  p = text->data;
+  last = p + text->len;
+
+  if (ngx_strlcasestrn(p, last, (u_char *) "$(", 2 - 1) == NULL) {
+    return NGX_DECLINED;
+  }
+
+  ops = ngx_array_create(pool, 4, sizeof(ngx_esi_var_op_t));
+  if (ops == NULL) {
+    return NGX_ERROR;
+  }
+
+  literal = p;
+
+  while (p < last) {
+    p = ngx_strlchr(p, last, '$');
+    if (p == NULL) {
+      break;
+    }
+
+    end = ngx_esi_vars_parse(p, last, &var);
+    if (end == NULL) {
+      /* not a variable, it stays part of the literal */
+      p++;
+      continue;
+    }
+
+    if (p > literal) {
+      op = ngx_array_push(ops);
+      if (op == NULL) {
+        return NGX_ERROR;
+      }
+      ngx_memzero(op, sizeof(ngx_esi_var_op_t));
+      op->op = NGX_ESI_VAR_LITERAL;
+      op->text.data = literal;
+      op->text.len = p - literal;
+    }
+
+    op = ngx_array_push(ops);
+    if (op == NULL) {
+      return NGX_ERROR;
+    }
+    *op = var;
+
+    p = literal = end;
+  }
+
+  if (literal < last) {
+    op = ngx_array_push(ops);
+    if (op == NULL) {
+      return NGX_ERROR;
+    }
+    ngx_memzero(op, sizeof(ngx_esi_var_op_t));
+    op->op = NGX_ESI_VAR_LITERAL;
+    op->text.data = literal;
+    op->text.len = last - literal;
+  }
+
+  *plan = ops;
+
+  return NGX_OK;
+}
+
+/* split "k1=v1<sep>k2=v2" into pairs, leading spaces are dropped from the keys */
+static ngx_array_t *
+ngx_esi_vars_split(ngx_pool_t *pool, ngx_str_t *value, u_char sep)
+{
+  u_char        *p, *last, *end, *eq;
+  ngx_array_t   *pairs;
+  ngx_keyval_t  *kv;
+
+  pairs = ngx_array_create(pool, 4, sizeof(ngx_keyval_t));
+  if (pairs == NULL) {
+    return NULL;
+  }
+
+  p = value->data;
+  last = p + value->len;
+
+  while (p < last) {
+    while (p < last && *p == ' ') {
+      p++;
+    }
+
+    end = ngx_strlchr(p, last, sep);
+    if (end == NULL) {
+      end = last;
+    }
+
+    eq = ngx_strlchr(p, end, '=');
+
+    if (end > p) {
+      kv = ngx_array_push(pairs);
+      if (kv == NULL) {
+        return NULL;
+      }
+      kv->key.data = p;
+      kv->key.len = (eq ? eq : end) - p;
+      kv->value.data = eq ? eq + 1 : end;
+      kv->value.len = eq ? (size_t) (end - eq - 1) : 0;
+    }
+
+    p = end + 1;
+  }
+
+  return pairs;
+}
+
+/* language ranges of Accept-Language without their quality */
+static ngx_array_t *
+ngx_esi_vars_languages(ngx_pool_t *pool, ngx_str_t *value)
+{
+  u_char       *p, *last, *end, *q;
+  ngx_str_t    *lang;
+  ngx_array_t  *langs;
+
+  langs = ngx_array_create(pool, 4, sizeof(ngx_str_t));
+  if (langs == NULL) {
+    return NULL;
+  }
+
+  p = value->data;
+  last = p + value->len;
+
+  while (p < last) {
+    while (p < last && *p == ' ') {
+      p++;
+    }
+
+    end = ngx_strlchr(p, last, ',');
+    if (end == NULL) {
+      end = last;
+    }
+
+    q = ngx_strlchr(p, end, ';');
+    if (q == NULL) {
+      q = end;
+    }
+    while (q > p && q[-1] == ' ') {
+      q--;
+    }
+
+    if (q > p) {
+      lang = ngx_array_push(langs);
+      if (lang == NULL) {
+        return NULL;
+      }
+      lang->data = p;
+      lang->len = q - p;
+    }
+
+    p = end + 1;
+  }
+
+  return langs;
+}
+
+static ngx_esi_vars_t *
+ngx_esi_vars_get(ngx_http_esi_ctx_t *ctx)
+{
+  ngx_uint_t                  i;
+  ngx_http_request_t         *r = ctx->request;
+  ngx_http_variable_value_t  *vv;
+
+  if (ctx->vars == NULL) {
+    ctx->vars = ngx_pcalloc(r->pool, sizeof(ngx_esi_vars_t));
+    if (ctx->vars == NULL) {
+      return NULL;
+    }
+  }
+
+  if (!ctx->vars->fetched) {
+    /* the variables are those of the client request, not of an enclosing fragment */
+    for (i = 1; i < NGX_ESI_VAR_N; i++) {
+      vv = ngx_http_get_indexed_variable(r->main, ngx_esi_vars_index[i]);
+      if (vv && !vv->not_found) {
+        ctx->vars->values[i].data = vv->data;
+        ctx->vars->values[i].len = vv->len;
+      }
+    }
+    ctx->vars->fetched = 1;
+  }
+
+  return ctx->vars;
+}
+
+static ngx_str_t *
+ngx_esi_vars_lookup(ngx_array_t *pairs, ngx_str_t *key)
+{
+  ngx_uint_t     i;
+  ngx_keyval_t  *kv;
+
+  if (pairs == NULL) {
+    return NULL;
+  }
+
+  kv = pairs->elts;
+  for (i = 0; i < pairs->nelts; i++) {
+    if (kv[i].key.len == key->len
+        && ngx_strncmp(kv[i].key.data, key->data, key->len) == 0)
+    {
+      return &kv[i].value;
+    }
+  }
+
+  return NULL;
+}
+
+/* HTTP_USER_AGENT{browser|os|version} */
+static void
+ngx_esi_vars_user_agent(ngx_str_t *ua, ngx_str_t *key, ngx_str_t *value)
+{
+  u_char  *p, *last, *end;
+
+  last = ua->data + ua->len;
+
+  if (key->len == 7 && ngx_strncmp(key->data, "browser", 7) == 0) {
+    if (ngx_strlcasestrn(ua->data, last, (u_char *) "MSIE", 4 - 1)
+        || ngx_strlcasestrn(ua->data, last, (u_char *) "Trident", 7 - 1))
+    {
+      ngx_str_set(value, "MSIE");
+    }
+    else if (ngx_strlcasestrn(ua->data, last, (u_char *) "Mozilla", 7 - 1)) {
+      ngx_str_set(value, "MOZILLA");
+    }
+    else {
+      ngx_str_set(value, "OTHER");
+    }
+    return;
+  }
+
+  if (key->len == 2 && ngx_strncmp(key->data, "os", 2) == 0) {
+    if (ngx_strlcasestrn(ua->data, last, (u_char *) "Windows", 7 - 1)) {
+      ngx_str_set(value, "WIN");
+    }
+    else if (ngx_strlcasestrn(ua->data, last, (u_char *) "Mac", 3 - 1)) {
+      ngx_str_set(value, "MAC");
+    }
+    else if (ngx_strlcasestrn(ua->data, last, (u_char *) "X11", 3 - 1)
+             || ngx_strlcasestrn(ua->data, last, (u_char *) "Linux", 5 - 1))
+    {
+      ngx_str_set(value, "UNIX");
+    }
+    else {
+      ngx_str_set(value, "OTHER");
+    }
+    return;
+  }
+
+  if (key->len == 7 && ngx_strncmp(key->data, "version", 7) == 0) {
+    p = ngx_strlcasestrn(ua->data, last, (u_char *) "MSIE ", 5 - 1);
+    if (p) {
+      p += 5;
+    }
+    else {
+      p = ngx_strlchr(ua->data, last, '/');
+      p = p ? p + 1 : last;
+    }
+    for (end = p; end < last && *end != ';' && *end != ' ' && *end != ')'; end++) {
+      /* up to the end of the version */
+    }
+    value->data = p;
+    value->len = end - p;
+  }
+}
+
+void
+ngx_esi_vars_value(ngx_http_esi_ctx_t *ctx, ngx_esi_var_op_t *op, ngx_str_t *value)
+{
+  ngx_str_t       *v, *lang;
+  ngx_uint_t       i;
+  ngx_pool_t      *pool = ctx->request->pool;
+  ngx_esi_vars_t  *vars;
+
+  value->len = 0;
+  value->data = NULL;
+
+  if (op->op == NGX_ESI_VAR_LITERAL) {
+    *value = op->text;
+    return;
+  }
+
+  vars = ngx_esi_vars_get(ctx);
+  if (vars == NULL) {
+    return;
+  }
+
+  v = &vars->values[op->op];
+
+  if (!op->keyed || v->len == 0) {
+    *value = *v;
+    return;
+  }
+
+  switch (op->op) {
+
+  case NGX_ESI_VAR_HTTP_COOKIE:
+    if (vars->cookies == NULL) {
+      vars->cookies = ngx_esi_vars_split(pool, v, ';');
+    }
+    v = ngx_esi_vars_lookup(vars->cookies, &op->text);
+    if (v) {
+      *value = *v;
+    }
+    break;
+
+  case NGX_ESI_VAR_QUERY_STRING:
+    if (vars->args == NULL) {
+      vars->args = ngx_esi_vars_split(pool, v, '&');
+    }
+    v = ngx_esi_vars_lookup(vars->args, &op->text);
+    if (v) {
+      *value = *v;
+    }
+    break;
+
+  case NGX_ESI_VAR_HTTP_ACCEPT_LANGUAGE:
+    if (vars->languages == NULL) {
+      vars->languages = ngx_esi_vars_languages(pool, v);
+    }
+    ngx_str_set(value, "false");
+    if (vars->languages == NULL) {
+      break;
+    }
+    /* {en} matches en as well as en-us */
+    lang = vars->languages->elts;
+    for (i = 0; i < vars->languages->nelts; i++) {
+      if (lang[i].len >= op->text.len
+          && ngx_strncasecmp(lang[i].data, op->text.data, op->text.len) == 0
+          && (lang[i].len == op->text.len || lang[i].data[op->text.len] == '-'))
+      {
+        ngx_str_set(value, "true");
+        break;
+      }
+    }
+    break;
+
+  case NGX_ESI_VAR_HTTP_USER_AGENT:
+    ngx_esi_vars_user_agent(v, &op->text, value);
+    break;
+
+  default:
+    *value = *v;
+    break;
+  }
+}
+
+ngx_int_t
+ngx_esi_vars_eval(ngx_http_esi_ctx_t *ctx, ngx_array_t *plan, ngx_str_t *out)
+{
+  size_t             len;
+  u_char            *p;
+  ngx_str_t          value;
+  ngx_uint_t         i;
+  ngx_esi_var_op_t  *op = plan->elts;
+
+  len = 0;
+  for (i = 0; i < plan->nelts; i++) {
+    ngx_esi_vars_value(ctx, &op[i], &value);
+    len += value.len ? value.len : op[i].def.len;
+  }
+
+  p = ngx_pnalloc(ctx->request->pool, len);
+  if (p == NULL && len) {
+    return NGX_ERROR;
+  }
+
+  out->data = p;
+  out->len = len;
+
+  for (i = 0; i < plan->nelts; i++) {
+    ngx_esi_vars_value(ctx, &op[i], &value);
+    if (value.len == 0) {
+      value = op[i].def;
+    }
+    p = ngx_cpymem(p, value.data, value.len);
+  }
+
+  return NGX_OK;
+}
+
+ngx_int_t
+ngx_esi_vars_substitute(ngx_http_esi_ctx_t *ctx, ngx_str_t *text)
+{
+  ngx_int_t     rc;
+  ngx_array_t  *plan;
+
+  rc = ngx_esi_vars_compile(ctx->request->pool, text, &plan);
+  if (rc != NGX_OK) {
+    return rc;
+  }
+
+  return ngx_esi_vars_eval(ctx, plan, text);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) Todd A. Fisher
+ */
+#ifndef NGX_ESI_VARS_H
+#define NGX_ESI_VARS_H
+
+#include "ngx_http_esi_filter_module.h"
+
+/*
+ * ESI 1.0 variables, e.g.
+ *
+ *  $(HTTP_COOKIE{name})  $(QUERY_STRING{p}|'default')  $(HTTP_USER_AGENT{os})
+ *
+ * Text holding variables is compiled into a plan, an array of ops that are either
+ * literal text or a variable lookup. The request headers behind the variables are
+ * parsed the first time a plan needs them and kept for the rest of the request
+ */
+typedef enum {
+  NGX_ESI_VAR_LITERAL = 0,
+  NGX_ESI_VAR_HTTP_ACCEPT_LANGUAGE,
+  NGX_ESI_VAR_HTTP_COOKIE,
+  NGX_ESI_VAR_HTTP_HOST,
+  NGX_ESI_VAR_HTTP_REFERER,
+  NGX_ESI_VAR_HTTP_USER_AGENT,
+  NGX_ESI_VAR_QUERY_STRING,
+  NGX_ESI_VAR_N
+} ngx_esi_var_e;
+
+typedef struct {
+  ngx_esi_var_e  op;
+  ngx_str_t      text;    /* literal text, or the {key} of the variable */
+  ngx_str_t      def;     /* |default, used when the variable has no value */
+  unsigned       keyed:1; /* text is a {key} */
+} ngx_esi_var_op_t;
+
+/* per request, filled in on first use */
+typedef struct ngx_esi_vars_s {
+  ngx_str_t     values[NGX_ESI_VAR_N]; /* raw header values */
+  ngx_array_t  *cookies;               /* ngx_keyval_t */
+  ngx_array_t  *args;                  /* ngx_keyval_t */
+  ngx_array_t  *languages;             /* ngx_str_t */
+  unsigned      fetched:1;
+} ngx_esi_vars_t;
+
+ngx_int_t ngx_esi_vars_init(ngx_conf_t *cf);
+
+/* parse a variable reference starting at "$(", returns the end of it or NULL if it is not one */
+u_char *ngx_esi_vars_parse(u_char *p, u_char *last, ngx_esi_var_op_t *op);
+
+/* NGX_DECLINED if text has no variables, *plan is then left alone */
+ngx_int_t ngx_esi_vars_compile(ngx_pool_t *pool, ngx_str_t *text, ngx_array_t **plan);
+ngx_int_t ngx_esi_vars_eval(ngx_http_esi_ctx_t *ctx, ngx_array_t *plan, ngx_str_t *out);
+/* value of a single variable op, empty if it has none */
+void ngx_esi_vars_value(ngx_http_esi_ctx_t *ctx, ngx_esi_var_op_t *op, ngx_str_t *value);
+
+/* compile and evaluate text in place, it is left as it is when there is nothing to substitute */
+ngx_int_t ngx_esi_vars_substitute(ngx_http_esi_ctx_t *ctx, ngx_str_t *text);
+
+#endif
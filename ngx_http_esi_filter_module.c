@@ -7,32 +7,36 @@
  * This module is model'ed after ssi module
  */
 
+#include <nginx.h>
 #include "ngx_esi_tag.h"
 #include "ngx_http_esi_filter_module.h"
 #include "ngx_buf_util.h"
-
-typedef struct {
-    ngx_hash_t                hash;
-    ngx_hash_keys_arrays_t    commands;
-} ngx_http_esi_main_conf_t;
-
-typedef struct {
-  ngx_flag_t     enable;          /* enable esi filter */
-  ngx_flag_t     silent_errors;   /* ignore include errors, don't raise exceptions */
-  ngx_array_t   *types;           /* array of ngx_str_t */
-
-  size_t         min_file_chunk;  /* smallest size chunk */
-  size_t         max_depth;       /* how many times to follow an esi:include redirect... */
-} ngx_http_esi_loc_conf_t;
+#include "ngx_esi_shm.h"
+#include "ngx_esi_cache.h"
+#include "ngx_esi_vars.h"
+#include "ngx_esi_fetch.h"
 
 
 static ngx_int_t ngx_http_esi_preconfiguration(ngx_conf_t *cf);
 static ngx_int_t ngx_http_esi_filter_init(ngx_conf_t *cf);
 static char *ngx_http_esi_types(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_esi_timeout_factor(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_esi_degrade(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_esi_fragment_root(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_esi_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static void *ngx_http_esi_create_main_conf(ngx_conf_t *cf);
 static char *ngx_http_esi_init_main_conf(ngx_conf_t *cf, void *conf);
 static void *ngx_http_esi_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_esi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child);
+static ngx_int_t ngx_http_esi_deduped_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
+
+static ngx_conf_enum_t  ngx_http_esi_bigpipe[] = {
+    { ngx_string("off"), NGX_HTTP_ESI_BIGPIPE_OFF },
+    { ngx_string("on"), NGX_HTTP_ESI_BIGPIPE_ON },
+    { ngx_string("all"), NGX_HTTP_ESI_BIGPIPE_ALL },
+    { ngx_null_string, 0 }
+};
 
 /* modified from ssi module */
 static ngx_command_t  ngx_http_esi_filter_commands[] = {
@@ -53,18 +57,39 @@ static ngx_command_t  ngx_http_esi_filter_commands[] = {
       NULL },
 
     { ngx_string("esi_min_file_chunk"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_size_slot,
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_esi_loc_conf_t, min_file_chunk),
       NULL },
 
     { ngx_string("esi_max_depth"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_size_slot,
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_esi_loc_conf_t, max_depth),
       NULL },
+
+    { ngx_string("esi_buffers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, bufs),
+      NULL },
+
+    { ngx_string("esi_max_includes"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, max_includes),
+      NULL },
+
+    { ngx_string("esi_max_bytes"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, max_bytes),
+      NULL },
     
     { ngx_string("esi_types"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
@@ -73,11 +98,181 @@ static ngx_command_t  ngx_http_esi_filter_commands[] = {
       0,
       NULL },
 
+    { ngx_string("esi_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_esi_shm_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("esi_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_esi_shm_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("esi_origin_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, origin_limit),
+      NULL },
+
+    { ngx_string("esi_origin_queue"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, origin_queue),
+      NULL },
+
+    { ngx_string("esi_origin_queue_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, origin_queue_timeout),
+      NULL },
+
+    { ngx_string("esi_adaptive_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, adaptive_timeout),
+      NULL },
+
+    { ngx_string("esi_adaptive_timeout_min"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, timeout_min),
+      NULL },
+
+    { ngx_string("esi_adaptive_timeout_max"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, timeout_max),
+      NULL },
+
+    { ngx_string("esi_adaptive_timeout_factor"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_esi_timeout_factor,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("esi_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_esi_cache_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("esi_cache_valid"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, cache_valid),
+      NULL },
+
+    { ngx_string("esi_cache_stale"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, cache_stale),
+      NULL },
+
+    { ngx_string("esi_bigpipe"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, bigpipe),
+      &ngx_http_esi_bigpipe },
+
+    { ngx_string("esi_client_fallback"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, client_fallback),
+      NULL },
+
+    { ngx_string("esi_batch_pass"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, batch_pass),
+      NULL },
+
+    { ngx_string("esi_fragment_pass"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_esi_fetch_pass,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("esi_fragment_root"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_http_esi_fragment_root,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("esi_parse_budget"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, parse_budget),
+      NULL },
+
+    { ngx_string("esi_max_buffered"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_esi_loc_conf_t, max_buffered),
+      NULL },
+
+    { ngx_string("esi_thread_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_esi_thread_pool,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("esi_fragment"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_esi_cache_fragment,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("esi_degrade_connections"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_esi_degrade,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_esi_main_conf_t, degrade_connections),
+      NULL },
+
+    { ngx_string("esi_degrade_fetches"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_esi_degrade,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_esi_main_conf_t, degrade_fetches),
+      NULL },
+
 
       ngx_null_command
 };
 
 
+static ngx_http_variable_t  ngx_http_esi_variables[] = {
+
+    { ngx_string("esi_deduped"), NULL, ngx_http_esi_deduped_variable, 0,
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_null_string, NULL, NULL, 0, 0, 0 }
+};
+
+
 static ngx_http_module_t  ngx_http_esi_filter_module_ctx = {
     ngx_http_esi_preconfiguration,         /* preconfiguration */
     ngx_http_esi_filter_init,              /* postconfiguration */
@@ -162,14 +357,208 @@ ngx_http_esi_types(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     return NGX_CONF_OK;
 }
 
+/* esi_adaptive_timeout_factor 1.5, stored as a percentage */
+static char *
+ngx_http_esi_timeout_factor(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_esi_loc_conf_t *slcf = conf;
+
+    ngx_int_t   n;
+    ngx_str_t  *value;
+
+    if (slcf->timeout_factor != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atofp(value[1].data, value[1].len, 2);
+    if (n == NGX_ERROR || n < 100) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid factor \"%V\", it must be 1.0 or more", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    slcf->timeout_factor = (ngx_uint_t) n;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * esi_degrade_connections high [low], esi_degrade_fetches high [low]
+ * without low the mode is left at three quarters of high
+ */
+static char *
+ngx_http_esi_degrade(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char  *p = conf;
+
+    ngx_int_t                  high, low;
+    ngx_str_t                 *value;
+    ngx_http_esi_threshold_t  *t;
+
+    t = (ngx_http_esi_threshold_t *) (p + cmd->offset);
+
+    if (t->high) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    high = ngx_atoi(value[1].data, value[1].len);
+    if (high == NGX_ERROR || high == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid threshold \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 3) {
+        low = ngx_atoi(value[2].data, value[2].len);
+        if (low == NGX_ERROR || low > high) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid threshold \"%V\", it must not be "
+                               "larger than \"%V\"", &value[2], &value[1]);
+            return NGX_CONF_ERROR;
+        }
+
+    } else {
+        low = high * 3 / 4;
+    }
+
+    t->high = (ngx_uint_t) high;
+    t->low = (ngx_uint_t) low;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * esi_fragment_root /fragments/ html/fragments/, includes under the uri prefix
+ * are read from the files under the directory instead of being fetched
+ */
+static char *
+ngx_http_esi_fragment_root(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_esi_loc_conf_t *slcf = conf;
+
+    ngx_str_t  *value;
+
+    if (slcf->local_prefix.data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0 || value[1].data[0] != '/') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid uri prefix \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, &value[2], 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    slcf->local_prefix = value[1];
+    slcf->local_root = value[2];
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * esi_thread_pool default 1m, buffers of 1m and up are scanned for esi tags
+ * by the thread pool before they are parsed
+ */
+static char *
+ngx_http_esi_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+#if (NGX_THREADS)
+    ngx_http_esi_loc_conf_t *slcf = conf;
+
+    ssize_t     size;
+    ngx_str_t  *value;
+
+    if (slcf->thread_pool != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        slcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    slcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (slcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 3) {
+        size = ngx_parse_size(&value[2]);
+        if (size == NGX_ERROR || size == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid size \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        slcf->thread_min = (size_t) size;
+    }
+
+    return NGX_CONF_OK;
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"esi_thread_pool\" requires nginx built "
+                       "with thread pools, --with-threads");
+    return NGX_CONF_ERROR;
+#endif
+}
+
 static ngx_int_t
 ngx_http_esi_preconfiguration(ngx_conf_t *cf)
 {
     ngx_http_esi_main_conf_t  *smcf;
+    ngx_http_variable_t       *var, *v;
 
     smcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_esi_filter_module);
 
+    for (v = ngx_http_esi_variables; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
+/* includes of the page that shared the fetch of an earlier include of the same fragment */
+static ngx_int_t
+ngx_http_esi_deduped_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char              *p;
+    ngx_http_esi_ctx_t  *ctx;
+
+    ctx = ngx_http_get_module_ctx(r->main, ngx_http_esi_filter_module);
+    if (ctx == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
 
+    v->len = ngx_sprintf(p, "%ui", ctx->deduped) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
 
     return NGX_OK;
 }
@@ -188,13 +577,43 @@ ngx_http_esi_create_loc_conf(ngx_conf_t *cf)
      * set by ngx_pcalloc():
      *
      *     conf->types = NULL;
+     *     conf->bufs.num = 0;
+     *     conf->client_fallback = { 0, NULL };
+     *     conf->batch_pass = { 0, NULL };
+     *     conf->local_prefix = { 0, NULL };
+     *     conf->local_root = { 0, NULL };
      */
 
     slcf->enable         = NGX_CONF_UNSET;
     slcf->silent_errors  = NGX_CONF_UNSET;
     slcf->min_file_chunk = NGX_CONF_UNSET_SIZE;
     slcf->max_depth      = NGX_CONF_UNSET_SIZE;
-    
+    slcf->max_includes   = NGX_CONF_UNSET_UINT;
+    slcf->max_bytes      = NGX_CONF_UNSET_SIZE;
+
+    slcf->origin_limit         = NGX_CONF_UNSET_UINT;
+    slcf->origin_queue         = NGX_CONF_UNSET_UINT;
+    slcf->origin_queue_timeout = NGX_CONF_UNSET_MSEC;
+
+    slcf->adaptive_timeout     = NGX_CONF_UNSET;
+    slcf->timeout_min          = NGX_CONF_UNSET_MSEC;
+    slcf->timeout_max          = NGX_CONF_UNSET_MSEC;
+    slcf->timeout_factor       = NGX_CONF_UNSET_UINT;
+
+    slcf->cache_valid          = NGX_CONF_UNSET;
+    slcf->cache_stale          = NGX_CONF_UNSET;
+
+    slcf->bigpipe              = NGX_CONF_UNSET_UINT;
+
+    slcf->fragment_pass        = NGX_CONF_UNSET_PTR;
+
+    slcf->parse_budget         = NGX_CONF_UNSET_SIZE;
+    slcf->max_buffered         = NGX_CONF_UNSET_SIZE;
+
+#if (NGX_THREADS)
+    slcf->thread_pool          = NGX_CONF_UNSET_PTR;
+    slcf->thread_min           = NGX_CONF_UNSET_SIZE;
+#endif
 
     return slcf;
 }
@@ -206,7 +625,8 @@ ngx_http_esi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_http_esi_loc_conf_t *prev = parent;
     ngx_http_esi_loc_conf_t *conf = child;
 
-    ngx_str_t  *type;
+    ngx_str_t                 *type;
+    ngx_http_esi_main_conf_t  *emcf;
 
 
     ngx_conf_merge_value(conf->enable, prev->enable, 0);
@@ -214,7 +634,71 @@ ngx_http_esi_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_size_value(conf->min_file_chunk, prev->min_file_chunk, 1024);
     ngx_conf_merge_size_value(conf->max_depth, prev->max_depth, 256);
-    
+    ngx_conf_merge_uint_value(conf->max_includes, prev->max_includes, 0);
+    ngx_conf_merge_size_value(conf->max_bytes, prev->max_bytes, 0);
+
+    ngx_conf_merge_bufs_value(conf->bufs, prev->bufs, 16, ngx_pagesize);
+
+    ngx_conf_merge_uint_value(conf->origin_limit, prev->origin_limit, 0);
+    ngx_conf_merge_uint_value(conf->origin_queue, prev->origin_queue, 0);
+    ngx_conf_merge_msec_value(conf->origin_queue_timeout,
+                              prev->origin_queue_timeout, 1000);
+
+    ngx_conf_merge_value(conf->adaptive_timeout, prev->adaptive_timeout, 0);
+    ngx_conf_merge_msec_value(conf->timeout_min, prev->timeout_min, 50);
+    ngx_conf_merge_msec_value(conf->timeout_max, prev->timeout_max, 10000);
+    ngx_conf_merge_uint_value(conf->timeout_factor, prev->timeout_factor, 150);
+
+    ngx_conf_merge_sec_value(conf->cache_valid, prev->cache_valid, 0);
+    ngx_conf_merge_sec_value(conf->cache_stale, prev->cache_stale, 0);
+
+    ngx_conf_merge_uint_value(conf->bigpipe, prev->bigpipe,
+                              NGX_HTTP_ESI_BIGPIPE_OFF);
+
+    ngx_conf_merge_str_value(conf->client_fallback, prev->client_fallback, "");
+    ngx_conf_merge_str_value(conf->batch_pass, prev->batch_pass, "");
+    ngx_conf_merge_ptr_value(conf->fragment_pass, prev->fragment_pass, NULL);
+
+    if (conf->local_prefix.data == NULL) {
+        conf->local_prefix = prev->local_prefix;
+        conf->local_root = prev->local_root;
+    }
+
+    ngx_conf_merge_size_value(conf->parse_budget, prev->parse_budget, 0);
+    ngx_conf_merge_size_value(conf->max_buffered, prev->max_buffered, 0);
+
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+    ngx_conf_merge_size_value(conf->thread_min, prev->thread_min,
+                              1024 * 1024);
+#endif
+
+    if (conf->timeout_min > conf->timeout_max) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"esi_adaptive_timeout_min\" is larger than "
+                           "\"esi_adaptive_timeout_max\"");
+        return NGX_CONF_ERROR;
+    }
+
+    emcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_esi_filter_module);
+
+    if (conf->origin_limit && emcf->shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"esi_origin_limit\" requires \"esi_zone\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->adaptive_timeout && emcf->shm_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"esi_adaptive_timeout\" requires \"esi_zone\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->client_fallback.len && emcf->cache_zone == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"esi_client_fallback\" requires \"esi_cache_zone\"");
+        return NGX_CONF_ERROR;
+    }
 
     if (conf->types == NULL) {
         if (prev->types == NULL) {
@@ -249,7 +733,9 @@ ngx_http_esi_header_filter(ngx_http_request_t *r)
 
   slcf = ngx_http_get_module_loc_conf(r, ngx_http_esi_filter_module);
 
+  /* a fragment fetched for a page is parsed by the page, see ngx_http_esi_include_expand */
   if (!slcf->enable
+      || r->subrequest_in_memory
       || r->headers_out.content_type.len == 0
       || r->headers_out.content_length_n == 0)
   {
@@ -280,15 +766,11 @@ found:
   ngx_http_set_ctx(r, ctx, ngx_http_esi_filter_module);
 
   ctx->request = r;
-  ctx->root_tag = NULL;
-  ctx->open_tag = NULL;
   /* allocate some output buffers */
   ctx->last_buf = ctx->chain = ngx_alloc_chain_link(r->pool);
   ctx->last_buf->buf = ctx->chain->buf = NULL;
   ctx->last_buf->next = ctx->chain->next = NULL;
 
-  r->filter_need_in_memory = 1;
-
   if (r == r->main) {
     ngx_http_clear_content_length(r);
     ngx_http_clear_last_modified(r);
@@ -302,27 +784,37 @@ esi_parser_start_tag_cb( const void *data, const char *name_start, size_t length
 {
   ESITag *tag = NULL;
   ngx_http_esi_ctx_t *ctx = (ngx_http_esi_ctx_t*)context;
-  esi_tag_t type = esi_tag_str_to_type( name_start, length );
+  esi_tag_t type;
+
+  if( ctx->skip ) {
+    /* discarded, only counted so the end of the discarded region is found */
+    ctx->skip++;
+    return;
+  }
+
+  type = esi_tag_str_to_type( name_start, length );
 
   if( type == ESI_NONE ) {
     ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0, "Invalid ESI Tag!");
     return;
   }
 
-  tag = esi_tag_new(type, ctx);
+  tag = esi_tag_push( ctx, type );
 
-  if( ctx->root_tag ) {
-    ESITag *last = ctx->root_tag;
-    while( last->next ) {
-      last = last->next;
-    }
-    last->next = tag;
-  }
-  else {
-    ctx->root_tag = tag;
+  if( tag == NULL ) {
+    /* nested too deep, the whole element is discarded */
+    ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0,
+                  "esi tags nested deeper than %d, discarded", NGX_ESI_TAG_DEPTH);
+    ctx->skip = 1;
+    ctx->deep = 1;
+    esi_parser_skip( ctx->parser, 1 );
+    return;
   }
-  ctx->open_tag = tag;
+
   esi_tag_open( tag , attributes );
+
+  /* the parser jumps over what the tag discards, e.g. <esi:remove> */
+  esi_parser_skip( ctx->parser, ctx->skip != 0 );
 //  printf("start tag:%d ", (int)length ); debug_string( name_start, length ); printf("\n" );
 }
 
@@ -330,22 +822,29 @@ static void
 esi_parser_end_tag_cb( const void *data, const char *name_start, size_t length, void *context )
 {
   ngx_http_esi_ctx_t *ctx = (ngx_http_esi_ctx_t*)context;
-  esi_tag_t type = esi_tag_str_to_type( name_start, length );
+  esi_tag_t type;
+
+  /* the tag that started discarding is closed as usual */
+  if( ctx->skip && --ctx->skip ) {
+    return;
+  }
+
+  esi_parser_skip( ctx->parser, 0 );
+
+  if( ctx->deep ) {
+    /* the end of the element too deep for the stack, nothing of it was opened */
+    ctx->deep = 0;
+    return;
+  }
+
+  type = esi_tag_str_to_type( name_start, length );
 
   if( type == ESI_NONE ) {
     ngx_log_error(NGX_LOG_ERR, ctx->request->connection->log, 0, "Invalid ESI Tag!");
     return;
   }
 
-  if( ctx->root_tag ) {
-    if( ctx->root_tag->type == type ) {
-      esi_tag_close( ctx->root_tag );
-      ctx->open_tag = ctx->root_tag = NULL;
-    }
-    else {
-      ctx->open_tag = esi_tag_close_children( ctx->root_tag, type );
-    }
-  }
+  esi_tag_pop( ctx, type );
 
 //  printf("end tag:%d ", (int)length ); debug_string( name_start, length ); printf("\n" );
 }
@@ -356,11 +855,25 @@ esi_parser_output_cb( const void *data, size_t length, void *context )
   ngx_buf_t *buf;
   ngx_http_esi_ctx_t *ctx = (ngx_http_esi_ctx_t*)context;
 
-  if( ctx->root_tag && ctx->open_tag ) {
+  if( ctx->skip ) {
+    return;
+  }
+
+  if( ctx->open_tag ) {
     buf = esi_tag_buffer( ctx->open_tag, data, length );
   }
   else {
-    buf = ngx_buf_from_data( ctx->request->pool, data, length );
+    buf = ngx_http_esi_text( ctx, data, length );
+  }
+
+  if( buf && buf == ctx->last_buf->buf ) {
+    /* appended to the tail buffer */
+    return;
+  }
+
+  if( buf && buf->temporary ) {
+    /* a copy only the output refers to, see ngx_http_esi_spill */
+    buf->tag = (ngx_buf_tag_t) &ngx_http_esi_filter_module;
   }
 
   if( buf ) {
@@ -369,73 +882,1002 @@ esi_parser_output_cb( const void *data, size_t length, void *context )
   //printf("output char len: %d \n", (int)length );debug_string( (const char*)data, (int)length );printf("\n");
 }
 
+/*
+ * small pieces are appended to the esi_buffers buffer at the tail of the chain
+ * being written while it has room and has not been passed on. A piece as large
+ * as a buffer, or one that comes when all buffers are out, gets a copy of its own
+ */
+static ngx_buf_t *
+ngx_http_esi_buffer(ngx_http_esi_ctx_t *ctx, const void *data, size_t length)
+{
+  ngx_buf_t               *b;
+  ngx_chain_t             *cl;
+  ngx_http_esi_try_t      *t;
+  ngx_pool_t              *pool = ctx->request->pool;
+  ngx_http_esi_loc_conf_t *slcf;
+
+  b = ctx->last_buf->buf;
+
+  if( b && b == ctx->coalesce && b->temporary && (size_t) (b->end - b->last) >= length ) {
+    b->last = ngx_cpymem( b->last, data, length );
+    return b;
+  }
+
+  slcf = ngx_http_get_module_loc_conf(ctx->request, ngx_http_esi_filter_module);
+
+  if( length >= slcf->bufs.size ) {
+    return ngx_buf_from_data( pool, data, length );
+  }
+
+  if( ctx->free ) {
+    cl = ctx->free;
+    ctx->free = cl->next;
+    b = cl->buf;
+    ngx_free_chain( pool, cl );
+  }
+  else if( ctx->nbufs < (ngx_uint_t) slcf->bufs.num ) {
+    b = ngx_create_temp_buf( pool, slcf->bufs.size );
+    if( b == NULL ) {
+      return NULL;
+    }
+    b->tag = (ngx_buf_tag_t) &ngx_http_esi_filter_module;
+    b->recycled = 1;
+    ctx->nbufs++;
+  }
+  else {
+    return ngx_buf_from_data( pool, data, length );
+  }
+
+  b->pos = b->start;
+  b->last = ngx_cpymem( b->pos, data, length );
+  ctx->coalesce = b;
+
+  t = ctx->try;
+  if( t ) {
+    /* the esi:try part may be thrown away, its buffers are then free again at once */
+    cl = ngx_alloc_chain_link( pool );
+    if( cl ) {
+      cl->buf = b;
+      cl->next = NULL;
+      if( t->pooled[ctx->branch] ) {
+        t->pooled_last[ctx->branch]->next = cl;
+      }
+      else {
+        t->pooled[ctx->branch] = cl;
+      }
+      t->pooled_last[ctx->branch] = cl;
+    }
+  }
+
+  return b;
+}
+
+ngx_buf_t *
+ngx_http_esi_text(ngx_http_esi_ctx_t *ctx, const void *data, size_t length)
+{
+  off_t      offset;
+  ngx_buf_t *buf;
+
+  if( ctx->input == NULL
+      || (const u_char *) data < ctx->input_start
+      || (const u_char *) data + length > ctx->input_start + ctx->input_len )
+  {
+    return ngx_http_esi_buffer( ctx, data, length );
+  }
+
+  /* the document as is, a region of the file instead of a copy */
+  offset = ctx->input_pos + ((const u_char *) data - ctx->input_start);
+
+  buf = ctx->last_buf->buf;
+  if( buf && buf->in_file && !ngx_buf_in_memory( buf )
+      && buf->file == ctx->input->file && buf->file_last == offset )
+  {
+    buf->file_last += length;
+    return buf;
+  }
+
+  buf = ngx_calloc_buf( ctx->request->pool );
+  if( buf ) {
+    buf->in_file = 1;
+    buf->file = ctx->input->file;
+    buf->file_pos = offset;
+    buf->file_last = offset + length;
+  }
+
+  return buf;
+}
+
+/* parsers of this worker done with their documents, linked through user_data */
+static ESIParser   *ngx_http_esi_parsers;
+static ngx_uint_t   ngx_http_esi_nparsers;
+
+ESIParser *
+ngx_http_esi_parser_create(ngx_http_esi_ctx_t *ctx)
+{
+  ESIParser *parser;
+
+  if( ngx_http_esi_parsers ) {
+    parser = ngx_http_esi_parsers;
+    ngx_http_esi_parsers = (ESIParser*)parser->user_data;
+    ngx_http_esi_nparsers--;
+  }
+  else {
+    parser = esi_parser_new();
+    if( parser == NULL ) {
+      return NULL;
+    }
+    esi_parser_init( parser );
+    esi_parser_start_tag_handler( parser, esi_parser_start_tag_cb );
+    esi_parser_end_tag_handler( parser, esi_parser_end_tag_cb );
+    esi_parser_output_handler( parser, esi_parser_output_cb );
+  }
+
+  parser->user_data = (void*)ctx;
+
+  return parser;
+}
+
+void
+ngx_http_esi_parser_release(ESIParser *parser)
+{
+  if( ngx_http_esi_nparsers == NGX_HTTP_ESI_PARSERS_KEPT ) {
+    esi_parser_free( parser );
+    return;
+  }
+
+  esi_parser_reset( parser, NGX_HTTP_ESI_PARSER_KEEP );
+
+  parser->user_data = (void*)ngx_http_esi_parsers;
+  ngx_http_esi_parsers = parser;
+  ngx_http_esi_nparsers++;
+}
+
+/* the request went away before the end of the document */
+static void
+ngx_http_esi_parser_cleanup(void *data)
+{
+  ngx_http_esi_ctx_t *ctx = data;
+
+  if( ctx->parser ) {
+    ngx_http_esi_parser_release( ctx->parser );
+    ctx->parser = NULL;
+  }
+}
+
+/* page text copied by esi_parser_output_cb and still in memory */
+static ngx_uint_t
+ngx_http_esi_spillable(ngx_buf_t *b)
+{
+  return b && b->tag == (ngx_buf_tag_t) &ngx_http_esi_filter_module
+         && b->temporary && b->last > b->pos;
+}
+
+/*
+ * esi_max_buffered, once the page text held back from the chain on goes over the
+ * cap it is written to a temp file and the buffers become regions of that file.
+ * The buffers keep their place in the chain, the memory of large copies is freed
+ */
+static ngx_int_t
+ngx_http_esi_spill(ngx_http_request_t *r, ngx_http_esi_ctx_t *ctx, ngx_chain_t *from, size_t max)
+{
+  off_t                      offset;
+  size_t                     held, size;
+  u_char                    *start;
+  ngx_buf_t                 *b;
+  ngx_chain_t               *cl, *out, **ll;
+  ngx_temp_file_t           *tf;
+  ngx_http_core_loc_conf_t  *clcf;
+
+  if( ctx->inline_fragment || !r->connection->sendfile
+      || r->filter_need_in_memory || r->main_filter_need_in_memory )
+  {
+    /* esi:inline keeps spans over the memory, or what comes after needs it in memory */
+    return NGX_OK;
+  }
+
+  held = 0;
+  for( cl = from; cl; cl = cl->next ) {
+    if( ngx_http_esi_spillable( cl->buf ) ) {
+      held += cl->buf->last - cl->buf->pos;
+    }
+  }
+
+  if( held <= max ) {
+    return NGX_OK;
+  }
+
+  tf = ctx->spill;
+  if( tf == NULL ) {
+    tf = ngx_pcalloc( r->pool, sizeof(ngx_temp_file_t) );
+    if( tf == NULL ) {
+      return NGX_ERROR;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    tf->file.fd = NGX_INVALID_FILE;
+    tf->file.log = r->connection->log;
+    tf->path = clcf->client_body_temp_path;
+    tf->pool = r->pool;
+    tf->warn = "an esi response is buffered to a temporary file";
+    tf->log_level = NGX_LOG_WARN;
+    tf->clean = 1;
+
+    ctx->spill = tf;
+  }
+
+  /* one write for all of it */
+  out = NULL;
+  ll = &out;
+  for( cl = from; cl; cl = cl->next ) {
+    if( ngx_http_esi_spillable( cl->buf ) ) {
+      *ll = ngx_alloc_chain_link( r->pool );
+      if( *ll == NULL ) {
+        return NGX_ERROR;
+      }
+      (*ll)->buf = cl->buf;
+      ll = &(*ll)->next;
+    }
+  }
+  *ll = NULL;
+
+  offset = tf->offset;
+
+  if( ngx_write_chain_to_temp_file( tf, out ) == NGX_ERROR ) {
+    return NGX_ERROR;
+  }
+
+  while( out ) {
+    b = out->buf;
+    size = b->last - b->pos;
+    start = b->start;
+
+    if( b->recycled ) {
+      /* not an esi_buffers buffer any more */
+      b->recycled = 0;
+      ctx->nbufs--;
+      if( b == ctx->coalesce ) {
+        ctx->coalesce = NULL;
+      }
+    }
+
+    b->tag = NULL;
+    b->pos = b->last = b->start = b->end = NULL;
+    b->temporary = 0;
+    b->in_file = 1;
+    b->file = &tf->file;
+    b->file_pos = offset;
+    b->file_last = offset + size;
+    offset += size;
+
+    ngx_pfree( r->pool, start );
+
+    cl = out;
+    out = out->next;
+    ngx_free_chain( r->pool, cl );
+  }
+
+  ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                 "esi spilled %uz bytes of output", held);
+
+  return NGX_OK;
+}
+
+/*
+ * pass on everything up to the first include still waiting on its fragment,
+ * the request stays buffered until that include is resolved
+ */
+static ngx_int_t
+ngx_http_esi_output(ngx_http_request_t *r, ngx_http_esi_ctx_t *ctx)
+{
+  off_t        size;
+  ngx_int_t    rc;
+  ngx_buf_t   *b;
+  ngx_chain_t *out, *cl, *stop, *sent, **ll;
+  ngx_http_esi_loc_conf_t *slcf;
+
+  if( ctx->error ) {
+    return NGX_ERROR;
+  }
+
+  if( ctx->finished && !ctx->ended ) {
+    /* deferred fragments go after the page, the response ends once all are in */
+    for( cl = ctx->pipe; cl && cl->buf; cl = cl->next ) {
+      ctx->last_buf = ngx_chain_append_buffer( r->pool, ctx->last_buf, cl->buf );
+    }
+    if( ctx->pipe ) {
+      ctx->pipe->buf = NULL;
+      ctx->pipe->next = NULL;
+      ctx->pipe_last = ctx->pipe;
+    }
+
+    if( ctx->piped == 0 ) {
+      b = ngx_calloc_buf(r->pool);
+      if( b == NULL ) {
+        return NGX_ERROR;
+      }
+      b->last_buf = (r == r->main) ? 1 : 0;
+      b->last_in_chain = 1;
+      b->sync = 1;
+      ctx->last_buf = ngx_chain_append_buffer( r->pool, ctx->last_buf, b );
+      ctx->ended = 1;
+    }
+  }
+
+  stop = ctx->pending ? ctx->pending->link : NULL;
+
+  if( stop || ctx->piped ) {
+    r->buffered |= NGX_HTTP_ESI_BUFFERED;
+  }
+  else {
+    r->buffered &= ~NGX_HTTP_ESI_BUFFERED;
+  }
+
+  if( ctx->held ) {
+    /* input is still to be parsed */
+    r->buffered |= NGX_HTTP_ESI_BUFFERED;
+  }
+
+  slcf = ngx_http_get_module_loc_conf(r, ngx_http_esi_filter_module);
+
+  if( slcf->max_buffered && ctx->chain->buf ) {
+
+    if( r->connection->buffered & NGX_HTTP_WRITE_BUFFERED ) {
+      /* the client is slow, what is queued after this filter goes first */
+      rc = ngx_http_next_body_filter(r, NULL);
+
+      if( rc == NGX_ERROR || (r->connection->buffered & NGX_HTTP_WRITE_BUFFERED) ) {
+        if( rc != NGX_ERROR && ngx_http_esi_spill( r, ctx, ctx->chain, slcf->max_buffered ) != NGX_OK ) {
+          return NGX_ERROR;
+        }
+        r->buffered |= NGX_HTTP_ESI_BUFFERED;
+        return rc;
+      }
+    }
+
+    if( stop && ngx_http_esi_spill( r, ctx, stop, slcf->max_buffered ) != NGX_OK ) {
+      return NGX_ERROR;
+    }
+  }
+
+  out = NULL;
+  sent = NULL;
+
+  if( ctx->chain->buf && ctx->chain != stop ) {
+    size = 0;
+    for( cl = ctx->chain; ; cl = cl->next ) {
+      if( cl->buf && !ngx_buf_special( cl->buf ) ) {
+        size += ngx_buf_size( cl->buf );
+      }
+      if( cl->next == NULL || cl->next == stop ) {
+        break; /* the last ready link */
+      }
+    }
+
+    /* esi_min_file_chunk, a small tail waits for more unless this is a flush point */
+    if( stop || ctx->finished || ctx->flush || size >= (off_t) slcf->min_file_chunk ) {
+      out = ctx->chain;
+      cl->next = NULL;
+
+      if( stop ) {
+        ctx->chain = stop;
+      }
+      else {
+        ctx->last_buf = ctx->chain = ngx_alloc_chain_link(r->pool);
+        if( ctx->chain == NULL ) {
+          return NGX_ERROR;
+        }
+        ctx->chain->buf = NULL;
+        ctx->chain->next = NULL;
+      }
+      ctx->flush = 0;
+
+      /* esi_buffers buffers on their way out, nothing more is appended to them */
+      ll = &sent;
+      for( cl = out; cl; cl = cl->next ) {
+        b = cl->buf;
+        if( b && b->recycled && b->tag == (ngx_buf_tag_t) &ngx_http_esi_filter_module ) {
+          if( b == ctx->coalesce ) {
+            ctx->coalesce = NULL;
+          }
+          *ll = ngx_alloc_chain_link(r->pool);
+          if( *ll == NULL ) {
+            return NGX_ERROR;
+          }
+          (*ll)->buf = b;
+          ll = &(*ll)->next;
+        }
+      }
+      *ll = NULL;
+    }
+  }
+
+  rc = ngx_http_next_body_filter(r, out);
+
+  ngx_chain_update_chains(r->pool, &ctx->free, &ctx->busy, &sent,
+                          (ngx_buf_tag_t) &ngx_http_esi_filter_module);
+
+  return rc;
+}
+
+/*
+ * read size bytes of a file buffer from offset, a file truncated meanwhile fails
+ * the response as it would fail sendfile
+ */
+static ngx_int_t
+ngx_http_esi_read_file(ngx_http_request_t *r, ngx_buf_t *in, u_char *to, size_t size, off_t offset)
+{
+  ssize_t  n;
+
+  n = ngx_read_file( in->file, to, size, offset );
+  if( n == NGX_ERROR ) {
+    return NGX_ERROR;
+  }
+
+  if( (size_t) n != size ) {
+    ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                  "esi read only %z of %uz from \"%V\", file was truncated",
+                  n, size, &in->file->name);
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+/*
+ * a buffer only in a file, e.g. a static template with sendfile on. The file is
+ * read a chunk at a time for the parser and what it leaves as is goes out as
+ * regions of the file, only the esi markup and what replaces it are in memory
+ */
+static ngx_int_t
+ngx_http_esi_execute_file(ngx_http_esi_ctx_t *ctx, ngx_buf_t *in, size_t size)
+{
+  size_t  n, done;
+
+  if( ctx->read == NULL ) {
+    ctx->read = ngx_palloc( ctx->request->pool, NGX_HTTP_ESI_READ_SIZE );
+    if( ctx->read == NULL ) {
+      return NGX_ERROR;
+    }
+  }
+
+  for( done = 0; done < size; done += n ) {
+    n = ngx_min( size - done, NGX_HTTP_ESI_READ_SIZE );
+
+    if( ngx_http_esi_read_file( ctx->request, in, ctx->read, n, in->file_pos + done ) != NGX_OK ) {
+      return NGX_ERROR;
+    }
+
+    ctx->input = in;
+    ctx->input_start = ctx->read;
+    ctx->input_pos = in->file_pos + done;
+    ctx->input_len = n;
+
+    esi_parser_execute( ctx->parser, (const char*)ctx->read, n );
+
+    /* the parser and the tags copy what they keep, the chunk is read over */
+    ctx->input = NULL;
+  }
+
+  return NGX_OK;
+}
+
+#if (NGX_THREADS)
+
+/* what was read in for the scan, a large allocation of the pool given back at once */
+static void
+ngx_http_esi_scan_free(ngx_http_request_t *r, ngx_http_esi_scan_t *scan)
+{
+  if( scan->file ) {
+    ngx_pfree( r->pool, scan->data );
+    scan->file = NULL;
+  }
+  scan->data = NULL;
+}
+
+/* the bytes of a part of a buffer only in a file, short when the file was truncated */
+static void
+ngx_http_esi_scan_read(ngx_http_esi_scan_part_t *part)
+{
+  ssize_t               n;
+  ngx_http_esi_scan_t  *scan = part->scan;
+
+  while( part->read < part->to - part->from ) {
+    n = pread( scan->file->fd, scan->data + part->from + part->read,
+               part->to - part->from - part->read, scan->file_pos + part->from + part->read );
+    if( n == -1 ) {
+      if( ngx_errno == NGX_EINTR ) {
+        continue;
+      }
+      part->err = ngx_errno;
+      return;
+    }
+    if( n == 0 ) {
+      return;
+    }
+    part->read += n;
+  }
+}
+
+/*
+ * runs in the thread pool, reads the part in when the buffer is only in a file and
+ * looks for candidates in it. The next part may not be read yet, so a candidate
+ * running past the end of the part is only looked at as far as the part goes
+ */
+static void
+ngx_http_esi_scan_thread(void *data, ngx_log_t *log)
+{
+  ngx_http_esi_scan_part_t *part = data;
+  ngx_http_esi_scan_t      *scan = part->scan;
+
+  if( scan->file ) {
+    ngx_http_esi_scan_read( part );
+    if( part->read < part->to - part->from ) {
+      return;
+    }
+  }
+
+  part->n = esi_parser_scan_hints( (const char*)scan->data, scan->file ? part->to : scan->size,
+                                   part->from, part->to, part->hints, part->max );
+}
+
+/* back on the event loop, once the last part is in the hints are put together in order */
+static void
+ngx_http_esi_scan_event_handler(ngx_event_t *ev)
+{
+  size_t                    *hints;
+  ngx_uint_t                 i, n;
+  ngx_connection_t          *c;
+  ngx_http_request_t        *r;
+  ngx_http_esi_scan_t       *scan;
+  ngx_http_esi_scan_part_t  *part = ev->data;
+
+  r = part->request;
+  scan = part->scan;
+  c = r->connection;
+
+  r->main->blocked--;
+
+  if( --scan->running ) {
+    return;
+  }
+
+  n = 0;
+  for( i = 0; i < scan->nparts; i++ ) {
+    part = scan->tasks[i]->ctx;
+    if( scan->file && part->read < part->to - part->from ) {
+      ngx_log_error(NGX_LOG_ALERT, c->log, part->err,
+                    "esi read only %uz of %uz from \"%V\" in the thread pool",
+                    part->read, part->to - part->from, &scan->file->name);
+      scan->failed = 1;
+    }
+  }
+
+  for( i = 0; i < scan->nparts; i++ ) {
+    part = scan->tasks[i]->ctx;
+    if( part->n > part->max ) {
+      /* dense markup or a part the pool did not take, the parser finds the tags on its own */
+      n = 0;
+      break;
+    }
+    n += part->n;
+  }
+
+  scan->hints = NULL;
+  if( i == scan->nparts ) {
+    scan->hints = hints = ngx_palloc( r->pool, (n ? n : 1) * sizeof(size_t) );
+    for( i = 0; hints && i < scan->nparts; i++ ) {
+      part = scan->tasks[i]->ctx;
+      hints = (size_t *) ngx_cpymem( hints, part->hints, part->n * sizeof(size_t) );
+    }
+  }
+  scan->nhints = n;
+  scan->done = 1;
+
+  ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                 "esi scanned %uz bytes in %ui parts, %ui tag candidates",
+                 scan->size, scan->nparts, n);
+
+  ngx_http_post_request( r, NULL );
+  ngx_http_run_posted_requests( c );
+}
+
+/*
+ * a buffer of at least esi_thread_pool's size is cut in parts the thread pool
+ * scans at the same time. It and the input after it are held back until all
+ * parts are in, NGX_DECLINED leaves the buffer to the parser alone
+ */
+static ngx_int_t
+ngx_http_esi_scan_start(ngx_http_request_t *r, ngx_http_esi_ctx_t *ctx, ngx_chain_t *in)
+{
+  size_t                     size, step;
+  ngx_uint_t                 i, n;
+  ngx_buf_t                 *buf = in->buf;
+  ngx_thread_task_t         *task;
+  ngx_http_esi_scan_t       *scan;
+  ngx_http_esi_loc_conf_t   *slcf;
+  ngx_http_esi_scan_part_t  *part;
+
+  slcf = ngx_http_get_module_loc_conf(r, ngx_http_esi_filter_module);
+
+  scan = ctx->scan;
+
+  if( scan && scan->done && scan->buf == buf ) {
+    return scan->failed ? NGX_ERROR : NGX_OK;
+  }
+
+  size = (size_t) ngx_buf_size( buf );
+
+  if( slcf->thread_pool == NULL || size < slcf->thread_min || size == 0 ) {
+    return NGX_DECLINED;
+  }
+
+  if( scan == NULL ) {
+    scan = ctx->scan = ngx_pcalloc( r->pool, sizeof(ngx_http_esi_scan_t) );
+    if( scan == NULL ) {
+      return NGX_ERROR;
+    }
+  }
+
+  if( ngx_chain_add_copy( r->pool, &ctx->held, in ) != NGX_OK ) {
+    return NGX_ERROR;
+  }
+
+  if( ngx_buf_in_memory( buf ) ) {
+    scan->data = buf->pos;
+    scan->file = NULL;
+  }
+  else {
+    /* the tasks read it in, a truncated file is a short read, not a fault */
+    scan->data = ngx_palloc( r->pool, size );
+    if( scan->data == NULL ) {
+      return NGX_ERROR;
+    }
+    scan->file = buf->file;
+    scan->file_pos = buf->file_pos;
+  }
+
+  scan->failed = 0;
+
+  scan->buf = buf;
+  scan->size = size;
+  scan->offset = 0;
+  scan->done = 0;
+
+  n = size / NGX_HTTP_ESI_SCAN_PART;
+  n = ngx_max( n, 1 );
+  n = ngx_min( n, NGX_HTTP_ESI_SCAN_PARTS );
+  step = size / n;
+
+  scan->nparts = n;
+
+  for( i = 0; i < n; i++ ) {
+    task = ngx_thread_task_alloc( r->pool, sizeof(ngx_http_esi_scan_part_t) );
+    if( task == NULL ) {
+      return NGX_ERROR;
+    }
+
+    part = task->ctx;
+    part->scan = scan;
+    part->request = r;
+    part->from = i * step;
+    part->to = ( i == n - 1 ) ? size : part->from + step;
+    part->max = ( part->to - part->from ) / 32 + 64;
+    part->n = part->max + 1; /* out of room until it is scanned */
+    part->hints = ngx_palloc( r->pool, part->max * sizeof(size_t) );
+    if( part->hints == NULL ) {
+      return NGX_ERROR;
+    }
+
+    task->handler = ngx_http_esi_scan_thread;
+    task->event.data = part;
+    task->event.handler = ngx_http_esi_scan_event_handler;
+
+    scan->tasks[i] = task;
+  }
+
+  for( i = 0; i < n; i++ ) {
+    if( ngx_thread_task_post( slcf->thread_pool, scan->tasks[i] ) != NGX_OK ) {
+      break;
+    }
+    scan->running++;
+    /* the request is not freed while a task still reads from it */
+    r->main->blocked++;
+  }
+
+  if( scan->running == 0 ) {
+    /* the queue of the pool is full */
+    ngx_http_esi_scan_free( r, scan );
+    ctx->held = NULL;
+    return NGX_DECLINED;
+  }
+
+  /* parts the pool did not take are read here, the parser finds their tags on its own */
+  for( ; scan->file && i < n; i++ ) {
+    ngx_http_esi_scan_read( scan->tasks[i]->ctx );
+  }
+
+  return NGX_AGAIN;
+}
+
+/* the next size bytes of a scanned buffer, the parser only looks at the text around the tag candidates */
+static void
+ngx_http_esi_execute_scanned(ngx_http_esi_ctx_t *ctx, ngx_buf_t *in, size_t size)
+{
+  u_char              *data;
+  ngx_http_esi_scan_t *scan = ctx->scan;
+
+  data = scan->data + scan->offset;
+
+  if( scan->hints ) {
+    esi_parser_hints( ctx->parser, (const char*)scan->data, scan->size, scan->hints, scan->nhints );
+  }
+
+  if( scan->file ) {
+    ctx->input = in;
+    ctx->input_start = data;
+    ctx->input_pos = in->file_pos;
+    ctx->input_len = size;
+  }
+
+  esi_parser_execute( ctx->parser, (const char*)data, size );
+
+  esi_parser_hints( ctx->parser, NULL, 0, NULL, 0 );
+  ctx->input = NULL;
+
+  scan->offset += size;
+  if( scan->offset < scan->size ) {
+    /* the parse budget ran out */
+    return;
+  }
+
+  ngx_http_esi_scan_free( ctx->request, scan );
+
+  scan->buf = NULL;
+  scan->done = 0;
+}
+
+#endif
+
+static void
+ngx_http_esi_resume_handler(ngx_event_t *ev)
+{
+  ngx_http_esi_ctx_t  *ctx = ev->data;
+  ngx_connection_t    *c = ctx->request->connection;
+
+  ngx_http_post_request( ctx->request, NULL );
+  ngx_http_run_posted_requests( c );
+}
+
+static void
+ngx_http_esi_resume_cleanup(void *data)
+{
+  ngx_http_esi_ctx_t *ctx = data;
+
+  if( ctx->resume.posted ) {
+    ngx_delete_posted_event( &ctx->resume );
+  }
+}
+
+/*
+ * esi_parse_budget ran out, what is left of the input is parsed after the next
+ * round of events so other requests of the worker are not kept waiting
+ */
+static ngx_int_t
+ngx_http_esi_yield(ngx_http_request_t *r, ngx_http_esi_ctx_t *ctx, ngx_chain_t *in)
+{
+  ngx_pool_cleanup_t  *cln;
+
+  if( ngx_chain_add_copy( r->pool, &ctx->held, in ) != NGX_OK ) {
+    return NGX_ERROR;
+  }
+
+  if( !ctx->resume_set ) {
+    cln = ngx_pool_cleanup_add( r->pool, 0 );
+    if( cln == NULL ) {
+      return NGX_ERROR;
+    }
+    cln->handler = ngx_http_esi_resume_cleanup;
+    cln->data = ctx;
+    ctx->resume_set = 1;
+  }
+
+  if( !ctx->resume.posted ) {
+    ctx->resume.handler = ngx_http_esi_resume_handler;
+    ctx->resume.data = ctx;
+    ctx->resume.log = r->connection->log;
+#if (nginx_version >= 1017005)
+    ngx_post_event( &ctx->resume, &ngx_posted_next_events );
+#else
+    /* no next round before 1.17.5, at the tail of this one the events already posted go first */
+    ngx_post_event( &ctx->resume, &ngx_posted_events );
+#endif
+  }
+
+  return NGX_OK;
+}
+
 static ngx_int_t
 ngx_http_esi_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
   off_t size;
-  int count = 0;
+  size_t left;
+  ngx_buf_t *buf;
   ngx_chain_t *chain_link;
-  short has_last_buffer = 0;
+  ngx_pool_cleanup_t *cln;
   ngx_http_esi_ctx_t   *ctx;
+  ngx_http_esi_loc_conf_t *slcf;
+#if (NGX_THREADS)
+  ngx_int_t rc;
+#endif
 
   ctx = ngx_http_get_module_ctx(r, ngx_http_esi_filter_module);
 
-  if( ctx == NULL || in == NULL || r->header_only ) { 
+  if( ctx == NULL || r->header_only ) { 
     return ngx_http_next_body_filter(r, in);
   }
 
   ctx->request = r;
-  ctx->root_tag = NULL;
-  ctx->open_tag = NULL;
+
+  if( ctx->held ) {
+    /* more input queues up behind what is not parsed yet */
+    if( in && ngx_chain_add_copy( r->pool, &ctx->held, in ) != NGX_OK ) {
+      return NGX_ERROR;
+    }
+#if (NGX_THREADS)
+    if( ctx->scan && ctx->scan->running ) {
+      return ngx_http_esi_output(r, ctx);
+    }
+#endif
+    in = ctx->held;
+    ctx->held = NULL;
+  }
+
+  if( in == NULL ) {
+    /* woken up by a finished fragment */
+    return ngx_http_esi_output(r, ctx);
+  }
 
   if( !ctx->parser ) {
-    ctx->parser = esi_parser_new();
-    esi_parser_init( ctx->parser );
-    ctx->parser->user_data = (void*)ctx;
-    esi_parser_start_tag_handler( ctx->parser, esi_parser_start_tag_cb );
-    esi_parser_end_tag_handler( ctx->parser, esi_parser_end_tag_cb );
-    esi_parser_output_handler( ctx->parser, esi_parser_output_cb );
+    if( !ctx->parser_set ) {
+      cln = ngx_pool_cleanup_add( r->pool, 0 );
+      if( cln == NULL ) {
+        return NGX_ERROR;
+      }
+      cln->handler = ngx_http_esi_parser_cleanup;
+      cln->data = ctx;
+      ctx->parser_set = 1;
+    }
+
+    ctx->parser = ngx_http_esi_parser_create( ctx );
+    if( ctx->parser == NULL ) {
+      return NGX_ERROR;
+    }
   }
 
-//  printf( "called esi body filter\n" );
+  slcf = ngx_http_get_module_loc_conf(r, ngx_http_esi_filter_module);
+  left = slcf->parse_budget;
 
   for( chain_link = in; chain_link != NULL; chain_link = chain_link->next ) {
-    size = ngx_buf_size(chain_link->buf);
+    buf = chain_link->buf;
+    size = ngx_buf_size(buf);
 
-    //printf("buf size: %d, link: %d, buf: '", (int)size, count ); debug_string( (const char*)chain_link->buf->start, (int)size ); printf("'\n");
-    esi_parser_execute( ctx->parser, (const char*)chain_link->buf->pos, (size_t)size );
+    if( buf->flush ) {
+      ctx->flush = 1;
+    }
 
-    if( chain_link->buf->last_buf ) {
-      esi_parser_finish( ctx->parser );
-      has_last_buffer  = 1;
-      break;
+    if( slcf->parse_budget && (size_t) size > left ) {
+      size = left;
+    }
+
+#if (NGX_THREADS)
+    rc = ngx_http_esi_scan_start( r, ctx, chain_link );
+    if( rc == NGX_ERROR ) {
+      return NGX_ERROR;
+    }
+    if( rc == NGX_AGAIN ) {
+      return ngx_http_esi_output(r, ctx);
+    }
+    if( rc == NGX_OK ) {
+      ngx_http_esi_execute_scanned( ctx, buf, (size_t)size );
+    }
+    else
+#endif
+    if( !ngx_buf_in_memory(buf) && buf->in_file ) {
+      if( ngx_http_esi_execute_file( ctx, buf, (size_t)size ) != NGX_OK ) {
+        return NGX_ERROR;
+      }
     }
     else {
-      // hrm... ?
+      esi_parser_execute( ctx->parser, (const char*)buf->pos, (size_t)size );
+    }
+
+    /* the parser copies what it keeps, so the input can be reused right away */
+    if( ngx_buf_in_memory(buf) ) {
+      buf->pos += size;
+    }
+    if( buf->in_file ) {
+      buf->file_pos += size;
+    }
+
+    if( slcf->parse_budget ) {
+      left -= (size_t) size;
+
+      if( ngx_buf_size(buf) > 0 ) {
+        if( ngx_http_esi_yield( r, ctx, chain_link ) != NGX_OK ) {
+          return NGX_ERROR;
+        }
+        break;
+      }
+    }
+
+    if( buf->last_buf || buf->last_in_chain ) {
+      esi_parser_finish( ctx->parser );
+      ngx_http_esi_parser_release( ctx->parser );
+      ctx->parser = NULL;
+      esi_tag_close_all( ctx );
+
+      ctx->finished = 1;
+      break;
     }
-    ++count;
   }
 
-  ctx->last_buf->buf->last_buf = 1;
+  return ngx_http_esi_output(r, ctx);
+}
+
+ngx_uint_t  ngx_http_esi_fetches;
+
+static ngx_uint_t  ngx_http_esi_degraded_mode;
+
+/*
+ * check the load signals of the worker. Degraded mode is entered once any
+ * signal reaches its high mark and left once all are back at their low mark,
+ * the gap keeps the worker from flapping around a single threshold
+ */
+ngx_uint_t
+ngx_http_esi_degraded(ngx_http_request_t *r)
+{
+  ngx_uint_t                 conns, over, under;
+  ngx_http_esi_main_conf_t  *emcf;
+
+  emcf = ngx_http_get_module_main_conf(r, ngx_http_esi_filter_module);
 
-#if 0
-  printf( "debugging buffer\n" );
-  count = 0;
-  for( chain_link = ctx->chain; chain_link != NULL; chain_link = chain_link->next ) {
-    size = ngx_buf_size(chain_link->buf);
-    printf("buf size: %d, link: %d, buf: '", (int)size, count ); debug_string( (const char*)chain_link->buf->pos, (int)size ); printf("'\n");
-    ++count;
+  if( !emcf->degrade_connections.high && !emcf->degrade_fetches.high ) {
+    return 0;
   }
-#endif
-  
-  if( has_last_buffer ) {
-    esi_parser_free( ctx->parser );
-    ctx->parser = NULL;
+
+  conns = ngx_cycle->connection_n - ngx_cycle->free_connection_n;
+
+  over = ( emcf->degrade_connections.high && conns >= emcf->degrade_connections.high )
+      || ( emcf->degrade_fetches.high && ngx_http_esi_fetches >= emcf->degrade_fetches.high );
+
+  under = ( !emcf->degrade_connections.high || conns <= emcf->degrade_connections.low )
+       && ( !emcf->degrade_fetches.high || ngx_http_esi_fetches <= emcf->degrade_fetches.low );
+
+  if( !ngx_http_esi_degraded_mode && over ) {
+    ngx_http_esi_degraded_mode = 1;
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "esi entering degraded mode, %ui connections, %ui fetches",
+                  conns, ngx_http_esi_fetches);
+
+    if( emcf->shm_zone ) {
+      ngx_esi_shm_degrade( emcf->shm_zone, 1 );
+    }
   }
+  else if( ngx_http_esi_degraded_mode && under ) {
+    ngx_http_esi_degraded_mode = 0;
 
-  //return ngx_http_next_body_filter(r, in);
-  ngx_free_chain(r->pool, in);
-  return ngx_http_next_body_filter(r, ctx->chain);
+    ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                  "esi leaving degraded mode, %ui connections, %ui fetches",
+                  conns, ngx_http_esi_fetches);
+
+    if( emcf->shm_zone ) {
+      ngx_esi_shm_degrade( emcf->shm_zone, 0 );
+    }
+  }
+
+  return ngx_http_esi_degraded_mode;
 }
 
 static void *
@@ -494,5 +1936,5 @@ ngx_http_esi_filter_init(ngx_conf_t *cf)
   ngx_http_next_body_filter = ngx_http_top_body_filter;
   ngx_http_top_body_filter = ngx_http_esi_body_filter;
 
-  return NGX_OK;
+  return ngx_esi_vars_init(cf);
 }
@@ -14,17 +14,334 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* r->buffered bit, set while output is held back waiting on a fragment.
+ * r->buffered has four bits, all claimed by stock filters (ssi 0x01, sub 0x02,
+ * copy 0x04, image 0x08). The image filter's is taken, it never sees a page esi parses
+ * while ssi and sub can run on the same response */
+#define NGX_HTTP_ESI_BUFFERED 0x08
+
+/* esi_bigpipe, which includes are streamed after the page instead of in place */
+#define NGX_HTTP_ESI_BIGPIPE_OFF  0
+#define NGX_HTTP_ESI_BIGPIPE_ON   1  /* includes with bigpipe="on" */
+#define NGX_HTTP_ESI_BIGPIPE_ALL  2  /* all but bigpipe="off" */
+
+/* degraded mode is entered at high and left again once back at or below low */
+typedef struct {
+    ngx_uint_t                high;           /* 0 disables the signal */
+    ngx_uint_t                low;
+} ngx_http_esi_threshold_t;
+
+typedef struct {
+    ngx_hash_t                hash;
+    ngx_hash_keys_arrays_t    commands;
+    ngx_shm_zone_t           *shm_zone;       /* esi_zone, shared across workers */
+    ngx_shm_zone_t           *cache_zone;     /* esi_cache_zone, fragment cache */
+
+    ngx_http_esi_threshold_t  degrade_connections; /* active connections of the worker */
+    ngx_http_esi_threshold_t  degrade_fetches;     /* fragment fetches in flight in the worker */
+} ngx_http_esi_main_conf_t;
+
+typedef struct {
+  ngx_flag_t     enable;          /* enable esi filter */
+  ngx_flag_t     silent_errors;   /* ignore include errors, don't raise exceptions */
+  ngx_array_t   *types;           /* array of ngx_str_t */
+
+  size_t         min_file_chunk;  /* smallest output passed on before a flush point */
+  size_t         max_depth;       /* how many times to follow an esi:include redirect... */
+  ngx_uint_t     max_includes;    /* includes a page may start, nested ones included, 0 is unlimited */
+  size_t         max_bytes;       /* fragment bytes a page may take in, 0 is unlimited */
+
+  ngx_uint_t     origin_limit;          /* concurrent fetches per origin, 0 is unlimited */
+  ngx_uint_t     origin_queue;          /* includes allowed to wait for a slot per origin */
+  ngx_msec_t     origin_queue_timeout;  /* how long an include waits before falling back */
+
+  ngx_flag_t     adaptive_timeout;      /* derive include timeouts from observed latency */
+  ngx_msec_t     timeout_min;           /* bounds of the derived timeout */
+  ngx_msec_t     timeout_max;
+  ngx_uint_t     timeout_factor;        /* percent of the p99 latency, 150 => p99 * 1.5 */
+
+  time_t         cache_valid;           /* fresh lifetime of a cached fragment without max-age */
+  time_t         cache_stale;           /* and how long it may be served stale after that */
+
+  ngx_uint_t     bigpipe;               /* NGX_HTTP_ESI_BIGPIPE_* */
+
+  ngx_str_t      client_fallback;       /* uri prefix of esi_fragment the client loads a late fragment from */
+
+  ngx_str_t      batch_pass;            /* location that serves several fragments in one response */
+
+  struct ngx_esi_fetch_pass_s *fragment_pass; /* upstream fragments are fetched from without subrequests */
+
+  ngx_str_t      local_prefix;          /* esi_fragment_root, includes under this uri prefix */
+  ngx_str_t      local_root;            /* are read from files under this directory */
+
+  ngx_bufs_t     bufs;                  /* esi_buffers, page text is gathered in these */
+
+  size_t         parse_budget;          /* template bytes parsed before other requests get a turn, 0 is unlimited */
+  size_t         max_buffered;          /* page text held in memory before it goes to a temp file, 0 is unlimited */
+
+#if (NGX_THREADS)
+  ngx_thread_pool_t *thread_pool;       /* esi_thread_pool, large buffers are scanned for tags there */
+  size_t         thread_min;            /* smallest buffer sent to it */
+#endif
+} ngx_http_esi_loc_conf_t;
+
+/* a template only in a file is read and parsed in chunks of this size */
+#define NGX_HTTP_ESI_READ_SIZE   65536
+
+#if (NGX_THREADS)
+/*
+ * esi_thread_pool, a large buffer is cut in parts the thread pool scans for
+ * tag candidates at the same time. The parser still runs on the event loop,
+ * over the whole buffer at once, and only looks at the text around them
+ */
+#define NGX_HTTP_ESI_SCAN_PART   262144  /* smallest part of a buffer a task scans */
+#define NGX_HTTP_ESI_SCAN_PARTS  8       /* most parts a buffer is cut in */
+
+typedef struct {
+  ngx_buf_t    *buf;        /* first buffer of the held input */
+  u_char       *data;       /* its bytes, read in by the tasks when it is only in a file */
+  size_t        size;
+  size_t        offset;     /* bytes of it parsed so far */
+  ngx_file_t   *file;       /* the file it is read from, NULL for a buffer in memory */
+  off_t         file_pos;
+  size_t       *hints;      /* candidates of all parts in document order, NULL if a part ran out of room */
+  ngx_uint_t    nhints;
+  ngx_thread_task_t *tasks[NGX_HTTP_ESI_SCAN_PARTS]; /* a ngx_http_esi_scan_part_t each */
+  ngx_uint_t    nparts;
+  ngx_uint_t    running;    /* parts still being scanned */
+  unsigned      done:1;     /* hints are ready */
+  unsigned      failed:1;   /* a part could not be read, the response fails */
+} ngx_http_esi_scan_t;
+
+/* a part of the buffer, scanned by one task */
+typedef struct {
+  ngx_http_esi_scan_t *scan;
+  ngx_http_request_t  *request;
+  size_t               from;
+  size_t               to;
+  size_t              *hints;
+  size_t               max;
+  size_t               n;   /* found, more than max when it ran out of room */
+  size_t               read; /* bytes of the part read in */
+  ngx_err_t            err;
+} ngx_http_esi_scan_part_t;
+#endif
+
 typedef struct {
   ESIParser *parser;
-  struct _ESITag *root_tag; /* If any tags are being actively processed there is always a root node */
+  struct _ESITag *tags;     /* stack of the open tags, allocated from the request pool on the first one */
+  ngx_uint_t ntags;
+  ngx_uint_t tags_base;     /* first tag of the running parser, a fragment's are stacked on the page's */
   struct _ESITag *open_tag; /* The deepest nested tag open */
   ngx_http_request_t *request;
   ngx_chain_t *chain; /* store buffered content */
   ngx_chain_t *last_buf;
 
-  unsigned exception_raised:1; /* this is toggled to 1 if an exception is raised while processing an attempt tag */
-  unsigned ignore_tag:1; /* this is toggled to 1 when for some reason typically no exception was raised so the tags should not be processed */
+  ngx_buf_t *coalesce;  /* esi_buffers buffer at the tail of the output small pieces are appended to */
+  ngx_chain_t *free;    /* esi_buffers buffers sent and free again */
+  ngx_chain_t *busy;    /* and those still on their way out */
+  ngx_uint_t nbufs;     /* allocated */
+
+  ngx_buf_t *input;     /* file buffer the parser is run over, see ngx_http_esi_execute_file */
+  u_char *input_start;  /* bytes of it read in */
+  off_t input_pos;      /* the file offset they were read from */
+  size_t input_len;
+  u_char *read;         /* where a chunk of the file is read, NGX_HTTP_ESI_READ_SIZE */
+
+  ngx_chain_t *held;    /* input not parsed yet, being scanned or left when the parse budget ran out */
+  ngx_event_t resume;   /* picks up the held input once the budget ran out */
+
+  ngx_temp_file_t *spill; /* esi_max_buffered, held output went here once over the cap */
+
+#if (NGX_THREADS)
+  ngx_http_esi_scan_t *scan; /* buffer scanned by the thread pool, see esi_thread_pool */
+#endif
+
+  struct ngx_http_esi_include_s *includes; /* includes and esi:try slots outside of any esi:try in document order */
+  struct ngx_http_esi_include_s *last_include;
+  struct ngx_http_esi_include_s *pending; /* first include still waiting on its fragment, output stops here */
+
+  struct ngx_http_esi_try_s *try; /* innermost esi:try the parser is in */
+  ngx_uint_t branch;              /* and which part of it */
+
+  ngx_chain_t *pipe;       /* deferred fragments that arrived before the end of the page */
+  ngx_chain_t *pipe_last;
+  ngx_uint_t   piped;      /* deferred fragments still to come */
+  ngx_uint_t   pipe_seq;   /* numbers the placeholder elements */
+
+  struct ngx_http_esi_choose_s *choose; /* innermost esi:choose the parser is in */
+  ngx_uint_t skip;        /* discarding content (esi:remove, a branch not taken), counts the esi tags opened in it */
+
+  struct ngx_http_esi_inline_s *inline_fragment; /* esi:inline the parser is in */
+
+  struct ngx_esi_vars_s *vars; /* request values behind esi variables */
+  ngx_buf_t *vars_text;        /* esi:vars content collected until the next tag */
+
+  struct ngx_http_esi_include_s *fragment; /* include whose fragment is being parsed */
+  ngx_uint_t included;      /* includes started by the page, budget of esi_max_includes */
+  size_t fragment_bytes;    /* fragment bytes taken in, budget of esi_max_bytes */
+
+  ngx_rbtree_t *fetches;    /* first include of each fragment fetched by the page */
+  ngx_uint_t deduped;       /* includes that shared the fetch of an earlier one, $esi_deduped */
+
+  struct ngx_http_esi_include_s *batch; /* includes waiting for the next esi_batch_pass request */
+  struct ngx_http_esi_include_s *batch_last;
+  struct ngx_http_esi_batch_s *batches; /* requests sent */
+  ngx_event_t batch_event;  /* sends the batch once the event that found the includes is over */
+
+  unsigned cleanup_set:1; /* include cleanup registered on the request pool */
+  unsigned resume_set:1;  /* and the one of the resume event */
+  unsigned parser_set:1;  /* and the one releasing the parser of a request that ends early */
+  unsigned flush:1;       /* the input asked for a flush, the output is passed on however small */
+  unsigned deep:1;        /* a tag nested past NGX_ESI_TAG_DEPTH is discarded */
+  unsigned finished:1;    /* the parser saw the end of the document */
+  unsigned ended:1;       /* the last buffer was queued */
+  unsigned error:1;       /* a deferred fragment could not be queued, the response is cut short */
 
 } ngx_http_esi_ctx_t;
 
+/* parts of an esi:try, ctx->last_buf appends to the output of the part the parser is in */
+#define NGX_HTTP_ESI_ATTEMPT   0
+#define NGX_HTTP_ESI_EXCEPT    1
+#define NGX_HTTP_ESI_TRY_BODY  2 /* outside of attempt and except, dropped */
+
+/*
+ * An esi:try owns a placeholder slot in the enclosing output just like an include.
+ * The output of each part is collected while the parser moves on, and the slot is
+ * filled with the attempt once its includes are all in, or with the except as soon
+ * as one of them failed. Includes in the except are not fetched until then
+ */
+typedef struct ngx_http_esi_try_s {
+  struct ngx_http_esi_include_s *slot;
+  ngx_chain_t                   *out[3];      /* output of each part */
+  ngx_chain_t                   *last[3];
+  struct ngx_http_esi_include_s *includes[3]; /* includes and nested slots of each part */
+  struct ngx_http_esi_include_s *last_include[3];
+  ngx_uint_t                     waiting[3];  /* started includes of each part not resolved yet */
+  ngx_chain_t                   *pooled[3];   /* esi_buffers buffers of each part */
+  ngx_chain_t                   *pooled_last[3];
+
+  unsigned                       active:1;    /* the slot will be used, includes may be fetched */
+  unsigned                       failed:1;    /* an include of the attempt failed */
+  unsigned                       closed:1;    /* the parser is past </esi:try> */
+  unsigned                       attempted:1; /* the parser is past </esi:attempt> */
+  unsigned                       fragment:1;  /* stands for a fragment holding esi markup, it has no except */
+} ngx_http_esi_try_t;
+
+/* esi:inline body on its way into the fragment cache */
+typedef struct ngx_http_esi_inline_s {
+  ngx_str_t                      name;
+  ngx_chain_t                   *body;   /* copy of the page output for the zone */
+  ngx_chain_t                  **last;
+  ngx_buf_t                     *tail;   /* the copy goes on in it while it has room */
+  time_t                         fresh;
+  time_t                         stale;
+  unsigned                       invalid:1; /* holds esi markup, not cached */
+} ngx_http_esi_inline_t;
+
+/* fragments of an origin fetched in one esi_batch_pass request */
+typedef struct ngx_http_esi_batch_s {
+  ngx_http_esi_ctx_t            *ctx;
+  struct ngx_http_esi_include_s *includes; /* in the order they were asked for */
+  struct ngx_esi_origin_s       *origin;
+  struct ngx_http_esi_batch_s   *next;
+  unsigned                       active:1;   /* holding an origin slot */
+  unsigned                       fetching:1; /* counted in ngx_http_esi_fetches */
+} ngx_http_esi_batch_t;
+
+/* a subrequest given up on after a timeout, it holds its origin slot until it is done */
+typedef struct ngx_http_esi_abandoned_s {
+  ngx_http_request_t            *sr;
+  struct ngx_esi_origin_s       *origin;   /* NULL once the slot is given back */
+  struct ngx_http_esi_abandoned_s *next;
+} ngx_http_esi_abandoned_t;
+
+/* an esi:choose takes the first esi:when that holds, or else its esi:otherwise */
+typedef struct ngx_http_esi_choose_s {
+  struct ngx_http_esi_choose_s  *prev;
+  unsigned                       matched:1;  /* a branch was taken, the rest are skipped */
+} ngx_http_esi_choose_t;
+
+/*
+ * An esi:include owns a placeholder link in ctx->chain. Output is passed on up to
+ * the first placeholder that is still waiting, so an include may be fetched late
+ * (e.g. after waiting for an origin slot) without reordering the document
+ */
+typedef struct ngx_http_esi_include_s {
+  ngx_http_esi_ctx_t            *ctx;
+  ngx_chain_t                   *link;     /* placeholder in ctx->chain or in the output of an esi:try part */
+  ngx_http_esi_try_t            *owner;    /* esi:try the include is in */
+  ngx_uint_t                     branch;   /* and which part of it */
+  ngx_http_esi_try_t            *try;      /* set when this is the slot of an esi:try or of a parsed fragment */
+  struct ngx_http_esi_include_s *parent;   /* fragment the include is in */
+  ngx_uint_t                     depth;    /* 1 for an include of the page itself */
+  ngx_str_t                      key;      /* src as written, the fragment cache key */
+  ngx_str_t                      uri;
+  ngx_str_t                      args;
+  ngx_str_t                      alt;      /* tried when uri fails or is rejected */
+  struct ngx_esi_origin_s       *origin;   /* shared counters of the origin serving uri */
+  ngx_http_request_t            *sr;       /* fetch in flight, a subrequest abandoned on timeout is not it */
+  ngx_http_esi_abandoned_t      *abandoned; /* subrequests abandoned on timeout, still holding a slot */
+  struct ngx_esi_fetch_s        *fetch;    /* or the esi_fragment_pass fetch in flight */
+  ngx_event_t                    wait;     /* queue timeout or wake of a queued include, or starts the alt fetch */
+  ngx_queue_t                    waiting;  /* in the worker's origin wait list while queued */
+  ngx_event_t                    expire;   /* include timeout */
+  ngx_msec_t                     deadline; /* stop waiting for an origin slot */
+  ngx_msec_t                     recheck;  /* next look at the origin while queued, doubles each time */
+  ngx_msec_t                     timeout;  /* explicit timeout attribute, 0 when absent */
+  ngx_msec_t                     started;  /* when the fetch was dispatched */
+  time_t                         max_age;  /* max-age='fresh+stale' attribute */
+  time_t                         max_stale;
+  ngx_chain_t                   *stale_copy; /* expired cached copy, served if the fetch fails */
+  ngx_chain_t                   *body;     /* what the placeholder was filled with, shared with later includes of it */
+  struct ngx_http_esi_include_s *same;     /* includes of the same fragment waiting on this fetch */
+  struct ngx_http_esi_include_s *batch_next; /* next include of the same esi_batch_pass request */
+  ngx_uint_t                     fetching; /* subrequests not yet done, abandoned ones included */
+  ngx_uint_t                     pipe_id;  /* number of the placeholder element when deferred */
+  struct ngx_http_esi_include_s *next;
+
+  unsigned                       done:1;     /* placeholder has its content */
+  unsigned                       queued:1;   /* waiting for an origin slot */
+  unsigned                       active:1;   /* holding an origin slot */
+  unsigned                       use_alt:1;  /* uri is now the alt src */
+  unsigned                       optional:1; /* onerror="continue" */
+  unsigned                       timedout:1; /* gave up on the fetch, a late fragment is dropped */
+  unsigned                       counted:1;  /* owner->waiting counts this include */
+  unsigned                       invalid:1;  /* neither src nor alt can be fetched */
+  unsigned                       pipe_on:1;  /* bigpipe="on" */
+  unsigned                       pipe_off:1; /* bigpipe="off" */
+  unsigned                       pipe:1;     /* fetched without holding back the page */
+  unsigned                       deferred:1; /* left a placeholder element, streamed after the page */
+  unsigned                       fallback:1; /* missed its deadline, the client loads it from the cache */
+  unsigned                       has_max_age:1;
+  unsigned                       revalidate:1; /* served from the cache, the fetch only updates it */
+  unsigned                       expanded:1;   /* its fragment was parsed, done once the includes in it are in */
+  unsigned                       markup:1;     /* the fragment holds esi markup, leaf fragments are not parsed */
+  unsigned                       failed:1;     /* neither src nor alt could be had */
+  unsigned                       personal:1;   /* src took request variables, its cache entry is private */
+} ngx_http_esi_include_t;
+
+extern ngx_module_t  ngx_http_esi_filter_module;
+
+#define NGX_HTTP_ESI_PARSERS_KEPT  64     /* idle parsers a worker keeps for the next documents */
+#define NGX_HTTP_ESI_PARSER_KEEP   16384  /* scratch memory an idle parser may hold on to */
+
+/* a parser that feeds its tags and output to ctx, NULL on allocation failure */
+ESIParser *ngx_http_esi_parser_create(ngx_http_esi_ctx_t *ctx);
+
+/* done with the parser, it is reset and kept for reuse or freed */
+void ngx_http_esi_parser_release(ESIParser *parser);
+
+/*
+ * page text for the output, a region of the template file when it is parsed from one,
+ * else a copy in an esi_buffers buffer. The tail buffer of the output when it went there
+ */
+ngx_buf_t *ngx_http_esi_text(ngx_http_esi_ctx_t *ctx, const void *data, size_t length);
+
+/* fragment fetches in flight in this worker */
+extern ngx_uint_t    ngx_http_esi_fetches;
+
+/* is this worker past an esi_degrade_* threshold, stale fragments are then served as is */
+ngx_uint_t ngx_http_esi_degraded(ngx_http_request_t *r);
+
 #endif /* _NGX_HTTP_ESI_FILTER_H_INCLUDED_ */
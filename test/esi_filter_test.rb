@@ -43,6 +43,479 @@ class EsiFilterTest < Test::Unit::TestCase
     end
   end
 
+  def test_nested_try_fails_over_to_except
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_try_nested.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match /except\s*<div>test1<\/div>/, req.body
+      assert_no_match /attempt|outer|failover/, req.body
+    end
+  end
+
+  def test_deeply_nested_and_sibling_tries
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_try_deep.html")
+      assert_equal Net::HTTPOK, req.header.class
+      # only the innermost attempt fails, each esi:try decides on its own
+      assert_match %r{level1\s*level2\s*level3\s*fallback4\s*sibling1\s*<div>test1</div>\s*recovered2\s*</body>}, req.body
+      assert_no_match /level4|fallback[123]|broken1|sibling2/, req.body
+    end
+  end
+
+  def test_failed_attempt_drops_its_file_regions
+    # the attempt text is left in the file, or spilled to one, before the include fails
+    ['', '/pooled', '/spill'].each do|prefix|
+      Net::HTTP.start("localhost", 9997) do |h|
+        req = h.get("#{prefix}/esi_try_file.html")
+        assert_equal Net::HTTPOK, req.header.class
+        assert_match %r{<p>before</p>\s*<p>except body</p>\s*<p>after</p>\s*</body>}, req.body, prefix
+        assert_no_match /attempt text|attempt tail|slow \/attempt/, req.body, prefix
+      end
+    end
+  end
+
+  def test_bigpipe_include_streams_after_page
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_bigpipe.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match %r{<h1>shell</h1>\n  <div id="esi-pipe-1"></div>\n  <div>test2</div>}, req.body
+      assert_match %r{</html>\n<template><div>test1</div>\n</template><script>.*"esi-pipe-1".*</script>\z}m, req.body
+    end
+  end
+
+  def test_vars_substitution
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_vars.html?page=2&frag=test1", { "Cookie" => "theme=dark; name=todd" })
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match %r{<p>hello todd, page 2</p>}, req.body
+      assert_match %r{<div>test1</div>}, req.body
+      assert_match %r{<p>\$\(HTTP_COOKIE\{name\}\)</p>}, req.body, "variables are only substituted in esi:vars"
+      req = h.get("/esi_vars.html?frag=test1")
+      assert_match %r{<p>hello guest, page 1</p>}, req.body
+    end
+  end
+
+  def test_choose_takes_first_matching_branch
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_choose.html", { "Cookie" => "group=beta" })
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match %r{beta\s*<div>test1</div>}, req.body
+      assert_no_match /beta page|everyone|test2/, req.body
+      req = h.get("/esi_choose.html?page=2", { "Cookie" => "group=beta" })
+      assert_match /beta page/, req.body
+      assert_no_match /test1|everyone/, req.body
+      req = h.get("/esi_choose.html")
+      assert_match %r{everyone\s*<div>test2</div>}, req.body
+      assert_no_match /beta/, req.body
+    end
+  end
+
+  def test_remove_and_comment_are_dropped
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_remove.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match %r{<div>test1</div>}, req.body
+      assert_no_match /fallback link|test2|without esi|unused except|<esi:/, req.body
+    end
+  end
+
+  def test_comment_wrapped_esi
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_comment_syntax.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match %r{<!-- an ordinary comment stays -->}, req.body
+      assert_match %r{<div>test1</div>}, req.body
+      assert_match %r{<p>only with esi</p>}, req.body
+      assert_no_match /<!--esi|-->\s*<\/body>|<esi:/, req.body
+    end
+  end
+
+  def test_comment_wrapper_split_at_every_offset
+    page = File.read("#{DOCROOT}/esi_comment_split.html")
+    Net::HTTP.start("localhost", 9997) do |h|
+      whole = h.get("/split/esi_comment_split.html").body
+      # ---> is a - and the end of the wrapper, the plain comment after it stays
+      assert_equal %{<p>x</p> <b>a</b> - tail <div>test1</div>\n end <!-- plain --> done\n}, whole
+      (1...page.size).each do|cut|
+        req = h.get("/split/esi_comment_split.html?cut=#{cut}")
+        assert_equal whole, req.body, "page split at #{cut}"
+      end
+    end
+  end
+
+  def test_recycled_parser_starts_clean
+    clean = %{<p>x</p> <b>a</b> - tail <div>test1</div>\n end <!-- plain --> done\n}
+    # each page ends in the middle of something, its parser goes back to the
+    # worker's free list as it was and the next page on the worker gets it
+    %w(esi_cut_tag esi_cut_prefix esi_cut_wrapper esi_cut_try).each do|cut|
+      Net::HTTP.start("localhost", 9997) do |h|
+        req = h.get("/#{cut}.html")
+        assert_equal Net::HTTPOK, req.header.class
+        assert_match %r{\A<p>cut</p>}, req.body, cut
+        assert_equal clean, h.get("/esi_comment_split.html").body, "after #{cut}"
+        req = h.get("/split/#{cut}.html?cut=14")
+        assert_equal Net::HTTPOK, req.header.class
+        assert_equal clean, h.get("/split/esi_comment_split.html?cut=12").body, "after #{cut} in two reads"
+      end
+    end
+  end
+
+  def test_inline_fragment_primes_cache
+    # the inline text is a region of the template file, or copied into esi_buffers
+    ['', '/pooled'].each do|prefix|
+      Net::HTTP.start("localhost", 9997) do |h|
+        req = h.get("#{prefix}/esi_inline.html")
+        assert_equal Net::HTTPOK, req.header.class
+        # /inline/nav.html does not exist on the origin, the include is served from the inline copy
+        assert_equal 2, req.body.scan(%r{<ul><li>home</li></ul>}).size, req.body
+        req = h.get("/_esi/frag/%2Finline%2Fnav.html")
+        assert_equal "<ul><li>home</li></ul>", req.body
+      end
+    end
+  end
+
+  def test_repeated_include_fills_every_position
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_dedup.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_equal 3, req.body.scan(%r{<li><div>test1</div>\n</li>}).size, req.body
+    end
+  end
+
+  def test_repeated_include_is_fetched_once
+    log = "#{File.dirname(__FILE__)}/../nginx/logs/esi_dedup.log"
+    uri = "/dedup/esi_dedup_alt.html?t=#{Time.now.to_f}"
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get(uri)
+      assert_equal Net::HTTPOK, req.header.class
+      # spelled three ways, one fetch
+      assert_equal 5, req.body.scan(%r{<li><div>counted /dedup.html</div></li>}).size, req.body
+      # the same src with another onerror or alt does not share the failure
+      assert_match %r{<li></li>\s*<li><div>test1</div>\n</li>\s*<li><div>test1</div>\n</li>}, req.body
+    end
+    assert_equal 1, $origin_hits["/dedup.html"]
+    # four repeats of the counted src and one of the include with an alt
+    line = nil
+    20.times do
+      line = File.read(log).split("\n").grep(/\A#{Regexp.escape(uri)} /).first if File.exist?(log)
+      break if line
+      sleep 0.05
+    end
+    assert_equal "#{uri} 5", line
+  end
+
+  def test_batch_pass_fetches_fragments_together
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/batch/esi_batch.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_equal 3, req.body.scan(%r{<div>test1</div>}).size, req.body
+      assert_match %r{<div>test2</div>}, req.body
+      assert_match %r{<div>test3</div>}, req.body
+      assert_no_match /<esi:/, req.body
+    end
+  end
+
+  def test_fragment_pass_fetches_from_origin
+    Net::HTTP.start("localhost", 9997) do |h|
+      2.times do
+        req = h.get("/pass/esi_batch.html")
+        assert_equal Net::HTTPOK, req.header.class
+        assert_equal 3, req.body.scan(%r{<div>test1</div>}).size, req.body
+        assert_match %r{<div>test2</div>}, req.body
+        assert_match %r{<div>test3</div>}, req.body
+        assert_no_match /<esi:/, req.body
+      end
+    end
+  end
+
+  def test_fragment_root_reads_local_files
+    Net::HTTP.start("localhost", 9997) do |h|
+      # the second time the worker knows which files hold markup without reading them
+      2.times do
+        req = h.get("/local/esi_batch.html")
+        assert_equal Net::HTTPOK, req.header.class
+        assert_equal 3, req.body.scan(%r{<div>test1</div>}).size, req.body
+        assert_match %r{<div>test2</div>}, req.body
+        assert_match %r{<div>test3</div>}, req.body
+        assert_no_match /<esi:/, req.body
+      end
+    end
+  end
+
+  def test_parse_budget_splits_tags_at_the_budget
+    # esi_parse_budget 4k, a tag across each of the first 24 budget boundaries
+    name, expected = markup_page("budget_markup.html", 100_000, (1..24).map {|k| k * 4096 - 5 })
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/budget/#{name}")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_equal expected, req.body
+      assert_equal 8, req.body.scan("<div>test1</div>").size
+    end
+  ensure
+    File.delete("#{DOCROOT}/budget_markup.html") rescue nil
+  end
+
+  def test_max_buffered_page_completes_for_a_slow_client
+    # the text behind the slow include is held, past esi_max_buffered it goes to
+    # a temp file, and so does what the client is slow to read
+    head = %q(<esi:include src="/slow/held.html?ms=300"/>)
+    name, expected = markup_page("spill_markup.html", 400_000, (1..40).map {|k| k * 9000 }, head)
+    expected = expected.sub(head, "<div>slow /held.html</div>")
+    sock = TCPSocket.new("localhost", 9997)
+    sock.write("GET /spill/#{name} HTTP/1.0\r\nHost: localhost\r\n\r\n")
+    response = ""
+    while chunk = (sock.readpartial(4096) rescue nil)
+      response << chunk
+      sleep 0.002
+    end
+    sock.close
+    head, body = response.split("\r\n\r\n", 2)
+    assert_match %r{\AHTTP/1.1 200}, head
+    assert_equal expected.size, body.size
+    assert_equal expected, body
+  ensure
+    File.delete("#{DOCROOT}/spill_markup.html") rescue nil
+  end
+
+  def test_min_file_chunk_boundary
+    page = File.read("#{DOCROOT}/esi_chunks.html")
+    expected = page.gsub(%q(<esi:include src="/test1.html"/>), $fragment_test1).gsub(/<!--esi(.*?)-->/m, '\1')
+    Net::HTTP.start("localhost", 9997) do |h|
+      # 256 bytes of text before the first tag, the first read ends around esi_min_file_chunk
+      (250..262).each do|cut|
+        req = h.get("/pooled_split/esi_chunks.html?cut=#{cut}")
+        assert_equal Net::HTTPOK, req.header.class
+        assert_equal expected, req.body, "page split at #{cut}"
+      end
+    end
+  end
+
+  # writes a page of size bytes to the docroot with a tag starting at each of
+  # offsets, returns its name and what the filter is to make of it
+  def markup_page(name, size, offsets, head = "")
+    tags = [ %q(<esi:include src="/test1.html"/>), %q(<!--esi <b>wrapped</b> -->),
+             %q(<esi:remove><p>removed</p></esi:remove>) ]
+    page = head.dup
+    offsets.each_with_index do|offset,i|
+      page << "filler line\n" while page.size + 12 <= offset
+      page << "f" * (offset - page.size)
+      page << tags[i % tags.size]
+    end
+    page << "filler line\n" while page.size + 12 <= size
+    page << "f" * (size - page.size)
+    File.open("#{DOCROOT}/#{name}", "w") {|f| f << page }
+    expected = page.gsub(%q(<esi:include src="/test1.html"/>), $fragment_test1)
+    expected = expected.gsub(%r{<esi:remove>.*?</esi:remove>}m, "").gsub(/<!--esi(.*?)-->/m, '\1')
+    [name, expected]
+  end
+
+  def test_thread_pool_scan_across_parts
+    # 1.1m is cut in 4 parts of 275000 bytes, a tag across each cut
+    size = 1_100_000
+    step = size / 4
+    offsets = (1..3).map {|k| k * step - 3 } + (1..100).map {|k| k * 10_007 }
+    name, expected = markup_page("threads_markup.html", size, offsets.sort)
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/threads/#{name}")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_equal expected.size, req.body.size
+      assert_equal expected, req.body
+      assert_no_match /<esi:|<!--esi/, req.body
+    end
+  ensure
+    File.delete("#{DOCROOT}/threads_markup.html") rescue nil
+  end
+
+  def test_include_cycle_is_refused
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_cycle.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_equal 1, req.body.scan(%r{<p>cycle</p>}).size, req.body
+      assert_no_match /<esi:/, req.body
+    end
+  end
+
+  def test_include_past_max_depth_is_dropped
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/limits/esi_depth.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match %r{<p>depth1</p>\s*<p>depth2</p>\s*</body>}, req.body
+      assert_no_match /depth3|<esi:/, req.body
+      # without the limit the whole chain is followed
+      req = h.get("/esi_depth.html")
+      assert_match %r{<p>depth1</p>\s*<p>depth2</p>\s*<p>depth3</p>}, req.body
+    end
+  end
+
+  def test_include_past_max_includes_fails_over
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/limits/esi_many.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_equal 4, req.body.scan(%r{<div>test1</div>}).size, req.body
+      assert_match %r{<p>over esi_max_includes</p>}, req.body
+      assert_no_match /<esi:/, req.body
+    end
+  end
+
+  def test_fragments_past_max_bytes_are_dropped
+    Net::HTTP.start("localhost", 9997) do |h|
+      # 17 bytes each, three fit whether they are inline or deferred
+      req = h.get("/max_bytes/esi_bytes.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_equal 3, req.body.scan(%r{<div>test1</div>}).size, req.body
+      assert_no_match /<esi:/, req.body
+    end
+  end
+
+  def test_deferred_fragment_markup_is_processed
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_bigpipe_markup.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match %r{<h1>shell</h1>\n  <div id="esi-pipe-1"></div>}, req.body
+      assert_match %r{<template><p>depth2</p>\s*<p>depth3</p>\s*</template><script>}, req.body
+      assert_no_match /<esi:/, req.body
+    end
+  end
+
+  def test_markup_split_across_fetch_buffers
+    Net::HTTP.start("localhost", 9997) do |h|
+      # the include starts two bytes before the end of the first 8k buffer
+      req = h.get("/pass/esi_split_tag.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match %r{filler line 0340</p>.*<div>test1</div>}m, req.body
+      assert_no_match /<esi:/, req.body
+    end
+  end
+
+  def test_surrogate_control_without_esi_passes_fragment_through
+    leaf = %q(<div>leaf <esi:include src="/test1.html"/><!--esi <b>kept</b> --></div>)
+    expanded = %r{<div>leaf <div>test1</div>\n <b>kept</b> </div>}
+    ["/esi_surrogate.html", "/pass/esi_surrogate.html"].each do |page|
+      Net::HTTP.start("localhost", 9997) do |h|
+        req = h.get(page)
+        assert_equal Net::HTTPOK, req.header.class
+        # no content="ESI/1.0", the fragment is copied byte for byte
+        assert req.body.include?(leaf), "#{page}: #{req.body}"
+        # the same body marked as ESI/1.0 is processed
+        assert_match expanded, req.body, page
+        assert_equal 1, req.body.scan(/<esi:/).size, page
+      end
+    end
+  end
+
+  def test_fragment_served_from_cache
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_test_content.html")
+      assert_equal Net::HTTPOK, req.header.class
+      req = h.get("/_esi/frag/%2Ftest1.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_equal "<div>test1</div>\n", req.body
+      req = h.get("/_esi/frag/%2Fnot-cached.html")
+      assert_equal Net::HTTPNotFound, req.header.class
+    end
+  end
+
+  def test_late_fragment_left_to_the_client
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_fallback.html")
+      assert_equal Net::HTTPOK, req.header.class
+      # the page does not wait for the fragment, the script loads it from esi_fragment
+      assert_match %r{<script>.*"/_esi/frag/%2Fslow%2Flate.html%3Fms%3D1000",0\)</script>\s*<p>end</p>}m, req.body
+      assert_no_match /slow \/late/, req.body
+
+      # the fetch goes on and stores the fragment for the script
+      req = nil
+      20.times do
+        req = h.get("/_esi/frag/%2Fslow%2Flate.html%3Fms%3D1000")
+        break if req.kind_of?(Net::HTTPOK)
+        sleep 0.2
+      end
+      assert_equal Net::HTTPOK, req.header.class
+      assert_equal "<div>slow /late.html</div>", req.body
+    end
+  end
+
+  def test_fragment_built_from_request_variables_is_private
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_private.html", { "Cookie" => "user=alice" })
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match %r{<div>counted /private.html</div>\s*<p>end</p>}, req.body
+      # a late personal fragment is not left to the client, the script could not load it
+      assert_no_match /<script>/, req.body
+
+      # cached for alice's pages, but not served to whoever asks for the key
+      req = h.get("/_esi/frag/%2Fcounted%2Fprivate.html%3Fuser%3Dalice")
+      assert_equal Net::HTTPNotFound, req.header.class
+      req = h.get("/esi_private.html", { "Cookie" => "user=alice" })
+      assert_equal 1, $origin_hits["/private.html"]
+    end
+  end
+
+  def test_origin_status
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_test_content.html")
+      assert_equal Net::HTTPOK, req.header.class
+    end
+    Net::HTTP.start("localhost", 9997) do |h|
+      req = h.get("/esi_status")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match /esi zone "esi"/, req.body
+      assert_match /degraded 0 entered (\d+) left \1\b/, req.body
+      assert_match /origin \/test1.html active 0 queued 0 max_queued \d+ dispatched \d+ rejected 0/, req.body
+      assert_match /fragment \/test1.html samples \d+ p50 \d+ p99 \d+/, req.body
+    end
+  end
+
+  def test_saturated_origin_queues_then_rejects
+    Net::HTTP.start("localhost", 9997) do |h|
+      # the queued include is started as soon as the first one gives back its slot,
+      # with the queue full the third is rejected and left empty
+      req = h.get("/queue/esi_queue.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match %r{<div>slow /first.html</div>\s*<div>slow /queued.html</div>\s*</body>}, req.body
+      assert_no_match /rejected|test1|<esi:/, req.body
+
+      # the wait outlasts esi_origin_queue_timeout, the include falls back to its alt
+      req = h.get("/queue_timeout/esi_queue.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match %r{<div>slow /first.html</div>\s*<div>test1</div>\s*</body>}, req.body
+      assert_no_match /queued|rejected|<esi:/, req.body
+
+      req = h.get("/esi_status")
+      assert_match %r{origin /slow active 0 queued 0 max_queued 1 dispatched \d+ rejected [1-9]}, req.body
+    end
+  end
+
+  def test_cached_fragment
+    bodies = (1..2).map do
+      Net::HTTP.start("localhost", 9997) do |h|
+        req = h.get("/esi_cached.html")
+        assert_equal Net::HTTPOK, req.header.class
+        req.body
+      end
+    end
+    assert_match %r{<div>counted /cached.html</div>}, bodies.last
+    assert_equal bodies.first, bodies.last
+    assert_equal 1, $origin_hits["/cached.html"], "the second page is served from the cache"
+  end
+
+  def test_degraded_mode_tries_alt_of_optional_misses
+    Net::HTTP.start("localhost", 9997) do |h|
+      # two fetches in flight reach esi_degrade_fetches, optional includes after them
+      # only get their alt
+      req = h.get("/esi_degraded.html")
+      assert_equal Net::HTTPOK, req.header.class
+      assert_match %r{<div>slow /one.html</div>\s*<div>slow /two.html</div>\s*<div>test1</div>\s*<p>end</p>}, req.body
+      assert_equal 0, $origin_hits["/degraded.html"]
+      assert_equal 0, $origin_hits["/degraded-no-alt.html"]
+
+      # with no fetches in flight the next page takes the worker out of degraded mode
+      h.get("/esi_test_content.html")
+      req = h.get("/esi_status")
+      assert_match /degraded 0 entered [1-9]/, req.body
+    end
+  end
+
 =begin
   def test_large_document
     Net::HTTP.start("localhost", 9997) do |h|
@@ -123,6 +123,85 @@ class InvalidateHandler < Mongrel::HttpHandler
   end
 end
 
+# stand-in for an origin with a batch endpoint, see esi_batch_pass
+class BatchHandler < Mongrel::HttpHandler
+  include Mongrel::HttpHandlerPlugin
+  def process(request, response)
+    uris = request.params["QUERY_STRING"].to_s.split("&").map do|arg|
+      name, value = arg.split("=", 2)
+      Mongrel::HttpRequest.unescape(value.to_s) if name == "u"
+    end.compact
+
+    response.start(200,true) do |head,out|
+      uris.each do|uri|
+        path = File.join(DOCROOT, uri.sub(%r{\A/fragments/}, "/").split("?").first)
+        if File.file?(path)
+          body = File.read(path)
+          out << "200 #{body.size}\n#{body}"
+        else
+          out << "404 0\n"
+        end
+      end
+    end
+  end
+end
+
+# an origin that takes ?ms= milliseconds to answer
+class SlowHandler < Mongrel::HttpHandler
+  include Mongrel::HttpHandlerPlugin
+  def process(request, response)
+    query = Mongrel::HttpRequest.query_parse(request.params["QUERY_STRING"].to_s)
+    sleep(query["ms"].to_i / 1000.0)
+    response.start(200,true) do |head,out|
+      out << "<div>slow #{request.params["PATH_INFO"]}</div>"
+    end
+  end
+end
+
+# a fragment that looks like ESI, marked as ESI/1.0 only with ?esi=1
+class SurrogateHandler < Mongrel::HttpHandler
+  include Mongrel::HttpHandlerPlugin
+  def process(request, response)
+    query = Mongrel::HttpRequest.query_parse(request.params["QUERY_STRING"].to_s)
+    response.start(200,true) do |head,out|
+      head["Content-Type"] = "text/html"
+      head["Surrogate-Control"] = query["esi"] ? %q(max-age=0, content="ESI/1.0") : %q(max-age=0)
+      out << %q(<div>leaf <esi:include src="/test1.html"/><!--esi <b>kept</b> --></div>)
+    end
+  end
+end
+
+# counts the requests reaching the origin for each path
+$origin_hits = Hash.new(0)
+class CountingHandler < Mongrel::HttpHandler
+  include Mongrel::HttpHandlerPlugin
+  def process(request, response)
+    path = request.params["PATH_INFO"]
+    $origin_hits[path] += 1
+    response.start(200,true) do |head,out|
+      out << "<div>counted #{path}</div>"
+    end
+  end
+end
+
+# sends a docroot page in two writes cut at ?cut= bytes, nginx reads them as two buffers
+class SplitHandler < Mongrel::HttpHandler
+  include Mongrel::HttpHandlerPlugin
+  def process(request, response)
+    query = Mongrel::HttpRequest.query_parse(request.params["QUERY_STRING"].to_s)
+    body = File.read(File.join(DOCROOT, request.params["PATH_INFO"]))
+    cut = query["cut"].to_i
+    response.status = 200
+    response.header["Content-Type"] = "text/html"
+    response.send_status(body.size)
+    response.send_header
+    response.write(body[0, cut])
+    sleep 0.02
+    response.write(body[cut..-1])
+    response.done = true
+  end
+end
+
 $fragment_test1 = File.open("#{DOCROOT}/test1.html").read
 $fragment_test2 = File.open("#{DOCROOT}/content/test2.html").read
 
@@ -144,7 +223,12 @@ module ESI
           { :uri => '/404', :handler => Basic404Handler.new },
           { :uri => '/404-no-surrogate', :handler => Basic404HandlerWithoutHeader.new },
           { :uri => '/invalidate', :handler => InvalidateHandler.new },
-          { :uri => '/500', :handler => Basic500Handler.new }
+          { :uri => '/500', :handler => Basic500Handler.new },
+          { :uri => '/batch', :handler => BatchHandler.new },
+          { :uri => '/slow', :handler => SlowHandler.new },
+          { :uri => '/counted', :handler => CountingHandler.new },
+          { :uri => '/split', :handler => SplitHandler.new },
+          { :uri => '/surrogate', :handler => SurrogateHandler.new }
         ]
       }
     ]